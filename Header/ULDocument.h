@@ -37,6 +37,65 @@ typedef enum : NSUInteger {
 	ULDocumentSaveTo	= 3
 } ULDocumentSaveOperation;
 
+/*!
+ @abstract The kind of interactions a document performs with the file system.
+ 
+ @const ULDocumentInteractionOpen					Opening the document through -openWithCompletionHandler:.
+ @const ULDocumentInteractionSave					Any save operation, including autosaves and moves caused by saving.
+ @const ULDocumentInteractionRevert					Reverting the document to the contents on disk.
+ @const ULDocumentInteractionClose					Closing the document through -closeWithCompletionHandler:.
+ @const ULDocumentInteractionDelete					Deleting the document through -deleteWithCompletionHandler:.
+ @const ULDocumentInteractionReplaceVersion			Replacing the document with a file version.
+ @const ULDocumentInteractionChangeNotification		Reconciling a change notification of the file presenter with the contents on disk.
+ */
+typedef enum : NSUInteger {
+	ULDocumentInteractionOpen					= 0,
+	ULDocumentInteractionSave					= 1,
+	ULDocumentInteractionRevert					= 2,
+	ULDocumentInteractionClose					= 3,
+	ULDocumentInteractionDelete					= 4,
+	ULDocumentInteractionReplaceVersion			= 5,
+	ULDocumentInteractionChangeNotification		= 6,
+	
+	ULDocumentInteractionCount
+} ULDocumentInteraction;
+
+/*!
+ @abstract The priority classes of the interactions queued for a document.
+ 
+ @const ULDocumentInteractionPriorityUserInitiated		Interactions the user is waiting for, like opening, explicit saves, closing and deleting. Overtake queued autosaves.
+ @const ULDocumentInteractionPriorityAutosave			Autosaves and other background maintenance.
+ @const ULDocumentInteractionPriorityReconciliation		Reverts and other reconciliations of external changes. Executed after all interactions queued before them.
+ */
+typedef enum : NSUInteger {
+	ULDocumentInteractionPriorityUserInitiated		= 0,
+	ULDocumentInteractionPriorityAutosave			= 1,
+	ULDocumentInteractionPriorityReconciliation		= 2,
+	
+	ULDocumentInteractionPriorityCount
+} ULDocumentInteractionPriority;
+
+/*!
+ @abstract The time interactions of a priority class waited for preceding interactions of the same document.
+ */
+typedef struct {
+	NSUInteger		count;					// Number of interactions started
+	NSTimeInterval	totalDuration;			// Sum of all wait times
+	NSTimeInterval	maximumDuration;		// Longest wait time
+} ULDocumentInteractionWaitStatistics;
+
+/*!
+ @abstract The effectiveness of prefetching sibling documents.
+ */
+typedef struct {
+	NSUInteger			prefetchedCount;		// Number of documents whose files have been warmed
+	unsigned long long	prefetchedBytes;		// Bytes the page cache has been advised to read
+	NSUInteger			hitCount;				// Number of opened documents that have been prefetched
+	NSUInteger			missCount;				// Number of opened documents that have not been prefetched
+	unsigned long long	wastedBytes;			// Prefetched bytes of documents that have been dropped from the prediction without being opened
+	NSUInteger			readAheadHitCount;		// Number of opened documents that used contents read ahead of time instead of reading their file
+} ULDocumentPrefetchStatistics;
+
 /*!
  @abstract A notification that is sent whenever an error during a save operation was not handled.
  @discussion The passed object contains the errorneous instance of ULDocument. The error message can be accessed from the userInfo of the notification using the key ULDocumentUnhandeledSaveErrorNotificationErrorKey.
@@ -48,6 +107,34 @@ extern NSString *ULDocumentUnhandeledSaveErrorNotification;
  */
 extern NSString *ULDocumentUnhandeledSaveErrorNotificationErrorKey;
 
+/*!
+ @abstract A notification that is sent whenever a document interaction exceeds its maximum duration.
+ @discussion The passed object contains the stalled instance of ULDocument. The notification is sent once per interaction, while the interaction is still running. Use the ULDocumentStalledInteractionNotification…Key constants to access the details from the userInfo of the notification. Stalled save operations are additionally notified through ULDocumentUnhandeledSaveErrorNotification.
+ */
+extern NSString *ULDocumentStalledInteractionNotification;
+
+/*!
+ @abstract References an NSNumber containing the ULDocumentInteraction that stalled.
+ */
+extern NSString *ULDocumentStalledInteractionNotificationInteractionKey;
+
+/*!
+ @abstract References an NSNumber containing the time in seconds the interaction has been running so far.
+ */
+extern NSString *ULDocumentStalledInteractionNotificationDurationKey;
+
+/*!
+ @abstract References the NSFileCoordinator the interaction is blocked in. Not set, if the interaction is not waiting for file coordination.
+ */
+extern NSString *ULDocumentStalledInteractionNotificationCoordinatorKey;
+
+/*!
+ @abstract References an NSNumber containing the time in seconds the interaction has been waiting for its file coordinator.
+ */
+extern NSString *ULDocumentStalledInteractionNotificationCoordinationDurationKey;
+
+
+@class ULDocumentFlushReport;
 
 /*!
  @abstract Abstract document class like NSDocument, modelled after UIDocument for headless operation.
@@ -84,6 +171,88 @@ extern NSString *ULDocumentUnhandeledSaveErrorNotificationErrorKey;
  */
 + (void)setAutoversioningInterval:(NSTimeInterval)interval;
 
+/*!
+ @abstract Allows clients to globally configure the maximum duration of a certain kind of document interaction.
+ @discussion Interactions exceeding their maximum duration are reported by a ULDocumentStalledInteractionNotification. The duration includes the time an interaction is waiting for preceding interactions of the same document. Defaults to 60 seconds for all interactions. Passing 0 disables the supervision of an interaction.
+ */
++ (void)setMaximumDuration:(NSTimeInterval)duration forInteraction:(ULDocumentInteraction)interaction;
+
+/*!
+ @abstract Allows clients to globally configure the time granted for saving all documents with pending changes when the application terminates.
+ @discussion Documents are saved in parallel through +flushAllDocumentsWithDeadline:. Documents that could not be saved in time are reported in the log. Defaults to 10 seconds. Passing 0 waits until all documents have been saved, which may block termination indefinitely.
+ */
++ (void)setTerminationFlushDuration:(NSTimeInterval)duration;
+
+/*!
+ @abstract Synchronously saves all documents of the receiving class that have pending autosaves.
+ @discussion Each save is performed as user-initiated interaction of its document, so it is ordered with all other interactions of the document. The documents are saved in parallel, starting with the most recently changed documents. Saves are not started after the deadline passed, and the method returns at the latest when the deadline is reached. Saves still running at this point are continued in background but are reported as unfinished. Passing nil waits until all documents have been saved.
+ */
++ (ULDocumentFlushReport *)flushAllDocumentsWithDeadline:(NSDate *)deadline;
+
+/*!
+ @abstract Allows clients to globally configure the time after which clean documents that have not been accessed hibernate.
+ @discussion Only applies to document classes supporting hibernation. Clean documents of these classes hibernate under memory pressure as well. Defaults to 0, which disables hibernation of idle documents.
+ */
++ (void)setHibernationIdleInterval:(NSTimeInterval)interval;
+
+/*!
+ @abstract Moves or renames many documents using a single file coordination.
+ @discussion Document i is moved to URL i, after all interactions queued for it so far have been completed. Interactions queued afterwards wait for the batch to finish. Documents already located at their URL are skipped. Unsaved changes are not written, but autosaved to the new URL later. Calls -didChangeFileURLBySaving for each moved document. The completionHandler will be called on a background queue. Passes NO if any document could not be moved.
+ */
++ (void)moveDocuments:(NSArray *)documents toURLs:(NSArray *)urls completionHandler:(void (^)(BOOL success))completionHandler;
+
+/*!
+ @abstract Moves or renames many documents using a single file coordination, calling the completionHandler on the passed queue.
+ @discussion See +moveDocuments:toURLs:completionHandler:. Passing a nil queue calls the completionHandler directly from the queue performing the move. It must thus be short.
+ */
++ (void)moveDocuments:(NSArray *)documents toURLs:(NSArray *)urls completionQueue:(dispatch_queue_t)queue completionHandler:(void (^)(BOOL success))completionHandler;
+
+/*!
+ @abstract Opens many documents, calling a single completionHandler after all of them have been opened.
+ @discussion The documents are opened in parallel. Passes the documents that could not be opened, in no particular order. The completionHandler is called like by -openWithCompletionQueue:completionHandler:.
+ */
++ (void)openDocuments:(NSArray *)documents completionQueue:(dispatch_queue_t)queue completionHandler:(void (^)(NSArray *failedDocuments))completionHandler;
+
+/*!
+ @abstract Autosaves many documents, calling a single completionHandler after all of them have been saved.
+ @discussion See +openDocuments:completionQueue:completionHandler:. Passes the documents that could not be saved.
+ */
++ (void)autosaveDocuments:(NSArray *)documents completionQueue:(dispatch_queue_t)queue completionHandler:(void (^)(NSArray *failedDocuments))completionHandler;
+
+/*!
+ @abstract Closes many documents, calling a single completionHandler after all of them have been closed.
+ @discussion See +openDocuments:completionQueue:completionHandler:. Passes the documents whose changes could not be saved.
+ */
++ (void)closeDocuments:(NSArray *)documents completionQueue:(dispatch_queue_t)queue completionHandler:(void (^)(NSArray *failedDocuments))completionHandler;
+
+/*!
+ @abstract The time interactions of all documents waited for preceding interactions, per priority class.
+ @discussion Intended for diagnostics, e.g. to verify that user-initiated interactions are not delayed by background work under load.
+ */
++ (ULDocumentInteractionWaitStatistics)waitStatisticsForInteractionPriority:(ULDocumentInteractionPriority)priority;
+
+/*!
+ @abstract Discards all recorded wait statistics.
+ */
++ (void)resetWaitStatistics;
+
+/*!
+ @abstract Allows clients to globally configure the number of sibling documents prefetched whenever a document is opened.
+ @discussion Siblings are the documents with the same path extension inside the same folder, ordered like in the Finder. The direction of browsing is derived from the previously opened sibling. Prefetching warms the page cache for the files of the siblings on a background queue. iCloud documents that have not been downloaded are skipped. Defaults to 0, which disables prefetching.
+ */
++ (void)setSiblingPrefetchCount:(NSUInteger)count;
+
+/*!
+ @abstract Allows clients to globally configure the number of bytes of prefetched siblings that are read ahead of time.
+ @discussion Prefetched siblings are read into file wrappers, which are kept in a cache that is purged under memory pressure. If the file did not change since, the next open passes the cached file wrapper to -readFromFileWrapper:error: instead of reading the file. Only applies to document classes using the default implementation of -readFromURL:error:. Has no effect unless sibling prefetching is enabled. Defaults to 0, which disables reading ahead of time.
+ */
++ (void)setReadAheadCacheLimit:(NSUInteger)limit;
+
+/*!
+ @abstract The effectiveness of sibling prefetching since the prefetch count has been configured.
+ */
++ (ULDocumentPrefetchStatistics)prefetchStatistics;
+
 
 #pragma mark - General properties
 
@@ -150,6 +319,12 @@ extern NSString *ULDocumentUnhandeledSaveErrorNotificationErrorKey;
  */
 @property(readonly) NSError *lastWriteError;
 
+/*!
+ @abstract The number of interactions (opening, saving, reverting etc.) that are currently queued or running.
+ @discussion Intended for diagnostics, e.g. to observe the backlog of documents under load. Might change asynchronously.
+ */
+@property(readonly) NSUInteger pendingInteractionCount;
+
 
 #pragma mark - Document lifecycle
 
@@ -159,30 +334,115 @@ extern NSString *ULDocumentUnhandeledSaveErrorNotificationErrorKey;
  */
 - (void)openWithCompletionHandler:(void (^)(BOOL success))completionHandler;
 
+/*!
+ @abstract Open the document, calling the completionHandler on the passed queue.
+ @discussion See -openWithCompletionHandler:. Passing a nil queue calls the completionHandler directly from the document's interaction queue, or from the calling thread if the document does not need to be opened. This avoids a thread hop, but further interactions of the document wait until the completionHandler returned. It must thus be short and must not wait for other interactions of the document.
+ */
+- (void)openWithCompletionQueue:(dispatch_queue_t)queue completionHandler:(void (^)(BOOL success))completionHandler;
+
 /*!
  @abstract Explicitly save the document to disk.
  @discussion Unlike the autosave happening after any changes, this method not only saves the contents but (on Mac OS) also creates a new version of the file on disk. The completionHandler will be called on a background queue. Passes NO to the completion handler, if an error occured. The error code will be set to lastWriteError. If an error occurs and no completion handler is provided a ULDocumentUnhandeledSaveErrorNotification is posted.
  */
 - (void)saveWithCompletionHandler:(void (^)(BOOL success))completionHandler;
 
+/*!
+ @abstract Explicitly save the document to disk, calling the completionHandler on the passed queue.
+ @discussion See -saveWithCompletionHandler:. The completionHandler is called like by -openWithCompletionQueue:completionHandler:.
+ */
+- (void)saveWithCompletionQueue:(dispatch_queue_t)queue completionHandler:(void (^)(BOOL success))completionHandler;
+
 /*!
  @abstract Saves the document's current state to the fileURL.
- @discussion This method does usually not have to called directly. The completionHandler will be called on a background queue. Passes NO to the completion handler, if an error occured. The error code will be set to lastWriteError. If an error occurs and no completion handler is provided a ULDocumentUnhandeledSaveErrorNotification is posted. Autosave is only performed if hasUnsavedChanges returns YES.
+ @discussion This method does usually not have to called directly. The completionHandler will be called on a background queue. Passes NO to the completion handler, if an error occured. The error code will be set to lastWriteError. If an error occurs and no completion handler is provided a ULDocumentUnhandeledSaveErrorNotification is posted. Autosave is only performed if hasUnsavedChanges returns YES. Passes NO without saving, if the document has no location to autosave to.
  */
 - (void)autosaveWithCompletionHandler:(void (^)(BOOL success))completionHandler;
 
+/*!
+ @abstract Autosave the document, calling the completionHandler on the passed queue.
+ @discussion See -autosaveWithCompletionHandler:. The completionHandler is called like by -openWithCompletionQueue:completionHandler:.
+ */
+- (void)autosaveWithCompletionQueue:(dispatch_queue_t)queue completionHandler:(void (^)(BOOL success))completionHandler;
+
 /*!
  @abstract Close the document.
  @discussion Calls [self autosaveWithCompletionHandler:completionHandler] which will save if [self hasUnsavedChanges] returns YES. The completionHandler will be called on a background queue. If an error occurs and no completion handler is provided a ULDocumentUnhandeledSaveErrorNotification is posted.
  */
 - (void)closeWithCompletionHandler:(void (^)(BOOL success))completionHandler;
 
+/*!
+ @abstract Close the document, calling the completionHandler on the passed queue.
+ @discussion See -closeWithCompletionHandler:. The completionHandler is called like by -openWithCompletionQueue:completionHandler:.
+ */
+- (void)closeWithCompletionQueue:(dispatch_queue_t)queue completionHandler:(void (^)(BOOL success))completionHandler;
+
 /*!
  @abstract Delete the document.
  @discussion Deletes the item at the document's current file URL and as a result also closes the document. The completionHandler will be called on a background queue.
  */
 - (void)deleteWithCompletionHandler:(void (^)(BOOL success))completionHandler;
 
+/*!
+ @abstract Delete the document, calling the completionHandler on the passed queue.
+ @discussion See -deleteWithCompletionHandler:. The completionHandler is called like by -openWithCompletionQueue:completionHandler:.
+ */
+- (void)deleteWithCompletionQueue:(dispatch_queue_t)queue completionHandler:(void (^)(BOOL success))completionHandler;
+
+
+#pragma mark - Hibernation
+
+/*!
+ @abstract Whether the document has released its contents to save memory.
+ @discussion A hibernating document stays open and keeps presenting its file. Its contents are reloaded by -beginContentAccess and before saving. See +supportsHibernation.
+ */
+@property(readonly) BOOL isHibernating;
+
+/*!
+ @abstract Hibernates the document, if its class supports hibernation, it is open, has no unsaved changes and its contents are not being accessed.
+ @discussion The completionHandler will be called on a background queue. Passes YES, if the document is hibernating.
+ */
+- (void)hibernateWithCompletionHandler:(void (^)(BOOL success))completionHandler;
+
+/*!
+ @abstract Hibernates the document, calling the completionHandler on the passed queue.
+ @discussion See -hibernateWithCompletionHandler:. The completionHandler is called like by -openWithCompletionQueue:completionHandler:.
+ */
+- (void)hibernateWithCompletionQueue:(dispatch_queue_t)queue completionHandler:(void (^)(BOOL success))completionHandler;
+
+/*!
+ @abstract Marks the begin of an access to the document's contents, reloading them synchronously if the document is hibernating.
+ @discussion Documents do not hibernate while their contents are being accessed. Each successful call must be balanced by -endContentAccess. Returns NO if the contents could not be reloaded. The error will be set to lastReadError.
+ 
+ Waking up a hibernating document blocks the calling thread until all interactions enqueued before have finished and the contents have been read, which may include waiting for file coordination. Use -beginContentAccessWithCompletionHandler: on the main thread if the document may hibernate.
+ */
+- (BOOL)beginContentAccess;
+
+/*!
+ @abstract Marks the begin of an access to the document's contents, reloading them asynchronously if the document is hibernating.
+ @discussion Behaves like -beginContentAccess without blocking. If the document is awake, the completionHandler is called immediately on the calling thread. Otherwise it is called on a background queue once the contents have been reloaded. Each access that passes YES must be balanced by -endContentAccess.
+ */
+- (void)beginContentAccessWithCompletionHandler:(void (^)(BOOL success))completionHandler;
+
+/*!
+ @abstract Marks the end of an access to the document's contents. Idle documents hibernate after the interval configured by +setHibernationIdleInterval: has passed since their last access.
+ */
+- (void)endContentAccess;
+
+
+#pragma mark - Snapshots
+
+/*!
+ @abstract Creates a read-only instance with the current in-memory contents of the receiver, including unsaved changes.
+ @discussion Intended for exports and previews of open documents. The snapshot is created after all pending interactions of the receiver without reading from disk. Contents are passed by -copyContentsToSnapshot:error:, so the snapshot only shares model objects with the receiver if the document class implements sharing. Otherwise the contents are copied, which costs about as much as serializing and parsing the document. The snapshot is open, reports the changeToken the receiver had when taking the snapshot and does not receive any subsequent changes. The completionHandler will be called on a background queue. Passes nil if the receiver is not open or its contents could not be copied.
+ */
+- (void)makeReadOnlySnapshotWithCompletionHandler:(void (^)(id snapshot))completionHandler;
+
+/*!
+ @abstract Creates a read-only snapshot of the document, calling the completionHandler on the passed queue.
+ @discussion See -makeReadOnlySnapshotWithCompletionHandler:. The completionHandler is called like by -openWithCompletionQueue:completionHandler:.
+ */
+- (void)makeReadOnlySnapshotWithCompletionQueue:(dispatch_queue_t)queue completionHandler:(void (^)(id snapshot))completionHandler;
+
 
 #pragma mark - Advanced reading and writing
 
@@ -203,6 +463,12 @@ extern NSString *ULDocumentUnhandeledSaveErrorNotificationErrorKey;
  */
 - (void)saveToURL:(NSURL *)url forSaveOperation:(ULDocumentSaveOperation)saveOperation completionHandler:(void (^)(BOOL success))completionHandler;
 
+/*!
+ @abstract Initiates a save, calling the completionHandler on the passed queue.
+ @discussion See -saveToURL:forSaveOperation:completionHandler:. The completionHandler is called like by -openWithCompletionQueue:completionHandler:.
+ */
+- (void)saveToURL:(NSURL *)url forSaveOperation:(ULDocumentSaveOperation)saveOperation completionQueue:(dispatch_queue_t)queue completionHandler:(void (^)(BOOL success))completionHandler;
+
 /*!
  @abstract Synchronously write the document to the specified URL.
  @discussion Will synchronously write the document to disk, updating the document's fileURL upon successful completion. Depending on the save operation, a new version will be added to the versions store or not. If the passed URL differs from the documents current file URL, and depending on the operation, the current item will first be moved to the passed URL before being overwritten. Should not be called directly if asynchronous saving is possible. If an error occurs and no output argument 'error' is provided a ULDocumentUnhandeledSaveErrorNotification is posted.
@@ -215,6 +481,12 @@ extern NSString *ULDocumentUnhandeledSaveErrorNotificationErrorKey;
  */
 - (void)revertToContentsOfURL:(NSURL *)url completionHandler:(void (^)(BOOL success))completionHandler;
 
+/*!
+ @abstract Resets the document to the file at the specified URL, calling the completionHandler on the passed queue.
+ @discussion See -revertToContentsOfURL:completionHandler:. The completionHandler is called like by -openWithCompletionQueue:completionHandler:.
+ */
+- (void)revertToContentsOfURL:(NSURL *)url completionQueue:(dispatch_queue_t)queue completionHandler:(void (^)(BOOL success))completionHandler;
+
 /*!
  @abstract Synchronously write the document to the specified URL.
  @discussion WARNING: This method does not do any file coordination but expects the caller to do so! Will synchronously write the document to disk, updating the document's fileURL upon successful completion. Depending on the save operation, a new version will be added to the versions store or not. Should rarely be called directly.
@@ -260,3 +532,41 @@ extern NSString *ULDocumentUnhandeledSaveErrorNotificationErrorKey;
 + (BOOL)usesConsistentPersistenceFormat;
 
 @end
+
+
+/*!
+ @abstract Describes the outcome of +[ULDocument flushAllDocumentsWithDeadline:].
+ */
+@interface ULDocumentFlushReport : NSObject
+
+/*!
+ @abstract The documents that have been saved before the deadline, in order of completion.
+ */
+@property(readonly) NSArray *savedDocuments;
+
+/*!
+ @abstract The documents that failed to save before the deadline, in order of completion.
+ */
+@property(readonly) NSArray *failedDocuments;
+
+/*!
+ @abstract The documents that were still saving or have not been started when the deadline passed, in order of priority.
+ */
+@property(readonly) NSArray *unfinishedDocuments;
+
+/*!
+ @abstract The time from starting the flush until all saves completed or the deadline passed.
+ */
+@property(readonly) NSTimeInterval duration;
+
+/*!
+ @abstract Whether all documents have been saved successfully before the deadline.
+ */
+@property(readonly) BOOL isComplete;
+
+/*!
+ @abstract The error of a document listed in failedDocuments. Might be nil if the document did not provide an error.
+ */
+- (NSError *)errorForDocument:(ULDocument *)document;
+
+@end
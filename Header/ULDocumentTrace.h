@@ -0,0 +1,204 @@
+//
+//  ULDocumentTrace.h
+//
+//  Copyright © 2018 Ulysses GmbH & Co. KG
+//
+//	Permission is hereby granted, free of charge, to any person obtaining a copy
+//	of this software and associated documentation files (the "Software"), to deal
+//	in the Software without restriction, including without limitation the rights
+//	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//	copies of the Software, and to permit persons to whom the Software is
+//	furnished to do so, subject to the following conditions:
+//
+//	The above copyright notice and this permission notice shall be included in
+//	all copies or substantial portions of the Software.
+//
+//	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//	THE SOFTWARE.
+//
+
+#import "ULDocument.h"
+
+@class ULDocumentTraceSnapshot, ULDocumentTraceHistogram, ULDocumentTraceEvent;
+
+/*!
+ @abstract The phases a document interaction is split into by the tracing.
+
+ @const ULDocumentTracePhaseInteraction			The entire coordinated part of an interaction, including all other phases.
+ @const ULDocumentTracePhaseCoordinationWait	Time spent waiting for file coordination to be granted.
+ @const ULDocumentTracePhaseReading				Reading the document's contents through -readFromURL:error:.
+ @const ULDocumentTracePhaseSerialization		Creating the representation for writing through -fileWrapperWithError:.
+ @const ULDocumentTracePhaseWriting				Writing the file wrapper to disk.
+ @const ULDocumentTracePhaseAttributeRestore	Restoring preserved file attributes after writing.
+ @const ULDocumentTracePhaseChangeToken			Computing change tokens from the file system.
+ @const ULDocumentTracePhaseVersionStore		Preserving old contents and adding them to the version store.
+ */
+typedef enum : NSUInteger {
+	ULDocumentTracePhaseInteraction			= 0,
+	ULDocumentTracePhaseCoordinationWait	= 1,
+	ULDocumentTracePhaseReading				= 2,
+	ULDocumentTracePhaseSerialization		= 3,
+	ULDocumentTracePhaseWriting				= 4,
+	ULDocumentTracePhaseAttributeRestore	= 5,
+	ULDocumentTracePhaseChangeToken			= 6,
+	ULDocumentTracePhaseVersionStore		= 7,
+
+	ULDocumentTracePhaseCount
+} ULDocumentTracePhase;
+
+/*!
+ @abstract Records the latency of document interactions and their phases.
+ @discussion Tracing is disabled by default and should be enabled during launch, before any documents are opened. While enabled, each phase is recorded into a per-thread ring buffer that keeps the most recent events, and into a fixed-bucket latency histogram per interaction and phase. Recording a phase takes no contended locks and, once the calling thread's buffer has been allocated on its first event, allocates no memory. Notices are different: each one allocates its message and record and is appended to a shared list under a lock, so they should not be used on hot paths. Unless the host provides its own ULNotice macros, notices also record the file accessed by each interaction.
+ */
+@interface ULDocumentTrace : NSObject
+
+/*!
+ @abstract Enables or disables the tracing of all documents.
+ */
++ (void)setEnabled:(BOOL)enabled;
+
+/*!
+ @abstract Whether tracing is currently enabled.
+ */
++ (BOOL)isEnabled;
+
+/*!
+ @abstract Captures the current histograms and the recent events of all threads.
+ */
++ (ULDocumentTraceSnapshot *)snapshot;
+
+/*!
+ @abstract Discards all recorded histograms and events.
+ */
++ (void)reset;
+
+@end
+
+
+/*!
+ @abstract A consistent copy of all recorded tracing information at a certain point in time.
+ */
+@interface ULDocumentTraceSnapshot : NSObject
+
+/*!
+ @abstract The histogram of a phase during a certain kind of interaction.
+ */
+- (ULDocumentTraceHistogram *)histogramForPhase:(ULDocumentTracePhase)phase ofInteraction:(ULDocumentInteraction)interaction;
+
+/*!
+ @abstract The histogram of a phase aggregated over all kinds of interactions.
+ @discussion Includes phases that happened outside of any interaction, e.g. change token computations for move notifications.
+ */
+- (ULDocumentTraceHistogram *)histogramForPhase:(ULDocumentTracePhase)phase;
+
+/*!
+ @abstract The most recent events of all threads, ordered by their start time.
+ @discussion Contains instances of ULDocumentTraceEvent.
+ */
+@property(nonatomic, readonly) NSArray *events;
+
+/*!
+ @abstract Serializes the events of the snapshot into the Chrome trace event format.
+ @discussion The result can be loaded into chrome://tracing or compatible viewers.
+ */
+- (NSData *)chromeTraceEventData;
+
+/*!
+ @abstract Writes the events of the snapshot to the passed URL using the Chrome trace event format.
+ */
+- (BOOL)writeChromeTraceEventsToURL:(NSURL *)url error:(NSError **)outError;
+
+@end
+
+
+/*!
+ @abstract A latency histogram with fixed, exponentially growing buckets.
+ @discussion Bucket 0 counts durations below one microsecond, each further bucket doubles the upper bound of its predecessor.
+ */
+@interface ULDocumentTraceHistogram : NSObject
+
+/*!
+ @abstract The number of buckets of each histogram.
+ */
++ (NSUInteger)bucketCount;
+
+/*!
+ @abstract The exclusive upper bound of a bucket in seconds.
+ */
++ (NSTimeInterval)upperBoundOfBucket:(NSUInteger)bucket;
+
+/*!
+ @abstract The number of recorded durations.
+ */
+@property(nonatomic, readonly) NSUInteger count;
+
+/*!
+ @abstract The sum of all recorded durations.
+ */
+@property(nonatomic, readonly) NSTimeInterval totalDuration;
+
+/*!
+ @abstract The longest recorded duration.
+ */
+@property(nonatomic, readonly) NSTimeInterval maximumDuration;
+
+/*!
+ @abstract The number of durations recorded for each bucket, as NSNumbers.
+ */
+@property(nonatomic, readonly) NSArray *bucketCounts;
+
+/*!
+ @abstract Estimates the duration below which the given fraction (0...1) of all recorded durations lies.
+ @discussion Returns the upper bound of the bucket containing the percentile, capped by the maximum duration. Returns 0 if nothing was recorded.
+ */
+- (NSTimeInterval)durationAtPercentile:(double)percentile;
+
+@end
+
+
+/*!
+ @abstract A single recorded phase or notice.
+ */
+@interface ULDocumentTraceEvent : NSObject
+
+/*!
+ @abstract The recorded phase. Undefined for notices.
+ */
+@property(nonatomic, readonly) ULDocumentTracePhase phase;
+
+/*!
+ @abstract The interaction the phase was part of. ULDocumentInteractionCount if the phase happened outside of an interaction.
+ */
+@property(nonatomic, readonly) ULDocumentInteraction interaction;
+
+/*!
+ @abstract The start time relative to the first enabling of the tracing.
+ */
+@property(nonatomic, readonly) NSTimeInterval startTime;
+
+/*!
+ @abstract The duration of the phase. Zero for notices.
+ */
+@property(nonatomic, readonly) NSTimeInterval duration;
+
+/*!
+ @abstract A process-unique number of the recording thread.
+ */
+@property(nonatomic, readonly) NSUInteger threadIdentifier;
+
+/*!
+ @abstract An opaque identifier of the document instance the event belongs to. Zero if unknown.
+ */
+@property(nonatomic, readonly) NSUInteger documentIdentifier;
+
+/*!
+ @abstract The message of a notice. Nil for phases.
+ */
+@property(nonatomic, readonly) NSString *message;
+
+@end
@@ -91,6 +91,81 @@ typedef enum : NSUInteger {
  */
 + (BOOL)shouldHandleSubitemChanges;
 
+/*!
+ @abstract Specifies that package contents are stored in a single container file instead of a directory.
+ @discussion Defaults to NO. Applies to documents serialized as directory file wrappers by the default implementations of -readFromURL:error: and -writeToURL:forSaveOperation:originalContentsURL:error:. -readFromFileWrapper:error: still receives a directory file wrapper. Saves append changed files to the container and periodically compact it. Existing package directories remain readable and are converted by their next save. The document type should be declared as flat file and +shouldHandleSubitemChanges is not required.
+ */
++ (BOOL)usesContainerStorage;
+
+/*!
+ @abstract Whether the fingerprint of the contents is already computed when the document is opened.
+ @discussion Defaults to NO. Saves and autosaves are skipped if the serialized contents match the contents persisted at the document's URL, which is detected by a fingerprint of the contents last written. Returning YES also fingerprints the contents read by -readFromURL:error:, so even the first save after opening can be skipped. This reads all lazily loaded contents and hashes them on each open. Contents read ahead of time by sibling prefetching are always fingerprinted.
+ */
++ (BOOL)fingerprintsContentsWhenOpening;
+
+
+#pragma mark - Hibernation
+
+/*!
+ @abstract Whether clean documents may release their contents under memory pressure or when idle.
+ @discussion Defaults to NO. Subclasses returning YES must implement -releaseContentsForHibernation and bracket all accesses to their contents by -beginContentAccess and -endContentAccess, including changes.
+ */
++ (BOOL)supportsHibernation;
+
+/*!
+ @abstract Releases the in-memory contents of a document that starts hibernating.
+ @discussion Called on a background queue, after the undo stack has been cleared. May return a compact form of the contents, e.g. compressed data, which is kept in a cache that is purged under memory pressure. If the file did not change until the document wakes up, the cached form is passed to -restoreContentsFromHibernationCache:error: instead of reading the file. Must be overridden by subclasses supporting hibernation.
+ */
+- (id)releaseContentsForHibernation;
+
+/*!
+ @abstract Restores the contents from a form returned by -releaseContentsForHibernation.
+ @discussion Returning NO reads the contents from the file instead. The default implementation returns NO.
+ */
+- (BOOL)restoreContentsFromHibernationCache:(id)cache error:(NSError **)outError;
+
+
+#pragma mark - Snapshots
+
+/*!
+ @abstract Passes the in-memory contents to a read-only snapshot of the document.
+ @discussion Called by -makeReadOnlySnapshotWithCompletionHandler: on a background queue. The default implementation is only a fallback that copies the contents: it serializes them using -fileWrapperWithError: and parses them by -readFromFileWrapper:error: of the snapshot. This does not touch the disk, but costs about as much as a save and an open, and the snapshot holds a second copy of the model. It fails for classes overriding -readFromURL:error: or -writeToURL:forSaveOperation:originalContentsURL:error:. Subclasses taking snapshots of large documents must override this method to share immutable model objects with the snapshot and copy mutable ones lazily on their next change. Returns YES on success or NO and an error otherwise.
+ */
+- (BOOL)copyContentsToSnapshot:(id)snapshot error:(NSError **)outError;
+
+
+#pragma mark - Edit journal
+
+/*!
+ @abstract Whether documents keep a write-ahead journal of changes that have not been saved yet.
+ @discussion Defaults to NO. A journal allows long autosave delays without risking the loss of changes on crashes. If YES, subclasses must append a record for each change using -appendJournalRecord: and implement -replayJournalRecord:error:.
+ */
++ (BOOL)usesEditJournal;
+
+/*!
+ @abstract The directory used for edit journals.
+ @discussion Defaults to the folder "Edit Journals" inside the application support directory of the application. Journals are named after a hash of the document's path and follow the document if it is moved.
+ */
++ (NSURL *)editJournalDirectoryURL;
+
+/*!
+ @abstract Appends a compact record of a change to the edit journal, e.g. whenever an undo group has been closed.
+ @discussion Records are written in batches that are synchronized to permanent storage shortly after. Records are removed as soon as a save containing the change succeeded. Does nothing if +usesEditJournal returns NO.
+ */
+- (void)appendJournalRecord:(NSData *)record;
+
+/*!
+ @abstract Notes that all records appended to the edit journal so far are part of the contents being serialized.
+ @discussion May be called by -fileWrapperWithError: or -writeToURL:forSaveOperation:originalContentsURL:error: at the point the contents are captured, under the same synchronization that orders changes with -appendJournalRecord:. A successful save only removes the records appended before. If not called, all records appended until serialization returned are treated as saved, so changes are never replayed twice. Changes appended after the contents have been captured then remain unsaved in memory until the next save, but are no longer journaled.
+ */
+- (void)markJournalRecordsAsSerialized;
+
+/*!
+ @abstract Applies a record of the edit journal to the document's contents.
+ @discussion Called after the document has been opened by -openWithCompletionHandler: for each record that has not been saved before the previous session ended, in the order the records have been appended. Records are only replayed on the contents they have been recorded for. Reverting the document discards the journal, and closing it only keeps the journal if its final save failed. Must be overridden if +usesEditJournal returns YES. Returns YES on success or NO and an error to stop replaying.
+ */
+- (BOOL)replayJournalRecord:(NSData *)record error:(NSError **)outError;
+
 
 #pragma mark - Filename handling
 
@@ -25,24 +25,34 @@
 #import "ULDocument.h"
 #import "ULDocument_Subclassing.h"
 
-#import "ULDeadlockDetector.h"
+#import "ULContainerFile.h"
+#import "ULEditJournal.h"
 #import "ULFilePresentationProxy.h"
+#import "ULSiblingPrefetcher.h"
+#import "ULStagingDirectoryPool.h"
+#import "ULTraceRecorder.h"
+#import "ULWatchdog.h"
 
 #import "NSDate+Utilities.h"
 #import "NSFileCoordinator+Convenience.h"
 #import "NSFileManager+FilesystemConvenience.h"
-#import "NSString+UniqueIdentifier.h"
+#import "NSFileWrapper+Fingerprint.h"
 #import "NSURL+PathUtilities.h"
 
 #import <objc/runtime.h>
+#import <pthread.h>
 
 
 #ifndef ULError
 #define ULError(...)				NSLog(__VA_ARGS__)
 #define ULLog(...)					NSLog(__VA_ARGS__)
-#define ULNotice(...)
-#define ULNoticeBeginURL(...)
-#define ULNoticeEndURL(...)
+#endif
+
+// Notices and accessed URLs are recorded by ULDocumentTrace, unless replaced by the host. Interaction timings are traced next to these hooks, so they are also recorded for hosts providing their own macros.
+#ifndef ULNotice
+#define ULNotice(...)				do { if (ULTraceRecorderIsEnabled) ULTraceRecorderRecordNotice([NSString stringWithFormat: __VA_ARGS__]); } while (0)
+#define ULNoticeBeginURL(__url)		ULNotice(@"Begin accessing '%@'.", (__url).path)
+#define ULNoticeEndURL(__url)		ULNotice(@"End accessing '%@'.", (__url).path)
 #endif
 
 /*!
@@ -65,18 +75,135 @@ static NSTimeInterval ULDocumentAutoversioningInterval = 900.;
  */
 NSTimeInterval ULDocumentMaximumSaveDuration = 60.;
 
+/*!
+ @abstract The maximum time any other document interaction may take until it is reported as stalled. The entry for saving is unused, see ULDocumentMaximumSaveDuration.
+ */
+static NSTimeInterval ULDocumentMaximumInteractionDurations[ULDocumentInteractionCount] = {60., 60., 60., 60., 60., 60., 60.};
+
+/*!
+ @abstract The time granted for saving all documents on termination. 0 waits until all documents have been saved.
+ @discussion Bounded by default, since termination blocks the main thread until all documents have been saved or the deadline passed.
+ */
+static NSTimeInterval ULDocumentTerminationFlushDuration = 10.;
+
+/*!
+ @abstract All documents holding an autosave token. These documents are saved when the application resigns active or terminates.
+ @discussion Must be accessed while holding ULDocumentPendingAutosaveLock.
+ */
+static NSHashTable *ULDocumentPendingAutosaveDocuments;
+static pthread_mutex_t ULDocumentPendingAutosaveLock = PTHREAD_MUTEX_INITIALIZER;
+
+/*!
+ @abstract The time after which clean documents that have not been accessed hibernate. 0 disables hibernation of idle documents.
+ */
+static NSTimeInterval ULDocumentHibernationIdleInterval = 0.;
+
+/*!
+ @abstract All open documents of classes supporting hibernation and the timer hibernating idle documents.
+ @discussion Must be accessed while holding ULDocumentHibernationLock.
+ */
+static NSHashTable *ULDocumentHibernationCandidates;
+static dispatch_source_t ULDocumentHibernationTimer;
+static pthread_mutex_t ULDocumentHibernationLock = PTHREAD_MUTEX_INITIALIZER;
+
+/*!
+ @abstract Compact forms of the contents of hibernating documents, as returned by -releaseContentsForHibernation. Purged under memory pressure.
+ */
+static NSCache *ULDocumentHibernationCache;
+
+/*!
+ @abstract The time interactions of all documents waited on their interaction queues, per priority class.
+ @discussion Must be accessed while holding ULDocumentInteractionWaitLock.
+ */
+static ULDocumentInteractionWaitStatistics ULDocumentInteractionWaitTimes[ULDocumentInteractionPriorityCount];
+static pthread_mutex_t ULDocumentInteractionWaitLock = PTHREAD_MUTEX_INITIALIZER;
+
+/*!
+ @abstract The prefetcher warming siblings of opened documents and the contents read ahead of time, keyed by their standardized path. Contents read ahead are costed by their file size.
+ @discussion Must be accessed while holding ULDocumentPrefetchLock. The prefetcher is nil if prefetching is disabled.
+ */
+static ULSiblingPrefetcher *ULDocumentSiblingPrefetcher;
+static NSCache *ULDocumentReadAheadContentsCache;
+static NSUInteger ULDocumentReadAheadHitCount;
+static pthread_mutex_t ULDocumentPrefetchLock = PTHREAD_MUTEX_INITIALIZER;
+
+/*!
+ @abstract The contents of a sibling read ahead of time, as they would be read by -readFromURL:error:.
+ */
+@interface ULDocumentPrefetchedContents : NSObject
+
+@property(nonatomic) Class documentClass;
+@property(nonatomic) id changeToken;				// Of the file when reading started
+@property(nonatomic) NSFileWrapper *fileWrapper;
+@property(nonatomic) NSData *fingerprint;
+
+@end
+
+@implementation ULDocumentPrefetchedContents
+@end
+
 
 NSString *ULDocumentUnhandeledSaveErrorNotification					= @"ULDocumentUnhandeledSaveErrorNotification";
 NSString *ULDocumentUnhandeledSaveErrorNotificationErrorKey			= @"error";
 
-@interface ULDocument () <ULFilePresentationProxyOwner, ULDeadlockDetectorDelegate>
+NSString *ULDocumentStalledInteractionNotification						= @"ULDocumentStalledInteractionNotification";
+NSString *ULDocumentStalledInteractionNotificationInteractionKey		= @"interaction";
+NSString *ULDocumentStalledInteractionNotificationDurationKey			= @"duration";
+NSString *ULDocumentStalledInteractionNotificationCoordinatorKey		= @"coordinator";
+NSString *ULDocumentStalledInteractionNotificationCoordinationDurationKey	= @"coordinationDuration";
+
+/*!
+ @abstract Provides a human-readable name of a document interaction for logging purposes.
+ */
+static NSString *ULDocumentInteractionName(ULDocumentInteraction interaction)
+{
+	switch (interaction) {
+		case ULDocumentInteractionOpen:					return @"open";
+		case ULDocumentInteractionSave:					return @"save";
+		case ULDocumentInteractionRevert:				return @"revert";
+		case ULDocumentInteractionClose:				return @"close";
+		case ULDocumentInteractionDelete:				return @"delete";
+		case ULDocumentInteractionReplaceVersion:		return @"replace version";
+		case ULDocumentInteractionChangeNotification:	return @"change notification";
+		case ULDocumentInteractionCount:				break;
+	}
+	
+	return @"unknown";
+}
+
+/*!
+ @abstract Calls a completion handler on the passed queue, or directly if no queue is passed.
+ */
+static void ULDocumentCallCompletionHandler(dispatch_queue_t queue, void (^completionHandler)(BOOL success), BOOL success)
+{
+	if (!completionHandler)
+		return;
+	
+	if (queue) {
+		dispatch_async(queue, ^{
+			completionHandler(success);
+		});
+	}
+	else {
+		completionHandler(success);
+	}
+}
+
+@interface ULDocument () <ULFilePresentationProxyOwner, ULWatchdogDelegate>
 {
 	id						_autosaveToken;							// Used to keep a document alive while autosave is pending
-	id						_resignActiveObserverToken;				// Observer token set for application resign notifications
-	id						_terminationObserverToken;				// Observer token set for application termination notifications
 	dispatch_queue_t		_autosaveQueue;							// A queue used to process and dequeue autosave operations
 	
 	BOOL					_deletionPending;						// Whether or not a deletion is pending
+	BOOL					_batchMovePending;						// Whether the document is moved by +moveDocuments:toURLs:completionHandler:. Presenter notifications caused by the move are ignored meanwhile. Set on the batch queue and read on the presenter queue, so it must be accessed atomically.
+	__weak NSOperation		*_lastOrderedInteraction;				// The last queued interaction that must not be overtaken by user-initiated ones. Must be accessed while synchronized on _interactionQueue.
+	__weak NSOperation		*_lastBackgroundInteraction;			// The last queued autosave or reconciliation. Must be accessed while synchronized on _interactionQueue.
+	NSUInteger				_contentAccessCount;					// Number of unbalanced -beginContentAccess calls. Must be accessed while synchronized on self.
+	id						_hibernationCacheKey;					// Identifies the document inside ULDocumentHibernationCache
+	ULEditJournal			*_editJournal;							// Journal of changes that have not been saved yet. Created lazily, if used by the document class.
+	NSUInteger				_serializedJournalRecordCount;			// Number of journal records contained in the contents serialized by the running save. Passed by -markJournalRecordsAsSerialized or taken as soon as serialization returned. NSNotFound while unknown.
+	NSData					*_persistedFingerprint;					// Fingerprint of the contents at fileURL, if written through a file wrapper, prefetched or read by classes fingerprinting contents when opening. Only valid while fileChangeToken describes the file.
+	NSFileWrapper			*_serializedFileWrapper;				// File wrapper serialized ahead of a save, consumed by -writeToURL:forSaveOperation:originalContentsURL:error:
 	NSURL					*_fileURL;								// Write accessor for document's file URL
 	NSOperationQueue		*_interactionQueue;						// A queue used to process and synchronize all background document interactions
 	ULFilePresentationProxy	*_presenter;
@@ -91,6 +218,8 @@ NSString *ULDocumentUnhandeledSaveErrorNotificationErrorKey			= @"error";
 @property(readwrite) NSDate *lastFileOpenDate;
 @property(readwrite) NSDate *changeDate;
 @property(readwrite) NSURL *revertURL;
+@property(readwrite) BOOL isHibernating;
+@property(readwrite) NSTimeInterval lastAccessTime;					// System uptime of the last access to the contents
 
 // The change token representing the current state in memory
 @property(readwrite) id changeToken;
@@ -112,6 +241,92 @@ NSString *ULDocumentUnhandeledSaveErrorNotificationErrorKey			= @"error";
  */
 - (BOOL)writeSafelyToURL:(NSURL *)url forSaveOperation:(ULDocumentSaveOperation)saveOperation error:(NSError **)outError;
 
+/*!
+ @abstract Synchronously write the document to the specified URL as part of an already supervised save interaction.
+ */
+- (BOOL)saveToURL:(NSURL *)url forSaveOperation:(ULDocumentSaveOperation)saveOperation interaction:(ULWatchdogToken)interaction error:(NSError **)outError;
+
+/*!
+ @abstract Enqueues a save of the document to the specified URL.
+ @discussion Autosaves may pass nil to write to the autosave URL that is current when the save is performed.
+ */
+- (void)enqueueSaveToURL:(NSURL *)url forSaveOperation:(ULDocumentSaveOperation)saveOperation completionQueue:(dispatch_queue_t)queue completionHandler:(void (^)(BOOL success))completionHandler;
+
+/*!
+ @abstract Synchronously autosaves the document, if it has unsaved changes. Must be called on the interaction queue.
+ */
+- (BOOL)flushChangesWithError:(NSError **)outError;
+
+/*!
+ @abstract Replays journaled changes that have not been saved before the previous session ended. Must be called after opening the document.
+ */
+- (void)replayEditJournal;
+
+/*!
+ @abstract Notes the journal records contained in the serialized contents, unless the subclass already marked them.
+ */
+- (void)markJournalRecordsAsSerializedIfNeeded;
+
+/*!
+ @abstract Writes all pending journal records and releases the journal without removing it, e.g. because the document is closed with unsaved changes.
+ */
+- (void)detachEditJournal;
+
+/*!
+ @abstract Hibernates all clean candidates whose contents have not been accessed since the passed system uptime.
+ */
++ (void)hibernateDocumentsAccessedBefore:(NSTimeInterval)time;
+
+/*!
+ @abstract Adds or removes the document from the candidates for hibernation.
+ */
+- (void)registerForHibernation;
+- (void)unregisterFromHibernation;
+
+/*!
+ @abstract Adds an interaction to the interaction queue, ordered according to its priority class.
+ @discussion User-initiated interactions overtake queued autosaves. All other interactions are executed in the order they have been enqueued.
+ */
+- (NSOperation *)enqueueInteractionWithPriority:(ULDocumentInteractionPriority)priority block:(void (^)(void))block;
+- (NSOperation *)enqueueInteractionWithPriority:(ULDocumentInteractionPriority)priority dependency:(NSOperation *)dependency block:(void (^)(void))block;
+
+/*!
+ @abstract Synchronously reloads the contents of a hibernating document. Must be called on the interaction queue.
+ */
+- (BOOL)wakeFromHibernationWithError:(NSError **)outError;
+
+/*!
+ @abstract Performs an interaction on each of the passed documents and calls the completionHandler after all of them finished.
+ @discussion The block must call the passed documentCompletionHandler exactly once for each document.
+ */
++ (void)performInteractionOnDocuments:(NSArray *)documents completionQueue:(dispatch_queue_t)queue completionHandler:(void (^)(NSArray *failedDocuments))completionHandler usingBlock:(void (^)(ULDocument *document, void (^documentCompletionHandler)(BOOL success)))block;
+
+/*!
+ @abstract Notes the opening of the document with the sibling prefetcher, if prefetching is enabled.
+ */
+- (void)prefetchSiblings;
+
+/*!
+ @abstract Reads the contents of the document at the passed URL ahead of time into the read-ahead cache.
+ */
++ (void)readAheadDocumentAtURL:(NSURL *)url cost:(unsigned long long)cost;
+
+/*!
+ @abstract Removes and returns the contents read ahead for the passed URL, if they have been read for the receiving class.
+ */
++ (ULDocumentPrefetchedContents *)takePrefetchedContentsForURL:(NSURL *)url;
+
+/*!
+ @abstract Reads the file wrapper passed to -readFromFileWrapper:error: by the default implementation of -readFromURL:error:.
+ */
++ (NSFileWrapper *)fileWrapperForReadingURL:(NSURL *)url error:(NSError **)outError;
+
+@end
+
+@interface ULDocumentFlushReport ()
+
+- (instancetype)initWithSavedDocuments:(NSArray *)savedDocuments failedDocuments:(NSArray *)failedDocuments errors:(NSMapTable *)errors unfinishedDocuments:(NSArray *)unfinishedDocuments duration:(NSTimeInterval)duration;
+
 @end
 
 @implementation ULDocument
@@ -143,6 +358,109 @@ NSString *ULDocumentUnhandeledSaveErrorNotificationErrorKey			= @"error";
 	ULDocumentAutoversioningInterval = interval;
 }
 
++ (void)setMaximumDuration:(NSTimeInterval)duration forInteraction:(ULDocumentInteraction)interaction
+{
+	NSParameterAssert(interaction < ULDocumentInteractionCount);
+	
+	if (interaction == ULDocumentInteractionSave)
+		ULDocumentMaximumSaveDuration = duration;
+	else
+		ULDocumentMaximumInteractionDurations[interaction] = duration;
+}
+
++ (void)setTerminationFlushDuration:(NSTimeInterval)duration
+{
+	ULDocumentTerminationFlushDuration = duration;
+}
+
++ (void)setHibernationIdleInterval:(NSTimeInterval)interval
+{
+	pthread_mutex_lock(&ULDocumentHibernationLock);
+	ULDocumentHibernationIdleInterval = interval;
+	
+	if (ULDocumentHibernationTimer) {
+		dispatch_source_cancel(ULDocumentHibernationTimer);
+		ULDocumentHibernationTimer = nil;
+	}
+	
+	// Idle documents are detected with a precision of a quarter of the interval
+	if (interval > 0) {
+		uint64_t period = (uint64_t)(interval / 4 * NSEC_PER_SEC);
+		
+		ULDocumentHibernationTimer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0));
+		dispatch_source_set_timer(ULDocumentHibernationTimer, dispatch_time(DISPATCH_TIME_NOW, (int64_t)period), period, period / 2);
+		dispatch_source_set_event_handler(ULDocumentHibernationTimer, ^{
+			[ULDocument hibernateDocumentsAccessedBefore: NSProcessInfo.processInfo.systemUptime - interval];
+		});
+		dispatch_resume(ULDocumentHibernationTimer);
+	}
+	
+	pthread_mutex_unlock(&ULDocumentHibernationLock);
+}
+
++ (ULDocumentInteractionWaitStatistics)waitStatisticsForInteractionPriority:(ULDocumentInteractionPriority)priority
+{
+	NSParameterAssert(priority < ULDocumentInteractionPriorityCount);
+	
+	pthread_mutex_lock(&ULDocumentInteractionWaitLock);
+	ULDocumentInteractionWaitStatistics statistics = ULDocumentInteractionWaitTimes[priority];
+	pthread_mutex_unlock(&ULDocumentInteractionWaitLock);
+	
+	return statistics;
+}
+
++ (void)resetWaitStatistics
+{
+	pthread_mutex_lock(&ULDocumentInteractionWaitLock);
+	memset(ULDocumentInteractionWaitTimes, 0, sizeof(ULDocumentInteractionWaitTimes));
+	pthread_mutex_unlock(&ULDocumentInteractionWaitLock);
+}
+
++ (void)setSiblingPrefetchCount:(NSUInteger)count
+{
+	pthread_mutex_lock(&ULDocumentPrefetchLock);
+	
+	ULDocumentSiblingPrefetcher = count ? [[ULSiblingPrefetcher alloc] initWithPrefetchCount: count] : nil;
+	ULDocumentReadAheadHitCount = 0;
+	[ULDocumentReadAheadContentsCache removeAllObjects];
+	
+	pthread_mutex_unlock(&ULDocumentPrefetchLock);
+}
+
++ (void)setReadAheadCacheLimit:(NSUInteger)limit
+{
+	pthread_mutex_lock(&ULDocumentPrefetchLock);
+	
+	if (!ULDocumentReadAheadContentsCache)
+		ULDocumentReadAheadContentsCache = [NSCache new];
+	
+	ULDocumentReadAheadContentsCache.totalCostLimit = limit;
+	
+	if (!limit)
+		[ULDocumentReadAheadContentsCache removeAllObjects];
+	
+	pthread_mutex_unlock(&ULDocumentPrefetchLock);
+}
+
++ (ULDocumentPrefetchStatistics)prefetchStatistics
+{
+	pthread_mutex_lock(&ULDocumentPrefetchLock);
+	
+	ULSiblingPrefetcherStatistics prefetcherStatistics = ULDocumentSiblingPrefetcher.statistics;
+	ULDocumentPrefetchStatistics statistics = {
+		.prefetchedCount	= prefetcherStatistics.prefetchedItemCount,
+		.prefetchedBytes	= prefetcherStatistics.prefetchedBytes,
+		.hitCount			= prefetcherStatistics.hitCount,
+		.missCount			= prefetcherStatistics.missCount,
+		.wastedBytes		= prefetcherStatistics.wastedBytes,
+		.readAheadHitCount	= ULDocumentReadAheadHitCount,
+	};
+	
+	pthread_mutex_unlock(&ULDocumentPrefetchLock);
+	
+	return statistics;
+}
+
 
 #pragma mark - Initialization
 
@@ -164,6 +482,7 @@ NSString *ULDocumentUnhandeledSaveErrorNotificationErrorKey			= @"error";
 	if (self) {
 		_autosaveQueue = dispatch_queue_create([[NSString stringWithFormat: @"com.soulmen.ulysses3.autosave.%p", self] cStringUsingEncoding: NSUTF8StringEncoding], DISPATCH_QUEUE_SERIAL);
 		_deletionPending = NO;
+		_hibernationCacheKey = [NSObject new];
 		
 		_interactionQueue = [NSOperationQueue new];
 		_interactionQueue.maxConcurrentOperationCount = 1;
@@ -181,6 +500,7 @@ NSString *ULDocumentUnhandeledSaveErrorNotificationErrorKey			= @"error";
 {
     self.undoManager = nil;
 	[_presenter endPresentation];
+	[ULDocumentHibernationCache removeObjectForKey: _hibernationCacheKey];
 }
 
 
@@ -202,13 +522,20 @@ NSString *ULDocumentUnhandeledSaveErrorNotificationErrorKey			= @"error";
 {
 	NSParameterAssert(!fileURL || fileURL.isFileURL);
 	
+	ULEditJournal *editJournal;
+	
 	@synchronized(self) {
 		if (_fileURL == fileURL || [_fileURL isEqual: fileURL])
 			return;
 		
 		_fileURL = [[fileURL copy] ul_URLByResolvingExactFilenames];
+		editJournal = _editJournal;
 	}
 	
+	// The journal follows the document
+	if (editJournal && fileURL)
+		[editJournal moveToURL: [ULEditJournal journalURLForItemAtURL:fileURL inDirectory:self.class.editJournalDirectoryURL]];
+	
 	if (self.documentIsOpen)
 		self.currentVersion = [NSFileVersion currentVersionOfItemAtURL: _fileURL];
 }
@@ -228,6 +555,11 @@ NSString *ULDocumentUnhandeledSaveErrorNotificationErrorKey			= @"error";
 	return self.class.defaultPathExtension;
 }
 
+- (NSUInteger)pendingInteractionCount
+{
+	return _interactionQueue.operationCount;
+}
+
 
 #pragma mark - Document state
 
@@ -316,59 +648,446 @@ NSString *ULDocumentUnhandeledSaveErrorNotificationErrorKey			= @"error";
 
 - (void)applicationWillTerminate:(NSNotification *)notification
 {
+	// Keep journaled changes, even if saving fails
+	[_editJournal synchronize];
+	
 	// Perform synchronous save if needed
-	if ([self hasUnsavedChanges] && self.fileURL) {
-		NSError *error;
-		NSURL *url = [self URLForSaveOperation:ULDocumentAutosave ignoreCurrentName:NO];
-		if (!url) return;
+	NSError *error;
+	
+	if (![self flushChangesWithError: &error])
+		ULError(@"Error writing file: %@ Path: %@", error, self.fileURL.path);
+}
+
+- (BOOL)flushChangesWithError:(NSError **)outError
+{
+	if (![self hasUnsavedChanges] || !self.fileURL)
+		return YES;
+	
+	// Documents without autosave location keep their changes, like regular autosaves
+	NSURL *url = [self URLForSaveOperation:ULDocumentAutosave ignoreCurrentName:NO];
+	if (!url)
+		return YES;
+	
+	return [self saveToURL:url forSaveOperation:ULDocumentAutosave error:outError];
+}
+
+
+#pragma mark - Flushing
+
++ (void)observeApplicationStateIfNeeded
+{
+	static dispatch_once_t onceToken;
+	dispatch_once(&onceToken, ^{
+		// Register for notifications to autosave on termination / resign active. Notifications are handled for all documents at once, so documents can be saved in parallel.
+#if TARGET_OS_IPHONE
+		NSString *resignNotification = UIApplicationWillResignActiveNotification;
+		NSString *terminationNotification = UIApplicationWillTerminateNotification;
+#else
+		NSString *resignNotification = NSApplicationWillResignActiveNotification;
+		NSString *terminationNotification = NSApplicationWillTerminateNotification;
+#endif
 		
-		BOOL success = [self saveToURL:url forSaveOperation:ULDocumentAutosave error:&error];
-		if (!success)
-			ULError(@"Error writing file: %@ Path: %@", error, url.path);
-	}
+		[NSNotificationCenter.defaultCenter addObserverForName:resignNotification object:nil queue:nil usingBlock:^(NSNotification *note) {
+			[ULDocument applicationWillResignActive: note];
+		}];
+		[NSNotificationCenter.defaultCenter addObserverForName:terminationNotification object:nil queue:nil usingBlock:^(NSNotification *note) {
+			[ULDocument applicationWillTerminate: note];
+		}];
+	});
 }
 
++ (void)applicationWillResignActive:(NSNotification *)notification
+{
+#if TARGET_OS_IPHONE
+	// Each document blocks until it has been saved, so all documents are handled in parallel
+	[self flushDocumentsWithDeadline:nil usingBlock:^BOOL(ULDocument *document, NSError **outError) {
+		[document applicationWillResignActive: notification];
+		return YES;
+	}];
+#else
+	for (ULDocument *document in self.documentsPendingAutosave)
+		[document applicationWillResignActive: notification];
+#endif
+}
 
-#pragma mark -
++ (void)applicationWillTerminate:(NSNotification *)notification
+{
+	NSDate *deadline = (ULDocumentTerminationFlushDuration > 0) ? [NSDate dateWithTimeIntervalSinceNow: ULDocumentTerminationFlushDuration] : nil;
+	
+	ULDocumentFlushReport *report = [self flushDocumentsWithDeadline:deadline usingInteraction:^BOOL(ULDocument *document, NSError **outError) {
+		[document applicationWillTerminate: notification];
+		
+		if (!document.hasUnsavedChanges)
+			return YES;
+		
+		if (outError) *outError = document.lastWriteError;
+		return NO;
+	}];
+	
+	if (report.unfinishedDocuments.count)
+		ULError(@"Termination deadline passed before %lu documents could be saved.", report.unfinishedDocuments.count);
+}
 
-- (BOOL)hasUnsavedChanges
++ (NSArray *)documentsPendingAutosave
 {
-	return (self.changeCount != 0);
+	pthread_mutex_lock(&ULDocumentPendingAutosaveLock);
+	NSArray *documents = ULDocumentPendingAutosaveDocuments.allObjects;
+	pthread_mutex_unlock(&ULDocumentPendingAutosaveLock);
+	
+	return [documents filteredArrayUsingPredicate: [NSPredicate predicateWithBlock:^BOOL(ULDocument *document, NSDictionary *bindings) {
+		return [document isKindOfClass: self];
+	}]];
 }
 
-+ (NSSet *)keyPathsForValuesAffectingHasUnsavedChanges
++ (ULDocumentFlushReport *)flushAllDocumentsWithDeadline:(NSDate *)deadline
 {
-	return [NSSet setWithObject: @"changeCount"];
+	return [self flushDocumentsWithDeadline:deadline usingInteraction:^BOOL(ULDocument *document, NSError **outError) {
+		return [document flushChangesWithError: outError];
+	}];
 }
 
-- (void)updateChangeCount:(ULDocumentChangeKind)change
+/*!
+ @abstract Returns all documents pending autosave, starting with the most recently changed documents.
+ */
++ (NSArray *)documentsPendingAutosaveByRecency
 {
-	// Clear change counter
-	if (change == ULDocumentChangeCleared) {
-		self.changeCount = 0;
+	// The most recently changed documents most likely contain the work the user cares about
+	return [self.documentsPendingAutosave sortedArrayUsingComparator:^NSComparisonResult(ULDocument *document1, ULDocument *document2) {
+		return [document2.changeDate ?: NSDate.distantPast compare: document1.changeDate ?: NSDate.distantPast];
+	}];
+}
+
+/*!
+ @abstract Runs the passed block as user-initiated interaction of each document pending autosave, starting with the most recently changed documents.
+ @discussion The block is ordered with all other interactions of a document, while different documents are handled in parallel. Interactions starting after the deadline passed skip the block. Returns as soon as all interactions completed or the deadline passed.
+ */
++ (ULDocumentFlushReport *)flushDocumentsWithDeadline:(NSDate *)deadline usingInteraction:(BOOL (^)(ULDocument *document, NSError **outError))block
+{
+	return [self flushDocumentsWithDeadline:deadline dispatcher:^(NSArray *documents, dispatch_group_t group, BOOL (^flushDocument)(ULDocument *document)) {
+		for (ULDocument *document in documents) {
+			dispatch_group_enter(group);
+			
+			[document enqueueInteractionWithPriority:ULDocumentInteractionPriorityUserInitiated block:^{
+				flushDocument(document);
+				dispatch_group_leave(group);
+			}];
+		}
+	} block:block];
+}
+
+/*!
+ @abstract Runs the passed block for all documents pending autosave on a pool of concurrent workers, starting with the most recently changed documents.
+ @discussion Blocks are not started after the deadline passed. Returns as soon as all blocks completed or the deadline passed.
+ */
++ (ULDocumentFlushReport *)flushDocumentsWithDeadline:(NSDate *)deadline usingBlock:(BOOL (^)(ULDocument *document, NSError **outError))block
+{
+	return [self flushDocumentsWithDeadline:deadline dispatcher:^(NSArray *documents, dispatch_group_t group, BOOL (^flushDocument)(ULDocument *document)) {
+		NSObject *lock = [NSObject new];
+		__block NSUInteger nextIndex = 0;
 		
-		// Deactivate autosave token in autosave queue to synchronize it
-		dispatch_async(_autosaveQueue, ^{
-			[self unsetAutosaveToken];
-		});
+		// Saving is mostly waiting for I/O and file coordination, so more workers than processors are used
+		NSUInteger workerCount = MIN(documents.count, MAX(4, NSProcessInfo.processInfo.activeProcessorCount * 2));
 		
-		return;
-	}
+		for (NSUInteger worker = 0; worker < workerCount; worker ++) {
+			dispatch_group_async(group, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0), ^{
+				while (YES) {
+					ULDocument *document = nil;
+					
+					@synchronized(lock) {
+						if (nextIndex < documents.count)
+							document = documents[nextIndex ++];
+					}
+					
+					// Stop taking documents once the deadline passed
+					if (!document || !flushDocument(document))
+						break;
+				}
+			});
+		}
+	} block:block];
+}
+
+/*!
+ @abstract Flushes all documents pending autosave, starting with the most recently changed documents.
+ @discussion The dispatcher schedules flushDocument for each passed document and tracks the scheduled work through the passed group. flushDocument runs the block and records its outcome, or returns NO without running the block if the deadline passed. Returns as soon as the group is done or the deadline passed.
+ */
++ (ULDocumentFlushReport *)flushDocumentsWithDeadline:(NSDate *)deadline dispatcher:(void (^)(NSArray *documents, dispatch_group_t group, BOOL (^flushDocument)(ULDocument *document)))dispatcher block:(BOOL (^)(ULDocument *document, NSError **outError))block
+{
+	NSDate *beginDate = [NSDate date];
+	NSArray *documents = self.documentsPendingAutosaveByRecency;
 	
-	NSAssert(!_isReadOnly, @"Modification made to read-only document %@!", self);
+	// Captured by the dispatched work, so late completions after the deadline remain safe
+	NSMutableArray *savedDocuments = [NSMutableArray new];
+	NSMutableArray *failedDocuments = [NSMutableArray new];
+	NSMapTable *errors = [NSMapTable strongToStrongObjectsMapTable];
+	NSObject *lock = [NSObject new];
+	dispatch_group_t group = dispatch_group_create();
 	
+	dispatcher(documents, group, ^BOOL(ULDocument *document) {
+		if (deadline && deadline.timeIntervalSinceNow <= 0)
+			return NO;
+		
+		NSError *error;
+		BOOL success;
+		
+		@autoreleasepool {
+			success = block(document, &error);
+		}
+		
+		@synchronized(lock) {
+			if (success) {
+				[savedDocuments addObject: document];
+			}
+			else {
+				[failedDocuments addObject: document];
+				if (error) [errors setObject:error forKey:document];
+			}
+		}
+		
+		return YES;
+	});
 	
-	// Update change date
-	[self updateChangeDate];
+	// Wait until all dispatched work is done or the deadline passed
+	NSTimeInterval remainingTime = deadline ? MAX(deadline.timeIntervalSinceNow, 0) : INFINITY;
+	dispatch_group_wait(group, (remainingTime < INT64_MAX / NSEC_PER_SEC) ? dispatch_time(DISPATCH_TIME_NOW, (int64_t)(remainingTime * NSEC_PER_SEC)) : DISPATCH_TIME_FOREVER);
 	
-	// Change autosave token in a autosave queue to synchronize it. Block retains 'self' since the autosave token has not been set yet. Do not trigger autosave if no URL has been set.
-	if (self.fileURL) {
-		dispatch_async(_autosaveQueue, ^{
-			// Autosave is already scheduled or pending: do nothing.
-			if (self->_autosaveToken)
-				return;
-			
-			// Activate autosave token to ensure document is kept alive and saved on exit
+	@synchronized(lock) {
+		NSMutableArray *unfinishedDocuments = [documents mutableCopy];
+		[unfinishedDocuments removeObjectsInArray: savedDocuments];
+		[unfinishedDocuments removeObjectsInArray: failedDocuments];
+		
+		return [[ULDocumentFlushReport alloc] initWithSavedDocuments:[savedDocuments copy] failedDocuments:[failedDocuments copy] errors:[errors copy] unfinishedDocuments:unfinishedDocuments duration:-beginDate.timeIntervalSinceNow];
+	}
+}
+
+
+#pragma mark - Batch moves
+
++ (void)moveDocuments:(NSArray *)documents toURLs:(NSArray *)urls completionHandler:(void (^)(BOOL success))completionHandler
+{
+	[self moveDocuments:documents toURLs:urls completionQueue:dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0) completionHandler:completionHandler];
+}
+
++ (void)moveDocuments:(NSArray *)documents toURLs:(NSArray *)urls completionQueue:(dispatch_queue_t)queue completionHandler:(void (^)(BOOL success))completionHandler
+{
+	NSParameterAssert(documents.count == urls.count);
+	
+	static NSOperationQueue *batchQueue;
+	static dispatch_once_t onceToken;
+	dispatch_once(&onceToken, ^{
+		batchQueue = [NSOperationQueue new];
+	});
+	
+	__block BOOL success = YES;
+	
+	NSBlockOperation *moveOperation = [NSBlockOperation blockOperationWithBlock:^{
+		NSError *error;
+		
+		success = [self coordinatedMoveDocuments:documents toURLs:urls error:&error];
+		if (!success)
+			ULError(@"Error moving %lu documents: %@", documents.count, error);
+	}];
+	moveOperation.qualityOfService = NSQualityOfServiceUserInitiated;
+	
+	NSBlockOperation *completionOperation = [NSBlockOperation blockOperationWithBlock:^{
+		ULDocumentCallCompletionHandler(queue, completionHandler, success);
+	}];
+	[completionOperation addDependency: moveOperation];
+	
+	for (ULDocument *document in documents) {
+		NSAssert(!document.isReadOnly, @"Read-only document %@ cannot be moved!", document);
+		
+		@synchronized(document->_interactionQueue) {
+			// Like a reconciliation, the move must see the results of all preceding interactions. E.g. queued autosaves would otherwise restore the old name.
+			NSOperation *gateOperation = [document enqueueInteractionWithPriority:ULDocumentInteractionPriorityReconciliation block:^{}];
+			[moveOperation addDependency: gateOperation];
+			
+			// Later interactions wait for the move without occupying a thread
+			[document enqueueInteractionWithPriority:ULDocumentInteractionPriorityUserInitiated dependency:moveOperation block:^{}];
+		}
+	}
+	
+	[batchQueue addOperations:@[moveOperation, completionOperation] waitUntilFinished:NO];
+}
+
++ (BOOL)coordinatedMoveDocuments:(NSArray *)documents toURLs:(NSArray *)urls error:(NSError **)outError
+{
+	NSMutableArray *movedDocuments = [NSMutableArray new];
+	NSMutableArray *intents = [NSMutableArray new];
+	
+	[documents enumerateObjectsUsingBlock:^(ULDocument *document, NSUInteger index, BOOL *stop) {
+		NSURL *url = [urls[index] ul_URLByFastStandardizingPath];
+		
+		// Compare standardized URLs directly, so filename case changes are moved as well
+		if (!document.fileURL || document->_deletionPending || [url isEqual: document.fileURL])
+			return;
+		
+		[movedDocuments addObject: document];
+		[intents addObject: [NSFileAccessIntent writingIntentWithURL:document.fileURL options:NSFileCoordinatorWritingForMoving]];
+		[intents addObject: [NSFileAccessIntent writingIntentWithURL:url options:0]];
+	}];
+	
+	if (!movedDocuments.count)
+		return YES;
+	
+	for (ULDocument *document in movedDocuments)
+		__atomic_store_n(&document->_batchMovePending, YES, __ATOMIC_RELEASE);
+	
+	// All items are coordinated at once. The coordinator has no presenter, so the presenters of all moved documents are notified.
+	NSFileCoordinator *coordinator = [[NSFileCoordinator alloc] initWithFilePresenter: nil];
+	NSOperationQueue *accessQueue = [NSOperationQueue new];
+	dispatch_semaphore_t accessSemaphore = dispatch_semaphore_create(0);
+	__block NSError *moveError;
+	__block BOOL success = YES;
+	
+	[coordinator coordinateAccessWithIntents:intents queue:accessQueue byAccessor:^(NSError *error) {
+		if (error) {
+			moveError = error;
+			success = NO;
+			dispatch_semaphore_signal(accessSemaphore);
+			return;
+		}
+		
+		[movedDocuments enumerateObjectsUsingBlock:^(ULDocument *document, NSUInteger index, BOOL *stop) {
+			NSURL *currentURL = [intents[index * 2] URL];
+			NSURL *newURL = [intents[index * 2 + 1] URL];
+			NSError *error;
+			
+			if (![NSFileManager.defaultManager ul_moveItemCaseSensistiveAtURL:currentURL toURL:newURL error:&error]) {
+				ULError(@"Cannot move '%@' to '%@': %@", currentURL.path, newURL.path, error);
+				moveError = moveError ?: error;
+				success = NO;
+				return;
+			}
+			
+			// Update the document before notifying its presenter, so the notification can be recognized as caused by the move
+			document.fileURL = newURL.ul_URLByResolvingExactFilenames;
+			[coordinator itemAtURL:currentURL didMoveToURL:newURL];
+			
+			[document didChangeFileURLBySaving];
+		}];
+		
+		dispatch_semaphore_signal(accessSemaphore);
+	}];
+	
+	dispatch_semaphore_wait(accessSemaphore, DISPATCH_TIME_FOREVER);
+	
+	for (ULDocument *document in movedDocuments)
+		__atomic_store_n(&document->_batchMovePending, NO, __ATOMIC_RELEASE);
+	
+	if (outError) *outError = moveError;
+	return success;
+}
+
+
+#pragma mark - Batch interactions
+
++ (void)openDocuments:(NSArray *)documents completionQueue:(dispatch_queue_t)queue completionHandler:(void (^)(NSArray *failedDocuments))completionHandler
+{
+	[self performInteractionOnDocuments:documents completionQueue:queue completionHandler:completionHandler usingBlock:^(ULDocument *document, void (^documentCompletionHandler)(BOOL success)) {
+		[document openWithCompletionQueue:nil completionHandler:documentCompletionHandler];
+	}];
+}
+
++ (void)autosaveDocuments:(NSArray *)documents completionQueue:(dispatch_queue_t)queue completionHandler:(void (^)(NSArray *failedDocuments))completionHandler
+{
+	[self performInteractionOnDocuments:documents completionQueue:queue completionHandler:completionHandler usingBlock:^(ULDocument *document, void (^documentCompletionHandler)(BOOL success)) {
+		[document autosaveWithCompletionQueue:nil completionHandler:documentCompletionHandler];
+	}];
+}
+
++ (void)closeDocuments:(NSArray *)documents completionQueue:(dispatch_queue_t)queue completionHandler:(void (^)(NSArray *failedDocuments))completionHandler
+{
+	[self performInteractionOnDocuments:documents completionQueue:queue completionHandler:completionHandler usingBlock:^(ULDocument *document, void (^documentCompletionHandler)(BOOL success)) {
+		[document closeWithCompletionQueue:nil completionHandler:documentCompletionHandler];
+	}];
+}
+
++ (void)performInteractionOnDocuments:(NSArray *)documents completionQueue:(dispatch_queue_t)queue completionHandler:(void (^)(NSArray *failedDocuments))completionHandler usingBlock:(void (^)(ULDocument *document, void (^documentCompletionHandler)(BOOL success)))block
+{
+	NSMutableArray *failedDocuments = [NSMutableArray new];
+	__block NSUInteger pendingCount = documents.count;
+	
+	void (^batchCompletionHandler)(void) = ^{
+		if (!completionHandler)
+			return;
+		
+		NSArray *result = [failedDocuments copy];
+		
+		if (queue) {
+			dispatch_async(queue, ^{
+				completionHandler(result);
+			});
+		}
+		else {
+			completionHandler(result);
+		}
+	};
+	
+	if (!pendingCount) {
+		batchCompletionHandler();
+		return;
+	}
+	
+	// Documents complete directly on their interaction queues, only the last one calls the completion handler of the batch
+	for (ULDocument *document in documents) {
+		block(document, ^(BOOL success) {
+			BOOL isLastDocument;
+			
+			@synchronized(failedDocuments) {
+				if (!success)
+					[failedDocuments addObject: document];
+				
+				isLastDocument = (-- pendingCount == 0);
+			}
+			
+			if (isLastDocument)
+				batchCompletionHandler();
+		});
+	}
+}
+
+
+#pragma mark -
+
+- (BOOL)hasUnsavedChanges
+{
+	return (self.changeCount != 0);
+}
+
++ (NSSet *)keyPathsForValuesAffectingHasUnsavedChanges
+{
+	return [NSSet setWithObject: @"changeCount"];
+}
+
+- (void)updateChangeCount:(ULDocumentChangeKind)change
+{
+	// Clear change counter
+	if (change == ULDocumentChangeCleared) {
+		self.changeCount = 0;
+		
+		// Deactivate autosave token in autosave queue to synchronize it
+		dispatch_async(_autosaveQueue, ^{
+			[self unsetAutosaveToken];
+		});
+		
+		return;
+	}
+	
+	NSAssert(!_isReadOnly, @"Modification made to read-only document %@!", self);
+	
+	
+	// Update change date
+	[self updateChangeDate];
+	
+	// Change autosave token in a autosave queue to synchronize it. Block retains 'self' since the autosave token has not been set yet. Do not trigger autosave if no URL has been set.
+	if (self.fileURL) {
+		dispatch_async(_autosaveQueue, ^{
+			// Autosave is already scheduled or pending: do nothing.
+			if (self->_autosaveToken)
+				return;
+			
+			// Activate autosave token to ensure document is kept alive and saved on exit
 			[self setAutosaveToken];
 			
 			// Use a different delay if the document is stored on an ubiquitous store, so back-off strategies of iCloud services are not triggered.
@@ -431,6 +1150,8 @@ NSString *ULDocumentUnhandeledSaveErrorNotificationErrorKey			= @"error";
 
 + (id)changeTokenForItemAtURL:(NSURL *)documentURL
 {
+	uint64_t phaseBegin = ULTraceRecorderBeginPhase();
+	
 	// Get attributes that should be used for calculating the change token
 	NSArray *urlAttributes;
 	NSString *versionIdentifier;
@@ -441,6 +1162,10 @@ NSString *ULDocumentUnhandeledSaveErrorNotificationErrorKey			= @"error";
 	NSMutableString *changeToken = [versionIdentifier mutableCopy];
 	[self readChangeInformationForItemAtURL:documentURL usingAttributes:urlAttributes andAppendToToken:changeToken];
 	
+	// Saving a container in place may neither alter its generation identifier nor its modification date within the same second
+	if (self.usesContainerStorage)
+		[changeToken appendFormat: @"|c:%llX", [ULContainerFile generationOfContainerAtURL: documentURL]];
+	
 	// If needed create token for package descendants
 	if (self.shouldHandleSubitemChanges) {
 		NSMutableArray *subitemURLs = [NSMutableArray new];
@@ -458,6 +1183,7 @@ NSString *ULDocumentUnhandeledSaveErrorNotificationErrorKey			= @"error";
 		}
 	}
 
+	ULTraceRecorderEndPhase(ULDocumentTracePhaseChangeToken, phaseBegin);
 	return changeToken;
 }
 
@@ -517,21 +1243,16 @@ NSString *ULDocumentUnhandeledSaveErrorNotificationErrorKey			= @"error";
 	// Create a cyclic reference to ensure that the document is kept alive until autosave happens
 	_autosaveToken = self;
 	
-	// Register for notifications to autosave on termination / resign active. Notification blocks are used to ensure observers are properly retained.
-#if TARGET_OS_IPHONE
-	NSString *resignNotification = UIApplicationWillResignActiveNotification;
-	NSString *terminationNotification = UIApplicationWillTerminateNotification;
-#else
-	NSString *resignNotification = NSApplicationWillResignActiveNotification;
-	NSString *terminationNotification = NSApplicationWillTerminateNotification;
-#endif
+	// Register document to autosave on termination / resign active
+	[ULDocument observeApplicationStateIfNeeded];
 	
-	_resignActiveObserverToken = [NSNotificationCenter.defaultCenter addObserverForName:resignNotification object:nil queue:nil usingBlock:^(NSNotification *note) {
-		[self applicationWillResignActive: note];
-	}];
-	_terminationObserverToken = [NSNotificationCenter.defaultCenter addObserverForName:terminationNotification object:nil queue:nil usingBlock:^(NSNotification *note) {
-		[self applicationWillTerminate: note];
-	}];
+	pthread_mutex_lock(&ULDocumentPendingAutosaveLock);
+	
+	if (!ULDocumentPendingAutosaveDocuments)
+		ULDocumentPendingAutosaveDocuments = [NSHashTable hashTableWithOptions: NSPointerFunctionsStrongMemory | NSPointerFunctionsObjectPointerPersonality];
+	
+	[ULDocumentPendingAutosaveDocuments addObject: self];
+	pthread_mutex_unlock(&ULDocumentPendingAutosaveLock);
 }
 
 - (void)unsetAutosaveToken
@@ -539,13 +1260,10 @@ NSString *ULDocumentUnhandeledSaveErrorNotificationErrorKey			= @"error";
 	if (!_autosaveToken)
 		return;
 
-	// Disable autosave observers and allow document to be released
-	[NSNotificationCenter.defaultCenter removeObserver: _resignActiveObserverToken];
-	[NSNotificationCenter.defaultCenter removeObserver: _terminationObserverToken];
-
-	// Tokens must be unset, since they retain references to the observer block.
-	_resignActiveObserverToken = nil;
-	_terminationObserverToken = nil;
+	// Do not autosave on termination / resign active any longer and allow document to be released
+	pthread_mutex_lock(&ULDocumentPendingAutosaveLock);
+	[ULDocumentPendingAutosaveDocuments removeObject: self];
+	pthread_mutex_unlock(&ULDocumentPendingAutosaveLock);
 	
 	// Autosave happened: no further retaining needed
 	_autosaveToken = nil;
@@ -555,34 +1273,41 @@ NSString *ULDocumentUnhandeledSaveErrorNotificationErrorKey			= @"error";
 #pragma mark - Reading and writing
 
 - (void)openWithCompletionHandler:(void (^)(BOOL success))completionHandler
+{
+	[self openWithCompletionQueue:dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0) completionHandler:completionHandler];
+}
+
+- (void)openWithCompletionQueue:(dispatch_queue_t)queue completionHandler:(void (^)(BOOL success))completionHandler
 {
 	// Document does not need to be opened
 	if (self.documentIsOpen) {
-		dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
-			if (completionHandler)
-				completionHandler(YES);
-		});
+		ULDocumentCallCompletionHandler(queue, completionHandler, YES);
 		return;
 	}
 	
 	// Document has no URL
 	if (!self.fileURL) {
-		dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
-			if (completionHandler)
-				completionHandler(NO);
-		});
+		ULDocumentCallCompletionHandler(queue, completionHandler, NO);
 		return;
 	}
 	
+	ULWatchdogToken interaction = [self beginInteraction:ULDocumentInteractionOpen context:0];
+	
 	// Coordinate sequential reading
-	[_interactionQueue addOperationWithBlock:^{
+	[self enqueueInteractionWithPriority:ULDocumentInteractionPriorityUserInitiated block:^{
 		__block BOOL success = NO;
 		__block NSError *readError;
 		NSError *error;
 		
 		ULNoticeBeginURL(self.fileURL);
+		ULTraceRecorderBeginInteraction(ULDocumentInteractionOpen, (__bridge const void *)self);
+		
+		NSFileCoordinator *coordinator = [[NSFileCoordinator alloc] initWithFilePresenter: self->_presenter];
+		[self interaction:interaction willWaitForCoordinator:coordinator];
 		
-		[[[NSFileCoordinator alloc] initWithFilePresenter: self->_presenter] coordinateReadingItemAtURL:self.fileURL options:NSFileCoordinatorReadingWithoutChanges error:&error byAccessor:^(NSURL *newURL) {
+		[coordinator coordinateReadingItemAtURL:self.fileURL options:NSFileCoordinatorReadingWithoutChanges error:&error byAccessor:^(NSURL *newURL) {
+			[self interactionDidAcquireCoordination: interaction];
+			
 			// Document has been opened in the meantime
 			if (self.documentIsOpen) {
 				success = YES;
@@ -591,8 +1316,13 @@ NSString *ULDocumentUnhandeledSaveErrorNotificationErrorKey			= @"error";
 			
 			// Attempt read
 			success = [self coordinatedOpenFromURL:newURL error:&readError];
+			
+			// Restore changes that have not been saved before the previous session ended
+			if (success)
+				[self replayEditJournal];
 		}];
 		
+		ULTraceRecorderEndInteraction();
 		ULNoticeEndURL(self.fileURL);
 		
 		// Handle coordination error
@@ -606,72 +1336,105 @@ NSString *ULDocumentUnhandeledSaveErrorNotificationErrorKey			= @"error";
 		if (!success)
 			ULError(@"Error opening file %@: %@", self.fileURL.path, error ?: readError);
 		
-		dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
-			if (completionHandler)
-				completionHandler(success);
-		});
+		[self endInteraction: interaction];
+		
+		if (success)
+			[self prefetchSiblings];
+		
+		ULDocumentCallCompletionHandler(queue, completionHandler, success);
 	}];
 }
 
 - (void)saveWithCompletionHandler:(void (^)(BOOL success))completionHandler
+{
+	[self saveWithCompletionQueue:dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0) completionHandler:completionHandler];
+}
+
+- (void)saveWithCompletionQueue:(dispatch_queue_t)queue completionHandler:(void (^)(BOOL success))completionHandler
 {
 	NSURL *url = [self URLForSaveOperation:ULDocumentSave ignoreCurrentName:NO];
 	NSAssert(url, @"Explicit save without valid URL forbidden.");
 	
-	[self saveToURL:url forSaveOperation:ULDocumentSave completionHandler:completionHandler];
+	[self saveToURL:url forSaveOperation:ULDocumentSave completionQueue:queue completionHandler:completionHandler];
 }
 
 - (void)autosaveWithCompletionHandler:(void (^)(BOOL success))completionHandler
+{
+	[self autosaveWithCompletionQueue:dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0) completionHandler:completionHandler];
+}
+
+- (void)autosaveWithCompletionQueue:(dispatch_queue_t)queue completionHandler:(void (^)(BOOL success))completionHandler
 {
 	if (!self.hasUnsavedChanges) {
-		if (completionHandler)
-			completionHandler(YES);
-		
+		ULDocumentCallCompletionHandler(queue, completionHandler, YES);
 		return;
 	}
 	
-	NSURL *url = [self URLForSaveOperation:ULDocumentAutosave ignoreCurrentName:NO];
-	if (!url) return;
+	// Documents without an autosave location cannot be saved, but callers waiting for the completion must not hang
+	if (![self URLForSaveOperation:ULDocumentAutosave ignoreCurrentName:NO]) {
+		ULDocumentCallCompletionHandler(queue, completionHandler, NO);
+		return;
+	}
 	
-	[self saveToURL:url forSaveOperation:ULDocumentAutosave completionHandler:completionHandler];
+	// The URL is determined again when the autosave is performed, since it may be overtaken by a save that renames the document
+	[self enqueueSaveToURL:nil forSaveOperation:ULDocumentAutosave completionQueue:queue completionHandler:completionHandler];
 }
 
 - (void)closeWithCompletionHandler:(void (^)(BOOL success))completionHandler
 {
-	[_interactionQueue addOperationWithBlock:^{
+	[self closeWithCompletionQueue:dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0) completionHandler:completionHandler];
+}
+
+- (void)closeWithCompletionQueue:(dispatch_queue_t)queue completionHandler:(void (^)(BOOL success))completionHandler
+{
+	ULWatchdogToken interaction = [self beginInteraction:ULDocumentInteractionClose context:0];
+	
+	[self enqueueInteractionWithPriority:ULDocumentInteractionPriorityUserInitiated block:^{
 		// Document does not need to be closed
 		if (!self.documentIsOpen) {
-			if (completionHandler) {
-				dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
-					completionHandler(YES);
-				});
-			}
+			[self endInteraction: interaction];
+			ULDocumentCallCompletionHandler(queue, completionHandler, YES);
 			return;
 		}
 		
-		// Write changes if needed
-		[self autosaveWithCompletionHandler: ^(BOOL success) {
+		// Write changes if needed. The autosave completes on the interaction queue, so only the final completion handler may change queues.
+		[self autosaveWithCompletionQueue:nil completionHandler:^(BOOL success) {
+			// Keep journaled changes that could not be saved, so they are restored when the document is opened again
+			if (!success)
+				[self detachEditJournal];
+			
 			[self close];
-			if (completionHandler) {
-				dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
-					completionHandler(success);
-				});
-			}
+			[self endInteraction: interaction];
+			
+			ULDocumentCallCompletionHandler(queue, completionHandler, success);
 		}];
 	}];
 }
 
 - (void)deleteWithCompletionHandler:(void (^)(BOOL success))completionHandler
 {
+	[self deleteWithCompletionQueue:dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0) completionHandler:completionHandler];
+}
+
+- (void)deleteWithCompletionQueue:(dispatch_queue_t)queue completionHandler:(void (^)(BOOL success))completionHandler
+{
+	ULWatchdogToken interaction = [self beginInteraction:ULDocumentInteractionDelete context:0];
+	
 	// Coordinate sequential deletion
-	[_interactionQueue addOperationWithBlock:^{
+	[self enqueueInteractionWithPriority:ULDocumentInteractionPriorityUserInitiated block:^{
 		__block NSError *deleteError;
 		__block BOOL success = NO;
 		NSError *error;
 		
 		ULNoticeBeginURL(self.fileURL);
+		ULTraceRecorderBeginInteraction(ULDocumentInteractionDelete, (__bridge const void *)self);
 		
-		[[[NSFileCoordinator alloc] initWithFilePresenter: self->_presenter] coordinateWritingItemAtURL:self.fileURL options:NSFileCoordinatorWritingForDeleting error:&error byAccessor:^(NSURL *newURL) {
+		NSFileCoordinator *coordinator = [[NSFileCoordinator alloc] initWithFilePresenter: self->_presenter];
+		[self interaction:interaction willWaitForCoordinator:coordinator];
+		
+		[coordinator coordinateWritingItemAtURL:self.fileURL options:NSFileCoordinatorWritingForDeleting error:&error byAccessor:^(NSURL *newURL) {
+			[self interactionDidAcquireCoordination: interaction];
+			
 			// File has been deleted externally
 			if (self->_deletionPending) {
 				deleteError = [NSError errorWithDomain:NSCocoaErrorDomain code:0 userInfo:@{NSLocalizedDescriptionKey: @"Deletion pending."}];
@@ -683,6 +1446,7 @@ NSString *ULDocumentUnhandeledSaveErrorNotificationErrorKey			= @"error";
 			success = success || ![newURL checkResourceIsReachableAndReturnError: NULL];
 		}];
 		
+		ULTraceRecorderEndInteraction();
 		ULNoticeEndURL(self.fileURL);
 		
 		// Close document
@@ -696,11 +1460,10 @@ NSString *ULDocumentUnhandeledSaveErrorNotificationErrorKey			= @"error";
 		else
 			ULError(@"Error deleting file: %@", (error ?: deleteError));
 		
+		[self endInteraction: interaction];
+		
 		// Callback
-		dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
-			if (completionHandler)
-				completionHandler(success);
-		});
+		ULDocumentCallCompletionHandler(queue, completionHandler, success);
 	}];
 }
 
@@ -709,6 +1472,10 @@ NSString *ULDocumentUnhandeledSaveErrorNotificationErrorKey			= @"error";
 	[_presenter endPresentation];
 	_presenter = nil;
 	
+	// Unsaved changes are discarded
+	[_editJournal discard];
+	[self unregisterFromHibernation];
+	
 	// Deactivate autosave observers. Do it on _autosaveQueue to prevent race conditions.
 	dispatch_async(_autosaveQueue, ^{
 		[self unsetAutosaveToken];
@@ -719,6 +1486,11 @@ NSString *ULDocumentUnhandeledSaveErrorNotificationErrorKey			= @"error";
 }
 
 - (void)revertToContentsOfURL:(NSURL *)url completionHandler:(void (^)(BOOL success))completionHandler
+{
+	[self revertToContentsOfURL:url completionQueue:dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0) completionHandler:completionHandler];
+}
+
+- (void)revertToContentsOfURL:(NSURL *)url completionQueue:(dispatch_queue_t)queue completionHandler:(void (^)(BOOL success))completionHandler
 {
 	// No duplicate reverts to the same URL
 	if ([self.revertURL ul_isEqualToFileURL: url])
@@ -730,20 +1502,40 @@ NSString *ULDocumentUnhandeledSaveErrorNotificationErrorKey			= @"error";
 	self.revertURL = [url copy];
 	[self disableEditing];
 	
+	ULWatchdogToken interaction = [self beginInteraction:ULDocumentInteractionRevert context:0];
+	
 	// Coordinate sequential reading
-	[_interactionQueue addOperationWithBlock:^{
+	[self enqueueInteractionWithPriority:ULDocumentInteractionPriorityReconciliation block:^{
 		__block NSError *readError;
 		__block BOOL success = NO;
 		NSError *error;
 		
 		ULNoticeBeginURL(self.fileURL);
+		ULTraceRecorderBeginInteraction(ULDocumentInteractionRevert, (__bridge const void *)self);
 		
-		[[[NSFileCoordinator alloc] initWithFilePresenter: self->_presenter] coordinateReadingItemAtURL:url options:NSFileCoordinatorReadingWithoutChanges error:&error byAccessor:^(NSURL *newURL) {
-			// Attempt read
+		NSFileCoordinator *coordinator = [[NSFileCoordinator alloc] initWithFilePresenter: self->_presenter];
+		[self interaction:interaction willWaitForCoordinator:coordinator];
+		
+		[coordinator coordinateReadingItemAtURL:url options:NSFileCoordinatorReadingWithoutChanges error:&error byAccessor:^(NSURL *newURL) {
+			[self interactionDidAcquireCoordination: interaction];
+			
 			self.fileURL = newURL;
+			
+			// Reverting drops all unsaved changes
+			[self.editJournal discard];
+			
+			// Hibernating documents read the changed file as soon as they wake up
+			if (self.isHibernating) {
+				[ULDocumentHibernationCache removeObjectForKey: self->_hibernationCacheKey];
+				success = YES;
+				return;
+			}
+			
+			// Attempt read
 			success = [self coordinatedOpenFromURL:newURL error:&readError];
 		}];
 		
+		ULTraceRecorderEndInteraction();
 		ULNoticeEndURL(self.fileURL);
 		
 		// Handle coordination error
@@ -762,10 +1554,9 @@ NSString *ULDocumentUnhandeledSaveErrorNotificationErrorKey			= @"error";
 		self.revertURL = nil;
 		self.changeDate = self.fileModificationDate;
 		
-		dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
-			if (completionHandler)
-				completionHandler(success);
-		});
+		[self endInteraction: interaction];
+		
+		ULDocumentCallCompletionHandler(queue, completionHandler, success);
 	}];
 }
 
@@ -773,12 +1564,22 @@ NSString *ULDocumentUnhandeledSaveErrorNotificationErrorKey			= @"error";
 {
 	[self disableEditing];
 	
-	[_interactionQueue addOperationWithBlock:^{
+	ULWatchdogToken interaction = [self beginInteraction:ULDocumentInteractionReplaceVersion context:0];
+	
+	[self enqueueInteractionWithPriority:ULDocumentInteractionPriorityUserInitiated block:^{
 		// Replace old contents
 		NSError *error;
 		__block NSError *operationError;
 		
-		[[[NSFileCoordinator alloc] initWithFilePresenter: self->_presenter] coordinateReadingItemAtURL:version.URL options:NSFileCoordinatorReadingWithoutChanges writingItemAtURL:self.fileURL options:NSFileCoordinatorWritingForReplacing error:&error byAccessor:^(NSURL *srcURL, NSURL *destURL) {
+		ULNoticeBeginURL(self.fileURL);
+		ULTraceRecorderBeginInteraction(ULDocumentInteractionReplaceVersion, (__bridge const void *)self);
+		
+		NSFileCoordinator *coordinator = [[NSFileCoordinator alloc] initWithFilePresenter: self->_presenter];
+		[self interaction:interaction willWaitForCoordinator:coordinator];
+		
+		[coordinator coordinateReadingItemAtURL:version.URL options:NSFileCoordinatorReadingWithoutChanges writingItemAtURL:self.fileURL options:NSFileCoordinatorWritingForReplacing error:&error byAccessor:^(NSURL *srcURL, NSURL *destURL) {
+			[self interactionDidAcquireCoordination: interaction];
+			
 			NSError *localError;
 			
 			// Replace file
@@ -788,12 +1589,16 @@ NSString *ULDocumentUnhandeledSaveErrorNotificationErrorKey			= @"error";
 				return;
 			}
 			
-			// Revert contents
+			// Revert contents, dropping all unsaved changes
+			[self.editJournal discard];
 			BOOL success = [self coordinatedOpenFromURL:destURL error:&localError];
 			if (!success)
 				operationError = localError;
 		}];
 		
+		ULTraceRecorderEndInteraction();
+		ULNoticeEndURL(self.fileURL);
+		
 		// Handle coordination error
 		if (error)
 			ULError(@"Error coordinating reading file access on '%@': %@", self.fileURL.path, error);
@@ -807,6 +1612,7 @@ NSString *ULDocumentUnhandeledSaveErrorNotificationErrorKey			= @"error";
 			ULError(@"Cannot replace version '%@' with '%@': %@", self.fileURL.path, version.URL.path, error);
 			
 		[self enableEditing];
+		[self endInteraction: interaction];
 		
 		if (completionHandler)
 			completionHandler(!error);
@@ -838,7 +1644,35 @@ NSString *ULDocumentUnhandeledSaveErrorNotificationErrorKey			= @"error";
 
 - (BOOL)coordinatedOpenFromURL:(NSURL *)url error:(NSError **)outError
 {
-	if (![self readFromURL:url error:outError])
+	// Set again if the contents have been read ahead or are fingerprinted when opening
+	_persistedFingerprint = nil;
+	
+	uint64_t phaseBegin = ULTraceRecorderBeginPhase();
+	BOOL success = NO;
+	
+	// Use contents read ahead of time, if the file did not change since. The file's change token is then known already.
+	ULDocumentPrefetchedContents *prefetchedContents = [self.class takePrefetchedContentsForURL: url];
+	id fileChangeToken = prefetchedContents ? [self.class changeTokenForItemAtURL: url] : nil;
+	
+	if (prefetchedContents && [prefetchedContents.changeToken isEqual: fileChangeToken] && [self readFromFileWrapper:prefetchedContents.fileWrapper error:NULL]) {
+		success = YES;
+		
+		if (!_isReadOnly)
+			_persistedFingerprint = prefetchedContents.fingerprint;
+		
+		pthread_mutex_lock(&ULDocumentPrefetchLock);
+		ULDocumentReadAheadHitCount ++;
+		pthread_mutex_unlock(&ULDocumentPrefetchLock);
+	}
+	
+	if (!success) {
+		success = [self readFromURL:url error:outError];
+		fileChangeToken = nil;
+	}
+	
+	ULTraceRecorderEndPhase(ULDocumentTracePhaseReading, phaseBegin);
+	
+	if (!success)
 		return NO;
 	
 	// Clear dirty state
@@ -848,9 +1682,12 @@ NSString *ULDocumentUnhandeledSaveErrorNotificationErrorKey			= @"error";
 	// Read change date and current version
 	NSDate *fileDate = url.ul_fileModificationDate;
 	self.fileModificationDate = fileDate;
-	self.fileChangeToken = [self.class changeTokenForItemAtURL: url];
+	self.fileChangeToken = fileChangeToken ?: [self.class changeTokenForItemAtURL: url];
 	self.changeToken = self.fileChangeToken;
+	
+	phaseBegin = ULTraceRecorderBeginPhase();
 	self.currentVersion = [NSFileVersion currentVersionOfItemAtURL: self.fileURL];
+	ULTraceRecorderEndPhase(ULDocumentTracePhaseVersionStore, phaseBegin);
 	
 	// Update state
 	self.documentIsOpen = YES;
@@ -867,45 +1704,84 @@ NSString *ULDocumentUnhandeledSaveErrorNotificationErrorKey			= @"error";
 	
 	_deletionPending = NO;
 	
+	// A hibernating document woke up
+	self.isHibernating = NO;
+	self.lastAccessTime = NSProcessInfo.processInfo.systemUptime;
+	[ULDocumentHibernationCache removeObjectForKey: _hibernationCacheKey];
+	
+	if (self.class.supportsHibernation)
+		[self registerForHibernation];
+	
 	return YES;
 }
 
 - (void)saveToURL:(NSURL *)url forSaveOperation:(ULDocumentSaveOperation)saveOperation completionHandler:(void (^)(BOOL success))completionHandler
+{
+	[self saveToURL:url forSaveOperation:saveOperation completionQueue:dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0) completionHandler:completionHandler];
+}
+
+- (void)saveToURL:(NSURL *)url forSaveOperation:(ULDocumentSaveOperation)saveOperation completionQueue:(dispatch_queue_t)queue completionHandler:(void (^)(BOOL success))completionHandler
 {
 	NSParameterAssert(url);
+	[self enqueueSaveToURL:url forSaveOperation:saveOperation completionQueue:queue completionHandler:completionHandler];
+}
+
+- (void)enqueueSaveToURL:(NSURL *)url forSaveOperation:(ULDocumentSaveOperation)saveOperation completionQueue:(dispatch_queue_t)queue completionHandler:(void (^)(BOOL success))completionHandler
+{
+	NSParameterAssert(url || saveOperation == ULDocumentAutosave);
 	
-	[ULDeadlockDetector performOperationWithContext:@(saveOperation) maximumDuration:ULDocumentMaximumSaveDuration delegate:self usingBlock:^(void (^terminationHandler)(void)) {
-		[self->_interactionQueue addOperationWithBlock:^{
-			__autoreleasing NSError *error;
-			
-			// Perform write
-			BOOL success = [self saveToURL:url forSaveOperation:saveOperation error:&error];
-			if (!success) {
-				ULError(@"Error writing file: %@ Path: %@", error, url.path);
-				
-				// Post error notification if needed
-				if (!completionHandler)
-					[self notifyError:error forSaveOperation:saveOperation];
-			}
+	// Supervise the entire save, including the time waiting for preceding interactions
+	ULWatchdogToken interaction = [self beginInteraction:ULDocumentInteractionSave context:saveOperation];
+	ULDocumentInteractionPriority priority = (saveOperation == ULDocumentAutosave) ? ULDocumentInteractionPriorityAutosave : ULDocumentInteractionPriorityUserInitiated;
+	
+	[self enqueueInteractionWithPriority:priority block:^{
+		__autoreleasing NSError *error;
+		BOOL success = YES;
+		
+		// Perform write, unless the changes have been saved by an interaction that overtook this autosave
+		NSURL *saveURL = url;
+		
+		if (saveOperation != ULDocumentAutosave || self.hasUnsavedChanges) {
+			if (!saveURL)
+				saveURL = [self URLForSaveOperation:ULDocumentAutosave ignoreCurrentName:NO];
 			
-			// Finish deadlock detection
-			terminationHandler();
+			success = saveURL && [self saveToURL:saveURL forSaveOperation:saveOperation interaction:interaction error:&error];
+		}
+		
+		if (!success) {
+			ULError(@"Error writing file: %@ Path: %@", error, saveURL.path);
 			
-			// Notify
-			dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
-				if (completionHandler)
-					completionHandler(success);
-			});
-		}];
+			// Post error notification if needed
+			if (!completionHandler)
+				[self notifyError:error forSaveOperation:saveOperation];
+		}
+		
+		[self endInteraction: interaction];
+		
+		// Notify
+		ULDocumentCallCompletionHandler(queue, completionHandler, success);
 	}];
 }
 
 - (BOOL)saveToURL:(NSURL *)url forSaveOperation:(ULDocumentSaveOperation)saveOperation error:(NSError **)outError
+{
+	ULWatchdogToken interaction = [self beginInteraction:ULDocumentInteractionSave context:saveOperation];
+	BOOL success = [self saveToURL:url forSaveOperation:saveOperation interaction:interaction error:outError];
+	[self endInteraction: interaction];
+	
+	return success;
+}
+
+- (BOOL)saveToURL:(NSURL *)url forSaveOperation:(ULDocumentSaveOperation)saveOperation interaction:(ULWatchdogToken)interaction error:(NSError **)outError
 {
 	NSParameterAssert(url);
 	NSError *localError;
 	__block BOOL success = NO;
 	
+	// Released contents cannot be serialized
+	if (self.isHibernating && ![self wakeFromHibernationWithError: outError])
+		return NO;
+	
 	// Only standardize URL, do not resolve exact filename since filename's case may change
 	url = url.ul_URLByFastStandardizingPath;
 	
@@ -916,8 +1792,12 @@ NSString *ULDocumentUnhandeledSaveErrorNotificationErrorKey			= @"error";
 		__block NSError *operationError;
 		
 		ULNoticeBeginURL(self.fileURL);
+		ULTraceRecorderBeginInteraction(ULDocumentInteractionSave, (__bridge const void *)self);
+		[self interaction:interaction willWaitForCoordinator:coordinator];
 		
 		[coordinator ul_coordinateMovingItemAtURL:self.fileURL toURL:url error:&localError byAccessor:^(NSURL *currentURL, NSURL *newURL) {
+			[self interactionDidAcquireCoordination: interaction];
+			
 			// File has been deleted externally
 			if (self->_deletionPending) {
 				operationError = [NSError errorWithDomain:NSCocoaErrorDomain code:0 userInfo:@{NSLocalizedDescriptionKey: @"Deletion pending."}];
@@ -954,16 +1834,23 @@ NSString *ULDocumentUnhandeledSaveErrorNotificationErrorKey			= @"error";
 			ULError(@"Error coordinating file access on '%@': %@", self.fileURL.path, localError);
 		
 		localError = localError ?: operationError;
+		ULTraceRecorderEndInteraction();
 		ULNoticeEndURL(self.fileURL);
 	}
 	// Just writing
 	else {
 		ULNoticeBeginURL(url);
+		ULTraceRecorderBeginInteraction(ULDocumentInteractionSave, (__bridge const void *)self);
 		__block NSError *operationError;
 		
-		[[[NSFileCoordinator alloc] initWithFilePresenter: _presenter] coordinateWritingItemAtURL:url options:0 error:&localError byAccessor:^(NSURL *newURL) {
-			// File has been deleted externally
-			if (self->_deletionPending) {
+		NSFileCoordinator *coordinator = [[NSFileCoordinator alloc] initWithFilePresenter: _presenter];
+		[self interaction:interaction willWaitForCoordinator:coordinator];
+		
+		[coordinator coordinateWritingItemAtURL:url options:0 error:&localError byAccessor:^(NSURL *newURL) {
+			[self interactionDidAcquireCoordination: interaction];
+			
+			// File has been deleted externally
+			if (self->_deletionPending) {
 				operationError = [NSError errorWithDomain:NSCocoaErrorDomain code:0 userInfo:@{NSLocalizedDescriptionKey: @"Deletion pending."}];
 				return;
 			}
@@ -976,6 +1863,7 @@ NSString *ULDocumentUnhandeledSaveErrorNotificationErrorKey			= @"error";
 			ULError(@"Error coordinating file access on '%@': %@", self.fileURL.path, localError);
 		
 		localError = localError ?: operationError;
+		ULTraceRecorderEndInteraction();
 		ULNoticeEndURL(url);
 	}
 	
@@ -993,10 +1881,44 @@ NSString *ULDocumentUnhandeledSaveErrorNotificationErrorKey			= @"error";
 - (BOOL)coordinatedSaveToURL:(NSURL *)url forSaveOperation:(ULDocumentSaveOperation)saveOperation error:(NSError **)outError
 {
 	id lastChangeToken = self.changeToken;
+	
+	// Records contained in the saved contents are marked by the subclass or counted as soon as serialization returned
+	ULEditJournal *editJournal = (saveOperation != ULDocumentSaveTo) ? self.editJournal : nil;
+	_serializedJournalRecordCount = NSNotFound;
+	
+	// Serialize ahead of writing, so saves that would not change the persisted contents can be skipped
+	NSData *fingerprint = nil;
+	
+	if (saveOperation != ULDocumentSaveTo && self.class.writesThroughFileWrapper) {
+		uint64_t phaseBegin = ULTraceRecorderBeginPhase();
+		NSFileWrapper *fileWrapper = [self fileWrapperWithError: outError];
+		[self markJournalRecordsAsSerializedIfNeeded];
+		fingerprint = fileWrapper.ul_contentFingerprint;
+		ULTraceRecorderEndPhase(ULDocumentTracePhaseSerialization, phaseBegin);
+		
+		if (!fileWrapper) {
+			[self breakUndoCoalescing];
+			return NO;
+		}
+		
+		if ([self isPersistedAtURL:url withFingerprint:fingerprint forSaveOperation:saveOperation]) {
+			[self didSkipSaveToURL:url changeToken:lastChangeToken];
+			[editJournal removeRecordsBeforeIndex:_serializedJournalRecordCount baseToken:[self.fileChangeToken description]];
+			return YES;
+		}
+		
+		_serializedFileWrapper = fileWrapper;
+	}
+	
+	uint64_t phaseBegin = ULTraceRecorderBeginPhase();
 	NSDictionary *preservedAttributes = self.fileURL.ul_preservableFileAttributes;
+	ULTraceRecorderEndPhase(ULDocumentTracePhaseAttributeRestore, phaseBegin);
 	
 	// Perform safe write
 	BOOL success = [self writeSafelyToURL:url forSaveOperation:saveOperation error:outError];
+	[self markJournalRecordsAsSerializedIfNeeded];
+	_serializedFileWrapper = nil;
+	
 	if (!success) {
 		// Break undo coalescing, to ensure that further changes will trigger further write errors.
 		[self breakUndoCoalescing];
@@ -1004,8 +1926,11 @@ NSString *ULDocumentUnhandeledSaveErrorNotificationErrorKey			= @"error";
 	}
 	
 	// Restore preserved file attributes if possible
-	if (preservedAttributes.count)
+	if (preservedAttributes.count) {
+		phaseBegin = ULTraceRecorderBeginPhase();
 		[url setResourceValues:preservedAttributes error:NULL];
+		ULTraceRecorderEndPhase(ULDocumentTracePhaseAttributeRestore, phaseBegin);
+	}
 	
 	// Save to does not alter document state
 	if (saveOperation == ULDocumentSaveTo)
@@ -1032,6 +1957,10 @@ NSString *ULDocumentUnhandeledSaveErrorNotificationErrorKey			= @"error";
 	
 	// Update file change token to persisted state. This ensures that stale -presentedItemDidChange notifications will not revert changes happen in memory while saving the file.
 	self.fileChangeToken = [self.class changeTokenForItemAtURL: url];
+	_persistedFingerprint = fingerprint;
+	
+	// Saved changes no longer need to be journaled. Remaining records are based on the saved contents.
+	[editJournal removeRecordsBeforeIndex:_serializedJournalRecordCount baseToken:[self.fileChangeToken description]];
 	
 	// If a change occured while saving: update change count to mark document as dirty and ensure that changeToken is set to a non-persistent value.
 	if (self.changeDate && ![lastChangeToken isEqual: self.changeToken])
@@ -1047,7 +1976,9 @@ NSString *ULDocumentUnhandeledSaveErrorNotificationErrorKey			= @"error";
 		self.changeToken = self.fileChangeToken;
 	
 	// Update current version
+	phaseBegin = ULTraceRecorderBeginPhase();
 	self.currentVersion = [NSFileVersion currentVersionOfItemAtURL: self.fileURL];
+	ULTraceRecorderEndPhase(ULDocumentTracePhaseVersionStore, phaseBegin);
 	
 	// Requires the activation of a new presenter
 	if (!_presenter) {
@@ -1058,6 +1989,42 @@ NSString *ULDocumentUnhandeledSaveErrorNotificationErrorKey			= @"error";
 	return YES;
 }
 
++ (BOOL)readsThroughFileWrapper
+{
+	// Contents can only be read as file wrapper by ULDocument, if the default implementation of -readFromURL:error: is used
+	return (class_getMethodImplementation(self, @selector(readFromURL:error:)) == class_getMethodImplementation(ULDocument.class, @selector(readFromURL:error:)));
+}
+
++ (BOOL)writesThroughFileWrapper
+{
+	// Contents can only be serialized ahead of writing, if the default implementation of -writeToURL:... is used
+	return (class_getMethodImplementation(self, @selector(writeToURL:forSaveOperation:originalContentsURL:error:)) == class_getMethodImplementation(ULDocument.class, @selector(writeToURL:forSaveOperation:originalContentsURL:error:)));
+}
+
+- (BOOL)isPersistedAtURL:(NSURL *)url withFingerprint:(NSData *)fingerprint forSaveOperation:(ULDocumentSaveOperation)saveOperation
+{
+	// Moves and new files must be written
+	if (!_persistedFingerprint || !(saveOperation == ULDocumentSave || saveOperation == ULDocumentAutosave) || ![url.ul_URLByFastStandardizingPath isEqual: self.fileURL.ul_URLByFastStandardizingPath])
+		return NO;
+	
+	// The file must not have been changed since it was read or written
+	return [fingerprint isEqual: _persistedFingerprint] && [self.fileChangeToken isEqual: [self.class changeTokenForItemAtURL: url]];
+}
+
+- (void)didSkipSaveToURL:(NSURL *)url changeToken:(id)lastChangeToken
+{
+	ULNotice(@"Skipping save of unchanged contents to '%@'.", url.path);
+	
+	[self updateChangeCount: ULDocumentChangeCleared];
+	[self breakUndoCoalescing];
+	
+	// Same as after writing: changes while serializing keep the document dirty, otherwise the document represents the persisted contents again
+	if (self.changeDate && ![lastChangeToken isEqual: self.changeToken])
+		[self updateChangeCount: ULDocumentChangeDone | ULDocumentChangeNotUndoable];
+	else if (self.class.usesConsistentPersistenceFormat)
+		self.changeToken = self.fileChangeToken;
+}
+
 #if !TARGET_OS_IPHONE
 
 - (BOOL)writeSafelyToURL:(NSURL *)url forSaveOperation:(ULDocumentSaveOperation)saveOperation error:(NSError **)outError
@@ -1065,72 +2032,80 @@ NSString *ULDocumentUnhandeledSaveErrorNotificationErrorKey			= @"error";
 	NSParameterAssert(url);
 	
 	NSFileManager *fileManager = NSFileManager.defaultManager;
+	ULStagingDirectoryPool *stagingDirectoryPool = ULStagingDirectoryPool.sharedPool;
 	
-	// Fetch URL for appropriate temporary folder (may vary on different Volumes)
-	NSURL *systemTemporaryFolderURL = [fileManager URLForDirectory:NSItemReplacementDirectory inDomain:NSUserDomainMask appropriateForURL:url create:NO	error:outError];
-    if (!systemTemporaryFolderURL)
-        return NO;
-	
-	[NSFileManager.defaultManager removeItemAtURL:systemTemporaryFolderURL error:NULL];
-	
-	// ULYSSES-4940: We're modifying the suggested temporary folder due to random failures when accessing the replacement directory
-	NSURL *temporaryFolderURL = [systemTemporaryFolderURL.URLByDeletingLastPathComponent URLByAppendingPathComponent: NSString.ul_newUniqueIdentifier];
-	if (![NSFileManager.defaultManager createDirectoryAtURL:temporaryFolderURL withIntermediateDirectories:YES attributes:nil error:outError])
+	// Fetch an empty temporary folder on the volume of the document (reused by later saves)
+	NSURL *temporaryFolderURL = [stagingDirectoryPool acquireDirectoryForItemAtURL:url error:outError];
+	if (!temporaryFolderURL)
 		return NO;
 	
 	// Create URL for temporary file
 	NSURL *temporaryFileURL = [temporaryFolderURL URLByAppendingPathComponent: url.lastPathComponent];
 	
+	// Decide ahead whether the old state is stored as version, so it is only copied if needed
+	BOOL shouldAddVersion = NO;
+	
+	if ([url checkResourceIsReachableAndReturnError: NULL]) {
+		switch (saveOperation) {
+			case ULDocumentSave:
+				shouldAddVersion = (self.changeDate && [self.changeDate timeIntervalSinceDate: self.fileModificationDate] > 0);
+				break;
+				
+			case ULDocumentAutosave:
+				shouldAddVersion = (ULDocumentAutoversioningInterval > 0 && self.changeDate && self.currentVersion && [self.changeDate timeIntervalSinceDate: self.currentVersion.modificationDate] > ULDocumentAutoversioningInterval);
+				break;
+				
+			case ULDocumentSaveAs:
+			case ULDocumentSaveTo:
+				shouldAddVersion = (ULDocumentAutoversioningInterval > 0);
+				break;
+		}
+	}
+	
 	// Copy old version to a temporary place for adding it to the version store.
 	// Note: We copy it, since some applications would lose track of the file when moving it away. (e.g. TextEdit)
-	if ([url checkResourceIsReachableAndReturnError: NULL]) {
-		// Fast path: Try hard linking first
-        if (![fileManager linkItemAtURL:url toURL:temporaryFileURL error:NULL]) {
+	uint64_t phaseBegin = ULTraceRecorderBeginPhase();
+	
+	if (shouldAddVersion) {
+		// Fast path: Try hard linking first. Containers are saved in place, which would alter a linked version as well.
+        if (self.class.usesContainerStorage || ![fileManager linkItemAtURL:url toURL:temporaryFileURL error:NULL]) {
             // Linking failed: remove if anything has been generated while linking (e.g. empty folders, see ULYSSES-2533)
             [fileManager removeItemAtURL:temporaryFileURL error:NULL];
 			
             // Slow path: make a full copy.
             if (![fileManager copyItemAtURL:url toURL:temporaryFileURL error:outError]) {
-				// Copying failed: remove entire temporary folder
-                [fileManager removeItemAtURL:temporaryFolderURL error:NULL];
+				// Copying failed: the temporary folder may contain a partial copy
+                [stagingDirectoryPool relinquishDirectory:temporaryFolderURL isEmpty:NO];
                 return NO;
             }
         }
 	}
 	
+	ULTraceRecorderEndPhase(ULDocumentTracePhaseVersionStore, phaseBegin);
+	
 	// Write new version to location
 	if (![self writeToURL:url forSaveOperation:saveOperation originalContentsURL:self.fileURL error:outError]) {
-		// Remove temporary directory
-		[fileManager removeItemAtURL:temporaryFolderURL error:NULL];
+		// Release temporary directory, which still contains the old version if any
+		[stagingDirectoryPool relinquishDirectory:temporaryFolderURL isEmpty:!shouldAddVersion];
 		return NO;
 	}
 
-	// Store old state as version
-	if ([temporaryFileURL checkResourceIsReachableAndReturnError: NULL]) {
-		BOOL shouldAddVersion;
-		
-		switch (saveOperation) {
-			case ULDocumentSave:
-				shouldAddVersion = (self.changeDate && [self.changeDate timeIntervalSinceDate: self.fileModificationDate] > 0);
-				break;
-				
-			case ULDocumentAutosave:
-				shouldAddVersion = (ULDocumentAutoversioningInterval > 0 && self.changeDate && self.currentVersion && [self.changeDate timeIntervalSinceDate: self.currentVersion.modificationDate] > ULDocumentAutoversioningInterval);
-				break;
-				
-			case ULDocumentSaveAs:
-			case ULDocumentSaveTo:
-				shouldAddVersion = (ULDocumentAutoversioningInterval > 0);
-				break;
-		}
+	// Add old state as version to store. Ignore failures, since file systems may not support the version store.
+	BOOL isTemporaryFolderEmpty = !shouldAddVersion;
+	
+	if (shouldAddVersion && [temporaryFileURL checkResourceIsReachableAndReturnError: NULL]) {
+		phaseBegin = ULTraceRecorderBeginPhase();
 		
-		// Add version to store. Ignore failures, since file systems may not support the version store.
-		if (shouldAddVersion && ![NSFileVersion addVersionOfItemAtURL:url withContentsOfURL:temporaryFileURL options:NSFileVersionAddingByMoving error:outError])
+		if ([NSFileVersion addVersionOfItemAtURL:url withContentsOfURL:temporaryFileURL options:NSFileVersionAddingByMoving error:outError])
+			isTemporaryFolderEmpty = YES;
+		else
 			ULNotice(@"Can't store version of item '%@' using temporary URL %@: %@", url, temporaryFileURL, *outError);
+		
+		ULTraceRecorderEndPhase(ULDocumentTracePhaseVersionStore, phaseBegin);
 	}
 	
-	// Remove temporary directory
-	[fileManager removeItemAtURL:temporaryFolderURL error:NULL];
+	// Release temporary directory. It is removed lazily if it could not be emptied.
+	[stagingDirectoryPool relinquishDirectory:temporaryFolderURL isEmpty:isTemporaryFolderEmpty];
 	
 	// Done
 	return YES;
@@ -1168,10 +2143,123 @@ NSString *ULDocumentUnhandeledSaveErrorNotificationErrorKey			= @"error";
 	});
 }
 
-- (void)deadlockDetectorDidExceedTimeLimit:(ULDeadlockDetector *)deadlockDetector
+
+#pragma mark - Interaction supervision
+
+- (NSOperation *)enqueueInteractionWithPriority:(ULDocumentInteractionPriority)priority block:(void (^)(void))block
+{
+	return [self enqueueInteractionWithPriority:priority dependency:nil block:block];
+}
+
+- (NSOperation *)enqueueInteractionWithPriority:(ULDocumentInteractionPriority)priority dependency:(NSOperation *)dependency block:(void (^)(void))block
+{
+	NSTimeInterval enqueueTime = NSProcessInfo.processInfo.systemUptime;
+	
+	NSBlockOperation *operation = [NSBlockOperation blockOperationWithBlock:^{
+		NSTimeInterval waitDuration = NSProcessInfo.processInfo.systemUptime - enqueueTime;
+		
+		pthread_mutex_lock(&ULDocumentInteractionWaitLock);
+		ULDocumentInteractionWaitTimes[priority].count ++;
+		ULDocumentInteractionWaitTimes[priority].totalDuration += waitDuration;
+		ULDocumentInteractionWaitTimes[priority].maximumDuration = MAX(ULDocumentInteractionWaitTimes[priority].maximumDuration, waitDuration);
+		pthread_mutex_unlock(&ULDocumentInteractionWaitLock);
+		
+		block();
+	}];
+	
+	switch (priority) {
+		case ULDocumentInteractionPriorityUserInitiated:
+			operation.queuePriority = NSOperationQueuePriorityHigh;
+			operation.qualityOfService = NSQualityOfServiceUserInitiated;
+			break;
+			
+		case ULDocumentInteractionPriorityAutosave:
+			operation.queuePriority = NSOperationQueuePriorityNormal;
+			operation.qualityOfService = NSQualityOfServiceUtility;
+			break;
+			
+		case ULDocumentInteractionPriorityReconciliation:
+		case ULDocumentInteractionPriorityCount:
+			operation.queuePriority = NSOperationQueuePriorityLow;
+			operation.qualityOfService = NSQualityOfServiceUtility;
+			break;
+	}
+	
+	// Dependencies on foreign operations, e.g. batch operations of multiple documents
+	if (dependency)
+		[operation addDependency: dependency];
+	
+	@synchronized(_interactionQueue) {
+		if (priority == ULDocumentInteractionPriorityUserInitiated) {
+			// Queued autosaves are overtaken, since they re-check for unsaved changes when they run
+			if (_lastOrderedInteraction)
+				[operation addDependency: _lastOrderedInteraction];
+		}
+		else {
+			// Background interactions must see the results of all preceding interactions, e.g. a revert must not overtake a pending save of newer contents. Background interactions and ordered interactions each form a chain, so depending on the end of both chains covers all of them.
+			if (_lastOrderedInteraction)
+				[operation addDependency: _lastOrderedInteraction];
+			
+			if (_lastBackgroundInteraction)
+				[operation addDependency: _lastBackgroundInteraction];
+			
+			_lastBackgroundInteraction = operation;
+		}
+		
+		if (priority != ULDocumentInteractionPriorityAutosave)
+			_lastOrderedInteraction = operation;
+		
+		[_interactionQueue addOperation: operation];
+	}
+	
+	return operation;
+}
+
+- (ULWatchdogToken)beginInteraction:(ULDocumentInteraction)interaction context:(NSUInteger)context
+{
+	NSTimeInterval maximumDuration = (interaction == ULDocumentInteractionSave) ? ULDocumentMaximumSaveDuration : ULDocumentMaximumInteractionDurations[interaction];
+	if (maximumDuration <= 0)
+		return ULWatchdogInvalidToken;
+	
+	return [ULWatchdog.sharedWatchdog beginOperationOfKind:interaction context:context deadline:maximumDuration delegate:self];
+}
+
+- (void)endInteraction:(ULWatchdogToken)interaction
 {
-	NSError *error = [NSError errorWithDomain:NSPOSIXErrorDomain code:EBUSY userInfo:@{NSLocalizedDescriptionKey: @"Reached time out for save operation."}];
-	[self notifyError:error forSaveOperation:[deadlockDetector.context unsignedIntegerValue]];
+	[ULWatchdog.sharedWatchdog endOperation: interaction];
+}
+
+- (void)interaction:(ULWatchdogToken)interaction willWaitForCoordinator:(NSFileCoordinator *)coordinator
+{
+	[ULWatchdog.sharedWatchdog operation:interaction willWaitForCoordinator:coordinator];
+	ULTraceRecorderBeginCoordination();
+}
+
+- (void)interactionDidAcquireCoordination:(ULWatchdogToken)interaction
+{
+	ULTraceRecorderEndCoordination();
+	[ULWatchdog.sharedWatchdog operationDidAcquireCoordination: interaction];
+}
+
+- (void)watchdog:(ULWatchdog *)watchdog operationDidExceedDeadline:(ULWatchdogReport *)report
+{
+	ULError(@"Interaction '%@' on '%@' stalled for %.1fs (waiting %.1fs for coordinator %@)", ULDocumentInteractionName(report.kind), self.fileURL.path, report.duration, report.coordinationDuration, report.coordinator);
+	
+	NSMutableDictionary *userInfo = [NSMutableDictionary new];
+	userInfo[ULDocumentStalledInteractionNotificationInteractionKey] = @(report.kind);
+	userInfo[ULDocumentStalledInteractionNotificationDurationKey] = @(report.duration);
+	userInfo[ULDocumentStalledInteractionNotificationCoordinationDurationKey] = @(report.coordinationDuration);
+	
+	if (report.coordinator)
+		userInfo[ULDocumentStalledInteractionNotificationCoordinatorKey] = report.coordinator;
+	
+	[NSNotificationCenter.defaultCenter postNotificationName:ULDocumentStalledInteractionNotification object:self userInfo:userInfo];
+	
+	// Stalled saves are unhandled save errors as well
+	if (report.kind == ULDocumentInteractionSave) {
+		NSError *error = [NSError errorWithDomain:NSPOSIXErrorDomain code:EBUSY userInfo:@{NSLocalizedDescriptionKey: @"Reached time out for save operation."}];
+		[self notifyError:error forSaveOperation:report.context];
+	}
 }
 
 
@@ -1191,20 +2279,59 @@ NSString *ULDocumentUnhandeledSaveErrorNotificationErrorKey			= @"error";
 
 - (BOOL)readFromURL:(NSURL *)url error:(NSError **)outError
 {
-	NSFileWrapper *wrapper = [[NSFileWrapper alloc] initWithURL:url options:0 error:outError];
+	NSFileWrapper *wrapper = [self.class fileWrapperForReadingURL:url error:outError];
 	if (!wrapper)
 		return NO;
 	
-	return [self readFromFileWrapper:wrapper error:outError];
+	if (![self readFromFileWrapper:wrapper error:outError])
+		return NO;
+	
+	// Allows to detect saves that would not change the file, which otherwise starts with the first save
+	if (!_isReadOnly && self.class.fingerprintsContentsWhenOpening)
+		_persistedFingerprint = wrapper.ul_contentFingerprint;
+	
+	return YES;
+}
+
++ (NSFileWrapper *)fileWrapperForReadingURL:(NSURL *)url error:(NSError **)outError
+{
+	BOOL isDirectory = NO;
+	
+	// Package directories are still read, so they are converted to containers by their next save. Any other file is read as container, so damaged containers are reported as such.
+	if (self.usesContainerStorage && !([NSFileManager.defaultManager fileExistsAtPath:url.path isDirectory:&isDirectory] && isDirectory))
+		return [ULContainerFile fileWrapperWithContentsOfURL:url error:outError];
+	
+	return [[NSFileWrapper alloc] initWithURL:url options:0 error:outError];
 }
 
 - (BOOL)writeToURL:(NSURL *)url forSaveOperation:(ULDocumentSaveOperation)saveOperation originalContentsURL:(NSURL *)originalURL error:(NSError **)outError
 {
-	NSFileWrapper *wrapper = [self fileWrapperWithError: outError];
+	// Use contents serialized ahead by -coordinatedSaveToURL:forSaveOperation:error:
+	NSFileWrapper *wrapper = _serializedFileWrapper;
+	_serializedFileWrapper = nil;
+	
+	uint64_t phaseBegin;
+	
+	if (!wrapper) {
+		phaseBegin = ULTraceRecorderBeginPhase();
+		wrapper = [self fileWrapperWithError: outError];
+		ULTraceRecorderEndPhase(ULDocumentTracePhaseSerialization, phaseBegin);
+	}
+	
 	if (!wrapper)
 		return NO;
 	
-	return [wrapper writeToURL:url options:NSFileWrapperWritingWithNameUpdating|NSFileWrapperWritingAtomic originalContentsURL:originalURL error:outError];
+	phaseBegin = ULTraceRecorderBeginPhase();
+	BOOL success;
+	
+	if (self.class.usesContainerStorage && wrapper.isDirectory)
+		success = [ULContainerFile writeFileWrapper:wrapper toURL:url originalContentsURL:originalURL error:outError];
+	else
+		success = [wrapper writeToURL:url options:NSFileWrapperWritingWithNameUpdating|NSFileWrapperWritingAtomic originalContentsURL:originalURL error:outError];
+	
+	ULTraceRecorderEndPhase(ULDocumentTracePhaseWriting, phaseBegin);
+	
+	return success;
 }
 
 - (NSURL *)preferredURL
@@ -1217,6 +2344,464 @@ NSString *ULDocumentUnhandeledSaveErrorNotificationErrorKey			= @"error";
 	return NO;
 }
 
++ (BOOL)usesContainerStorage
+{
+	return NO;
+}
+
++ (BOOL)fingerprintsContentsWhenOpening
+{
+	return NO;
+}
+
+
+#pragma mark - Edit journal
+
++ (BOOL)usesEditJournal
+{
+	return NO;
+}
+
++ (NSURL *)editJournalDirectoryURL
+{
+	NSURL *applicationSupportURL = [NSFileManager.defaultManager URLForDirectory:NSApplicationSupportDirectory inDomain:NSUserDomainMask appropriateForURL:nil create:NO error:NULL];
+	NSString *applicationName = NSBundle.mainBundle.bundleIdentifier ?: NSProcessInfo.processInfo.processName;
+	
+	return [[applicationSupportURL URLByAppendingPathComponent: applicationName] URLByAppendingPathComponent: @"Edit Journals"];
+}
+
+- (ULEditJournal *)editJournal
+{
+	if (!self.class.usesEditJournal || _isReadOnly)
+		return nil;
+	
+	@synchronized(self) {
+		if (!_editJournal && _fileURL)
+			_editJournal = [[ULEditJournal alloc] initWithURL: [ULEditJournal journalURLForItemAtURL:_fileURL inDirectory:self.class.editJournalDirectoryURL]];
+		
+		return _editJournal;
+	}
+}
+
+- (void)appendJournalRecord:(NSData *)record
+{
+	NSParameterAssert(record);
+	[self.editJournal appendRecord:record baseToken:[self.fileChangeToken description]];
+}
+
+- (void)markJournalRecordsAsSerialized
+{
+	_serializedJournalRecordCount = self.editJournal.recordCount;
+}
+
+- (void)markJournalRecordsAsSerializedIfNeeded
+{
+	// Records appended while serializing are most likely contained in the serialized contents. Replaying them again would apply them twice.
+	if (_serializedJournalRecordCount == NSNotFound)
+		[self markJournalRecordsAsSerialized];
+}
+
+- (void)detachEditJournal
+{
+	ULEditJournal *editJournal;
+	
+	@synchronized(self) {
+		editJournal = _editJournal;
+		_editJournal = nil;
+	}
+	
+	[editJournal synchronize];
+}
+
+- (BOOL)replayJournalRecord:(NSData *)record error:(NSError **)outError
+{
+	NSAssert(NO, @"-replayJournalRecord:error: must be overridden if +usesEditJournal returns YES!");
+	return NO;
+}
+
+- (void)replayEditJournal
+{
+	ULEditJournal *editJournal = self.editJournal;
+	
+	NSString *baseToken;
+	NSArray *records = [editJournal readRecordsWithBaseToken: &baseToken];
+	
+	if (!records.count)
+		return;
+	
+	// Records cannot be applied to other contents, e.g. if the file has been changed externally
+	if (![baseToken isEqual: [self.fileChangeToken description]]) {
+		ULLog(@"Discarding %lu journaled changes of '%@' recorded for other contents.", records.count, self.fileURL.path);
+		[editJournal discard];
+		return;
+	}
+	
+	NSUInteger replayedCount = 0;
+	
+	for (NSData *record in records) {
+		NSError *error;
+		
+		if (![self replayJournalRecord:record error:&error]) {
+			ULError(@"Cannot replay journaled change of '%@': %@", self.fileURL.path, error);
+			break;
+		}
+		
+		replayedCount ++;
+	}
+	
+	// Replayed changes still need to be saved
+	if (replayedCount) {
+		ULLog(@"Restored %lu journaled changes of '%@'.", replayedCount, self.fileURL.path);
+		[self updateChangeCount: ULDocumentChangeDone | ULDocumentChangeNotUndoable];
+	}
+}
+
+
+#pragma mark - Hibernation
+
++ (BOOL)supportsHibernation
+{
+	return NO;
+}
+
+- (id)releaseContentsForHibernation
+{
+	NSAssert(NO, @"-releaseContentsForHibernation must be overridden if +supportsHibernation returns YES!");
+	return nil;
+}
+
+- (BOOL)restoreContentsFromHibernationCache:(id)cache error:(NSError **)outError
+{
+	return NO;
+}
+
++ (void)observeMemoryPressureIfNeeded
+{
+	static dispatch_source_t memoryPressureSource;
+	static dispatch_once_t onceToken;
+	
+	dispatch_once(&onceToken, ^{
+		ULDocumentHibernationCache = [NSCache new];
+		
+		// Under memory pressure, all clean documents hibernate regardless of their last access
+		memoryPressureSource = dispatch_source_create(DISPATCH_SOURCE_TYPE_MEMORYPRESSURE, 0, DISPATCH_MEMORYPRESSURE_WARN | DISPATCH_MEMORYPRESSURE_CRITICAL, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0));
+		dispatch_source_set_event_handler(memoryPressureSource, ^{
+			[ULDocument hibernateDocumentsAccessedBefore: DBL_MAX];
+		});
+		dispatch_resume(memoryPressureSource);
+	});
+}
+
++ (void)hibernateDocumentsAccessedBefore:(NSTimeInterval)time
+{
+	pthread_mutex_lock(&ULDocumentHibernationLock);
+	NSArray *documents = ULDocumentHibernationCandidates.allObjects;
+	pthread_mutex_unlock(&ULDocumentHibernationLock);
+	
+	for (ULDocument *document in documents) {
+		if (!document.isHibernating && !document.hasUnsavedChanges && document.lastAccessTime < time)
+			[document hibernateWithCompletionHandler: nil];
+	}
+}
+
+- (void)registerForHibernation
+{
+	[ULDocument observeMemoryPressureIfNeeded];
+	
+	pthread_mutex_lock(&ULDocumentHibernationLock);
+	if (!ULDocumentHibernationCandidates)
+		ULDocumentHibernationCandidates = [NSHashTable weakObjectsHashTable];
+	
+	[ULDocumentHibernationCandidates addObject: self];
+	pthread_mutex_unlock(&ULDocumentHibernationLock);
+}
+
+- (void)unregisterFromHibernation
+{
+	pthread_mutex_lock(&ULDocumentHibernationLock);
+	[ULDocumentHibernationCandidates removeObject: self];
+	pthread_mutex_unlock(&ULDocumentHibernationLock);
+	
+	[ULDocumentHibernationCache removeObjectForKey: _hibernationCacheKey];
+	self.isHibernating = NO;
+}
+
+- (void)hibernateWithCompletionHandler:(void (^)(BOOL success))completionHandler
+{
+	[self hibernateWithCompletionQueue:dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0) completionHandler:completionHandler];
+}
+
+- (void)hibernateWithCompletionQueue:(dispatch_queue_t)queue completionHandler:(void (^)(BOOL success))completionHandler
+{
+	[self enqueueInteractionWithPriority:ULDocumentInteractionPriorityAutosave block:^{
+		BOOL success = [self hibernateIfPossible];
+		ULDocumentCallCompletionHandler(queue, completionHandler, success);
+	}];
+}
+
+- (BOOL)hibernateIfPossible
+{
+	if (self.isHibernating)
+		return YES;
+	
+	// Contents that are about to change cannot be released
+	if (!self.class.supportsHibernation || !self.documentIsOpen || self.revertURL || _deletionPending)
+		return NO;
+	
+	@synchronized(self) {
+		if (_contentAccessCount || self.hasUnsavedChanges)
+			return NO;
+		
+		// Undo actions may reference the released contents
+		[self.undoManager removeAllActions];
+		
+		id cache = [self releaseContentsForHibernation];
+		
+		if (cache) {
+			NSUInteger cost = [cache respondsToSelector: @selector(length)] ? [cache length] : 0;
+			[ULDocumentHibernationCache setObject:cache forKey:_hibernationCacheKey cost:cost];
+		}
+		
+		self.isHibernating = YES;
+	}
+	
+	ULLog(@"Document '%@' hibernates.", self.fileURL.path);
+	return YES;
+}
+
+- (BOOL)beginContentAccess
+{
+	if (![self registerContentAccess])
+		return YES;
+	
+	// Wake up on the interaction queue, so that no other interaction changes the contents meanwhile
+	__block BOOL success = NO;
+	
+	if (NSOperationQueue.currentQueue == _interactionQueue)
+		success = [self wakeForContentAccess];
+	else
+		[[self enqueueInteractionWithPriority:ULDocumentInteractionPriorityUserInitiated block:^{ success = [self wakeForContentAccess]; }] waitUntilFinished];
+	
+	return success;
+}
+
+- (void)beginContentAccessWithCompletionHandler:(void (^)(BOOL success))completionHandler
+{
+	if (![self registerContentAccess]) {
+		if (completionHandler) completionHandler(YES);
+		return;
+	}
+	
+	[self enqueueInteractionWithPriority:ULDocumentInteractionPriorityUserInitiated block:^{
+		BOOL success = [self wakeForContentAccess];
+		if (completionHandler) completionHandler(success);
+	}];
+}
+
+/*!
+ @abstract Counts a new content access and returns whether the document needs to wake up for it.
+ */
+- (BOOL)registerContentAccess
+{
+	@synchronized(self) {
+		_contentAccessCount ++;
+		self.lastAccessTime = NSProcessInfo.processInfo.systemUptime;
+		return self.isHibernating;
+	}
+}
+
+/*!
+ @abstract Wakes up the document for a content access registered before. Must be called on the interaction queue.
+ */
+- (BOOL)wakeForContentAccess
+{
+	NSError *error;
+	
+	if ([self wakeFromHibernationWithError: &error])
+		return YES;
+	
+	ULError(@"Cannot wake document '%@' from hibernation: %@", self.fileURL.path, error);
+	self.lastReadError = error;
+	
+	// Failed accesses must not be balanced
+	@synchronized(self) {
+		_contentAccessCount --;
+	}
+	
+	return NO;
+}
+
+- (void)endContentAccess
+{
+	@synchronized(self) {
+		NSAssert(_contentAccessCount > 0, @"Unbalanced call of -endContentAccess.");
+		
+		_contentAccessCount --;
+		self.lastAccessTime = NSProcessInfo.processInfo.systemUptime;
+	}
+}
+
+- (BOOL)wakeFromHibernationWithError:(NSError **)outError
+{
+	if (!self.isHibernating)
+		return YES;
+	
+	__block BOOL success = NO;
+	__block NSError *readError;
+	NSError *error;
+	
+	NSFileCoordinator *coordinator = [[NSFileCoordinator alloc] initWithFilePresenter: _presenter];
+	[coordinator coordinateReadingItemAtURL:self.fileURL options:NSFileCoordinatorReadingWithoutChanges error:&error byAccessor:^(NSURL *newURL) {
+		id cache = [ULDocumentHibernationCache objectForKey: self->_hibernationCacheKey];
+		
+		// The cached contents are only valid as long as the file has not been changed
+		if (cache && [self.fileChangeToken isEqual: [self.class changeTokenForItemAtURL: newURL]] && [self restoreContentsFromHibernationCache:cache error:NULL]) {
+			[ULDocumentHibernationCache removeObjectForKey: self->_hibernationCacheKey];
+			self.isHibernating = NO;
+			success = YES;
+			return;
+		}
+		
+		success = [self coordinatedOpenFromURL:newURL error:&readError];
+	}];
+	
+	if (!success && outError)
+		*outError = error ?: readError;
+	
+	return success;
+}
+
+
+#pragma mark - Snapshots
+
+- (void)makeReadOnlySnapshotWithCompletionHandler:(void (^)(id snapshot))completionHandler
+{
+	[self makeReadOnlySnapshotWithCompletionQueue:dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0) completionHandler:completionHandler];
+}
+
+- (void)makeReadOnlySnapshotWithCompletionQueue:(dispatch_queue_t)queue completionHandler:(void (^)(id snapshot))completionHandler
+{
+	[self enqueueInteractionWithPriority:ULDocumentInteractionPriorityUserInitiated block:^{
+		ULDocument *snapshot;
+		NSError *error;
+		
+		if (self.documentIsOpen && [self wakeFromHibernationWithError: &error]) {
+			// Changes made while copying are not covered by the snapshot's change token, just like for saves
+			id changeToken = self.changeToken;
+			
+			snapshot = [[self.class alloc] initWithFileURL:self.fileURL readOnly:YES];
+			
+			if ([self copyContentsToSnapshot:snapshot error:&error]) {
+				[snapshot.undoManager removeAllActions];
+				[snapshot updateChangeCount: ULDocumentChangeCleared];
+				
+				snapshot.fileModificationDate = self.fileModificationDate;
+				snapshot.fileChangeToken = self.fileChangeToken;
+				snapshot.changeToken = changeToken;
+				snapshot.currentVersion = self.currentVersion;
+				snapshot.lastFileOpenDate = self.lastFileOpenDate;
+				snapshot.documentIsOpen = YES;
+			}
+			else {
+				ULError(@"Cannot create snapshot of '%@': %@", self.fileURL.path, error);
+				snapshot = nil;
+			}
+		}
+		
+		if (!completionHandler)
+			return;
+		
+		if (queue) {
+			dispatch_async(queue, ^{
+				completionHandler(snapshot);
+			});
+		}
+		else {
+			completionHandler(snapshot);
+		}
+	}];
+}
+
+- (BOOL)copyContentsToSnapshot:(id)snapshot error:(NSError **)outError
+{
+	// Fallback for classes that do not share their model: a full copy through the serialized contents. Contents can only be passed as file wrapper, if the default implementations of reading and writing are used
+	if (!self.class.readsThroughFileWrapper || !self.class.writesThroughFileWrapper) {
+		if (outError)
+			*outError = [NSError errorWithDomain:NSCocoaErrorDomain code:NSFeatureUnsupportedError userInfo:@{NSLocalizedDescriptionKey: @"Document class does not support snapshots."}];
+		
+		return NO;
+	}
+	
+	NSFileWrapper *fileWrapper = [self fileWrapperWithError: outError];
+	if (!fileWrapper)
+		return NO;
+	
+	return [snapshot readFromFileWrapper:fileWrapper error:outError];
+}
+
+
+#pragma mark - Prefetching
+
+- (void)prefetchSiblings
+{
+	pthread_mutex_lock(&ULDocumentPrefetchLock);
+	ULSiblingPrefetcher *prefetcher = ULDocumentSiblingPrefetcher;
+	BOOL readsSiblingsAhead = (ULDocumentReadAheadContentsCache.totalCostLimit > 0);
+	pthread_mutex_unlock(&ULDocumentPrefetchLock);
+	
+	if (!prefetcher || !self.fileURL)
+		return;
+	
+	Class documentClass = self.class;
+	
+	[prefetcher noteOpenOfItemAtURL:self.fileURL prefetchHandler:!readsSiblingsAhead ? nil : ^(NSURL *url, unsigned long long length) {
+		[documentClass readAheadDocumentAtURL:url cost:length];
+	}];
+}
+
++ (void)readAheadDocumentAtURL:(NSURL *)url cost:(unsigned long long)cost
+{
+	// Only the file wrapper passed to -readFromFileWrapper:error: can be read ahead, parsing needs the document being opened
+	if (!self.readsThroughFileWrapper)
+		return;
+	
+	ULDocumentPrefetchedContents *contents = [ULDocumentPrefetchedContents new];
+	contents.documentClass = self;
+	
+	NSFileCoordinator *coordinator = [[NSFileCoordinator alloc] initWithFilePresenter: nil];
+	
+	[coordinator coordinateReadingItemAtURL:url options:NSFileCoordinatorReadingWithoutChanges error:NULL byAccessor:^(NSURL *newURL) {
+		// Taken before reading, so that changes made while reading invalidate the contents
+		contents.changeToken = [self changeTokenForItemAtURL: newURL];
+		contents.fileWrapper = [self fileWrapperForReadingURL:newURL error:NULL];
+		
+		// Also reads lazily loaded contents while the file is coordinated
+		contents.fingerprint = contents.fileWrapper.ul_contentFingerprint;
+	}];
+	
+	if (!contents.fileWrapper || !contents.changeToken)
+		return;
+	
+	pthread_mutex_lock(&ULDocumentPrefetchLock);
+	[ULDocumentReadAheadContentsCache setObject:contents forKey:url.URLByStandardizingPath.path cost:(NSUInteger)cost];
+	pthread_mutex_unlock(&ULDocumentPrefetchLock);
+}
+
++ (ULDocumentPrefetchedContents *)takePrefetchedContentsForURL:(NSURL *)url
+{
+	NSString *key = url.URLByStandardizingPath.path;
+	
+	pthread_mutex_lock(&ULDocumentPrefetchLock);
+	ULDocumentPrefetchedContents *contents = [ULDocumentReadAheadContentsCache objectForKey: key];
+	
+	if (contents)
+		[ULDocumentReadAheadContentsCache removeObjectForKey: key];
+	
+	pthread_mutex_unlock(&ULDocumentPrefetchLock);
+	
+	return (contents.documentClass == self) ? contents : nil;
+}
+
 
 #pragma mark - File presentation
 
@@ -1256,6 +2841,12 @@ NSString *ULDocumentUnhandeledSaveErrorNotificationErrorKey			= @"error";
 
 - (void)savePresentedItemChangesWithCompletionHandler:(void (^)(NSError *errorOrNil))completionHandler
 {
+	// Saving would wait for the batch move that is waiting for this presenter. Changes are autosaved to the new URL afterwards.
+	if (__atomic_load_n(&_batchMovePending, __ATOMIC_ACQUIRE)) {
+		completionHandler(nil);
+		return;
+	}
+	
 	// Perform autosave if state is dirty
 	[self autosaveWithCompletionHandler: ^(BOOL success) {
 		completionHandler(success ? nil : [NSError errorWithDomain:NSCocoaErrorDomain code:0 userInfo:nil]);
@@ -1269,7 +2860,7 @@ NSString *ULDocumentUnhandeledSaveErrorNotificationErrorKey			= @"error";
 	if (completionHandler)
 		completionHandler(nil);
 	
-	[_interactionQueue addOperationWithBlock:^{
+	[self enqueueInteractionWithPriority:ULDocumentInteractionPriorityReconciliation block:^{
 		[self close];
 		self.fileModificationDate = nil;
 		self.fileChangeToken = nil;
@@ -1279,6 +2870,10 @@ NSString *ULDocumentUnhandeledSaveErrorNotificationErrorKey			= @"error";
 
 - (void)presentedItemDidMoveToURL:(NSURL *)newURL
 {
+	// Batch moves already updated the document
+	if (__atomic_load_n(&_batchMovePending, __ATOMIC_ACQUIRE) && [self.fileURL isEqual: newURL.ul_URLByResolvingExactFilenames])
+		return;
+	
 	self.fileURL = newURL.ul_URLByResolvingExactFilenames;
 	
 	// Notify on document change if change token has been changed
@@ -1291,17 +2886,26 @@ NSString *ULDocumentUnhandeledSaveErrorNotificationErrorKey			= @"error";
 - (void)presentedItemDidChange
 {
 	__weak ULDocument *weakSelf = self;
+	ULWatchdogToken interaction = [self beginInteraction:ULDocumentInteractionChangeNotification context:0];
 	
 	// Dispatch coordinated read on another queue, to ensure that it cannot block/deadlock other coordinators waiting for confirmation of presentation events of this presenter
-	[_interactionQueue addOperationWithBlock:^{
+	[self enqueueInteractionWithPriority:ULDocumentInteractionPriorityReconciliation block:^{
 		ULDocument *strongSelf = weakSelf;
-		if (!strongSelf)
+		if (!strongSelf) {
+			[ULWatchdog.sharedWatchdog endOperation: interaction];
 			return;
+		}
 		
 		ULNoticeBeginURL(strongSelf.fileURL);
+		ULTraceRecorderBeginInteraction(ULDocumentInteractionChangeNotification, (__bridge const void *)strongSelf);
 		
 		NSError *error;
-		[[[NSFileCoordinator alloc] initWithFilePresenter: strongSelf->_presenter] coordinateReadingItemAtURL:strongSelf.fileURL options:NSFileCoordinatorReadingWithoutChanges error:&error byAccessor:^(NSURL *newURL) {
+		NSFileCoordinator *coordinator = [[NSFileCoordinator alloc] initWithFilePresenter: strongSelf->_presenter];
+		[strongSelf interaction:interaction willWaitForCoordinator:coordinator];
+		
+		[coordinator coordinateReadingItemAtURL:strongSelf.fileURL options:NSFileCoordinatorReadingWithoutChanges error:&error byAccessor:^(NSURL *newURL) {
+			[strongSelf interactionDidAcquireCoordination: interaction];
+			
 			newURL = newURL.ul_URLByResolvingExactFilenames;
 			
 			// Item seems to be still reachable
@@ -1320,11 +2924,14 @@ NSString *ULDocumentUnhandeledSaveErrorNotificationErrorKey			= @"error";
 			}
 		}];
 		
+		ULTraceRecorderEndInteraction();
 		ULNoticeEndURL(strongSelf.fileURL);
 		
 		// Handle coordination errors
 		if (error)
 			ULError(@"Error coordinating reading file access on '%@': %@", self.fileURL.path, error);
+		
+		[strongSelf endInteraction: interaction];
 	}];
 }
 
@@ -1342,3 +2949,41 @@ NSString *ULDocumentUnhandeledSaveErrorNotificationErrorKey			= @"error";
 #endif
 
 @end
+
+
+@implementation ULDocumentFlushReport
+{
+	NSMapTable *_errors;
+}
+
+- (instancetype)initWithSavedDocuments:(NSArray *)savedDocuments failedDocuments:(NSArray *)failedDocuments errors:(NSMapTable *)errors unfinishedDocuments:(NSArray *)unfinishedDocuments duration:(NSTimeInterval)duration
+{
+	self = [super init];
+	
+	if (self) {
+		_savedDocuments = savedDocuments;
+		_failedDocuments = failedDocuments;
+		_errors = errors;
+		_unfinishedDocuments = unfinishedDocuments;
+		_duration = duration;
+	}
+	
+	return self;
+}
+
+- (BOOL)isComplete
+{
+	return !_failedDocuments.count && !_unfinishedDocuments.count;
+}
+
+- (NSError *)errorForDocument:(ULDocument *)document
+{
+	return [_errors objectForKey: document];
+}
+
+- (NSString *)description
+{
+	return [NSString stringWithFormat: @"<%@ %p: %lu saved, %lu failed, %lu unfinished, %.3fs>", self.class, self, _savedDocuments.count, _failedDocuments.count, _unfinishedDocuments.count, _duration];
+}
+
+@end
@@ -0,0 +1,302 @@
+//
+//  ULDocumentTrace.m
+//
+//  Copyright © 2018 Ulysses GmbH & Co. KG
+//
+//	Permission is hereby granted, free of charge, to any person obtaining a copy
+//	of this software and associated documentation files (the "Software"), to deal
+//	in the Software without restriction, including without limitation the rights
+//	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//	copies of the Software, and to permit persons to whom the Software is
+//	furnished to do so, subject to the following conditions:
+//
+//	The above copyright notice and this permission notice shall be included in
+//	all copies or substantial portions of the Software.
+//
+//	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//	THE SOFTWARE.
+//
+
+#import "ULDocumentTrace.h"
+
+#import "ULTraceRecorder.h"
+
+static NSString *ULDocumentTracePhaseName(ULDocumentTracePhase phase)
+{
+	switch (phase) {
+		case ULDocumentTracePhaseInteraction:		return @"interaction";
+		case ULDocumentTracePhaseCoordinationWait:	return @"coordination wait";
+		case ULDocumentTracePhaseReading:			return @"reading";
+		case ULDocumentTracePhaseSerialization:		return @"serialization";
+		case ULDocumentTracePhaseWriting:			return @"writing";
+		case ULDocumentTracePhaseAttributeRestore:	return @"attribute restore";
+		case ULDocumentTracePhaseChangeToken:		return @"change token";
+		case ULDocumentTracePhaseVersionStore:		return @"version store";
+		case ULDocumentTracePhaseCount:				break;
+	}
+
+	return @"unknown";
+}
+
+static NSString *ULDocumentTraceInteractionName(NSUInteger interaction)
+{
+	switch (interaction) {
+		case ULDocumentInteractionOpen:					return @"open";
+		case ULDocumentInteractionSave:					return @"save";
+		case ULDocumentInteractionRevert:				return @"revert";
+		case ULDocumentInteractionClose:				return @"close";
+		case ULDocumentInteractionDelete:				return @"delete";
+		case ULDocumentInteractionReplaceVersion:		return @"replace version";
+		case ULDocumentInteractionChangeNotification:	return @"change notification";
+	}
+
+	return @"other";
+}
+
+
+@interface ULDocumentTraceHistogram ()
+
+- (instancetype)initWithHistogram:(const ULTraceRecorderHistogram *)histogram;
+
+@end
+
+@interface ULDocumentTraceEvent ()
+
+@property(nonatomic, readwrite) ULDocumentTracePhase phase;
+@property(nonatomic, readwrite) ULDocumentInteraction interaction;
+@property(nonatomic, readwrite) NSTimeInterval startTime;
+@property(nonatomic, readwrite) NSTimeInterval duration;
+@property(nonatomic, readwrite) NSUInteger threadIdentifier;
+@property(nonatomic, readwrite) NSUInteger documentIdentifier;
+@property(nonatomic, readwrite) NSString *message;
+
+@end
+
+@interface ULDocumentTraceSnapshot ()
+{
+	// Copied histograms by interaction and phase, including phases outside of interactions
+	ULTraceRecorderHistogram _histograms[ULTraceRecorderNoInteraction + 1][ULDocumentTracePhaseCount];
+}
+
+@property(nonatomic, readwrite) NSArray *events;
+
+@end
+
+
+@implementation ULDocumentTrace
+
++ (void)setEnabled:(BOOL)enabled
+{
+	ULTraceRecorderSetEnabled(enabled);
+}
+
++ (BOOL)isEnabled
+{
+	return ULTraceRecorderIsEnabled;
+}
+
++ (ULDocumentTraceSnapshot *)snapshot
+{
+	return [ULDocumentTraceSnapshot new];
+}
+
++ (void)reset
+{
+	ULTraceRecorderReset();
+}
+
+@end
+
+
+@implementation ULDocumentTraceSnapshot
+
+- (instancetype)init
+{
+	self = [super init];
+
+	if (self) {
+		for (NSUInteger interaction = 0; interaction <= ULTraceRecorderNoInteraction; interaction ++) {
+			for (NSUInteger phase = 0; phase < ULDocumentTracePhaseCount; phase ++)
+				ULTraceRecorderCopyHistogram(interaction, phase, &_histograms[interaction][phase]);
+		}
+
+		uint64_t epoch = ULTraceRecorderEpoch();
+		NSMutableArray *events = [NSMutableArray new];
+
+		NSData *recordedEvents = ULTraceRecorderCopyEvents();
+		const ULTraceRecorderEvent *recordedEvent = recordedEvents.bytes;
+
+		for (NSUInteger index = 0; index < recordedEvents.length / sizeof(ULTraceRecorderEvent); index ++, recordedEvent ++) {
+			ULDocumentTraceEvent *event = [ULDocumentTraceEvent new];
+			event.phase = recordedEvent->phase;
+			event.interaction = recordedEvent->interaction;
+			event.startTime = (recordedEvent->beginTime > epoch) ? ULTraceRecorderSecondsForDuration(recordedEvent->beginTime - epoch) : 0;
+			event.duration = ULTraceRecorderSecondsForDuration(recordedEvent->duration);
+			event.threadIdentifier = recordedEvent->thread;
+			event.documentIdentifier = recordedEvent->document;
+			[events addObject: event];
+		}
+
+		for (NSDictionary *notice in ULTraceRecorderCopyNotices()) {
+			uint64_t time = [notice[@"time"] unsignedLongLongValue];
+
+			ULDocumentTraceEvent *event = [ULDocumentTraceEvent new];
+			event.interaction = [notice[@"interaction"] unsignedIntegerValue];
+			event.startTime = (time > epoch) ? ULTraceRecorderSecondsForDuration(time - epoch) : 0;
+			event.threadIdentifier = [notice[@"thread"] unsignedIntegerValue];
+			event.documentIdentifier = [notice[@"document"] unsignedIntegerValue];
+			event.message = notice[@"message"];
+			[events addObject: event];
+		}
+
+		[events sortUsingDescriptors: @[[NSSortDescriptor sortDescriptorWithKey:@"startTime" ascending:YES]]];
+		_events = events;
+	}
+
+	return self;
+}
+
+- (ULDocumentTraceHistogram *)histogramForPhase:(ULDocumentTracePhase)phase ofInteraction:(ULDocumentInteraction)interaction
+{
+	NSParameterAssert(phase < ULDocumentTracePhaseCount && interaction < ULDocumentInteractionCount);
+	return [[ULDocumentTraceHistogram alloc] initWithHistogram: &_histograms[interaction][phase]];
+}
+
+- (ULDocumentTraceHistogram *)histogramForPhase:(ULDocumentTracePhase)phase
+{
+	NSParameterAssert(phase < ULDocumentTracePhaseCount);
+
+	ULTraceRecorderHistogram aggregate = {0};
+
+	for (NSUInteger interaction = 0; interaction <= ULTraceRecorderNoInteraction; interaction ++) {
+		const ULTraceRecorderHistogram *histogram = &_histograms[interaction][phase];
+
+		aggregate.count += histogram->count;
+		aggregate.totalDuration += histogram->totalDuration;
+		aggregate.maximumDuration = MAX(aggregate.maximumDuration, histogram->maximumDuration);
+
+		for (NSUInteger bucket = 0; bucket < ULTraceRecorderBucketCount; bucket ++)
+			aggregate.buckets[bucket] += histogram->buckets[bucket];
+	}
+
+	return [[ULDocumentTraceHistogram alloc] initWithHistogram: &aggregate];
+}
+
+- (NSData *)chromeTraceEventData
+{
+	NSMutableArray *traceEvents = [NSMutableArray new];
+	NSNumber *processIdentifier = @(NSProcessInfo.processInfo.processIdentifier);
+
+	for (ULDocumentTraceEvent *event in _events) {
+		NSMutableDictionary *traceEvent = [NSMutableDictionary new];
+		traceEvent[@"pid"] = processIdentifier;
+		traceEvent[@"tid"] = @(event.threadIdentifier);
+		traceEvent[@"ts"] = @(event.startTime * USEC_PER_SEC);
+		traceEvent[@"cat"] = ULDocumentTraceInteractionName(event.interaction);
+		traceEvent[@"args"] = @{@"document": [NSString stringWithFormat: @"0x%lx", (unsigned long)event.documentIdentifier]};
+
+		if (event.message) {
+			traceEvent[@"name"] = event.message;
+			traceEvent[@"ph"] = @"i";
+			traceEvent[@"s"] = @"t";
+		}
+		else {
+			traceEvent[@"name"] = ULDocumentTracePhaseName(event.phase);
+			traceEvent[@"ph"] = @"X";
+			traceEvent[@"dur"] = @(event.duration * USEC_PER_SEC);
+		}
+
+		[traceEvents addObject: traceEvent];
+	}
+
+	return [NSJSONSerialization dataWithJSONObject:@{@"traceEvents": traceEvents, @"displayTimeUnit": @"ms"} options:0 error:NULL];
+}
+
+- (BOOL)writeChromeTraceEventsToURL:(NSURL *)url error:(NSError **)outError
+{
+	return [self.chromeTraceEventData writeToURL:url options:NSDataWritingAtomic error:outError];
+}
+
+@end
+
+
+@implementation ULDocumentTraceHistogram
+{
+	ULTraceRecorderHistogram _histogram;
+}
+
++ (NSUInteger)bucketCount
+{
+	return ULTraceRecorderBucketCount;
+}
+
++ (NSTimeInterval)upperBoundOfBucket:(NSUInteger)bucket
+{
+	NSParameterAssert(bucket < ULTraceRecorderBucketCount);
+	return (NSTimeInterval)(1ULL << bucket) / USEC_PER_SEC;
+}
+
+- (instancetype)initWithHistogram:(const ULTraceRecorderHistogram *)histogram
+{
+	self = [super init];
+
+	if (self)
+		_histogram = *histogram;
+
+	return self;
+}
+
+- (NSUInteger)count
+{
+	return (NSUInteger)_histogram.count;
+}
+
+- (NSTimeInterval)totalDuration
+{
+	return ULTraceRecorderSecondsForDuration(_histogram.totalDuration);
+}
+
+- (NSTimeInterval)maximumDuration
+{
+	return ULTraceRecorderSecondsForDuration(_histogram.maximumDuration);
+}
+
+- (NSArray *)bucketCounts
+{
+	NSMutableArray *bucketCounts = [NSMutableArray new];
+
+	for (NSUInteger bucket = 0; bucket < ULTraceRecorderBucketCount; bucket ++)
+		[bucketCounts addObject: @(_histogram.buckets[bucket])];
+
+	return bucketCounts;
+}
+
+- (NSTimeInterval)durationAtPercentile:(double)percentile
+{
+	if (!_histogram.count)
+		return 0;
+
+	// The bucket counts may lag behind the total count while recording concurrently
+	uint64_t threshold = MAX(1, (uint64_t)ceil(MIN(MAX(percentile, 0), 1) * _histogram.count));
+	uint64_t accumulated = 0;
+
+	for (NSUInteger bucket = 0; bucket < ULTraceRecorderBucketCount; bucket ++) {
+		accumulated += _histogram.buckets[bucket];
+
+		if (accumulated >= threshold)
+			return MIN([self.class upperBoundOfBucket: bucket], self.maximumDuration);
+	}
+
+	return self.maximumDuration;
+}
+
+@end
+
+
+@implementation ULDocumentTraceEvent
+@end
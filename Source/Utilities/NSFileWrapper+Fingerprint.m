@@ -0,0 +1,82 @@
+//
+//  NSFileWrapper+Fingerprint.m
+//
+//  Copyright © 2018 Ulysses GmbH & Co. KG
+//
+//	Permission is hereby granted, free of charge, to any person obtaining a copy
+//	of this software and associated documentation files (the "Software"), to deal
+//	in the Software without restriction, including without limitation the rights
+//	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//	copies of the Software, and to permit persons to whom the Software is
+//	furnished to do so, subject to the following conditions:
+//
+//	The above copyright notice and this permission notice shall be included in
+//	all copies or substantial portions of the Software.
+//
+//	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//	THE SOFTWARE.
+//
+
+#import "NSFileWrapper+Fingerprint.h"
+
+#import <CommonCrypto/CommonDigest.h>
+
+@implementation NSFileWrapper (Fingerprint)
+
+- (NSData *)ul_contentFingerprint
+{
+	CC_SHA256_CTX context;
+	CC_SHA256_Init(&context);
+	
+	[self ul_updateFingerprintContext: &context];
+	
+	NSMutableData *fingerprint = [NSMutableData dataWithLength: CC_SHA256_DIGEST_LENGTH];
+	CC_SHA256_Final(fingerprint.mutableBytes, &context);
+	
+	return fingerprint;
+}
+
+- (void)ul_updateFingerprintContext:(CC_SHA256_CTX *)context
+{
+	// Each node is tagged by its type and prefixed by its length, so different trees cannot produce the same byte stream
+	if (self.isRegularFile) {
+		[self.class ul_updateFingerprintContext:context withTag:'f' data:self.regularFileContents];
+	}
+	else if (self.isSymbolicLink) {
+		[self.class ul_updateFingerprintContext:context withTag:'l' data:[self.symbolicLinkDestinationURL.relativeString dataUsingEncoding: NSUTF8StringEncoding]];
+	}
+	else if (self.isDirectory) {
+		NSDictionary *fileWrappers = self.fileWrappers;
+		NSArray *names = [fileWrappers.allKeys sortedArrayUsingSelector: @selector(compare:)];
+		
+		uint64_t count = names.count;
+		CC_SHA256_Update(context, "d", 1);
+		CC_SHA256_Update(context, &count, sizeof(count));
+		
+		for (NSString *name in names) {
+			[self.class ul_updateFingerprintContext:context withTag:'n' data:[name dataUsingEncoding: NSUTF8StringEncoding]];
+			[fileWrappers[name] ul_updateFingerprintContext: context];
+		}
+	}
+}
+
++ (void)ul_updateFingerprintContext:(CC_SHA256_CTX *)context withTag:(char)tag data:(NSData *)data
+{
+	uint64_t length = data.length;
+	
+	CC_SHA256_Update(context, &tag, 1);
+	CC_SHA256_Update(context, &length, sizeof(length));
+	
+	// Large contents are hashed in chunks, since CC_SHA256_Update is limited to 32-bit lengths
+	[data enumerateByteRangesUsingBlock:^(const void *bytes, NSRange byteRange, BOOL *stop) {
+		for (NSUInteger offset = 0; offset < byteRange.length; offset += UINT32_MAX)
+			CC_SHA256_Update(context, (const uint8_t *)bytes + offset, (CC_LONG)MIN(byteRange.length - offset, UINT32_MAX));
+	}];
+}
+
+@end
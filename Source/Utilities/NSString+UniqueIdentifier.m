@@ -24,6 +24,8 @@
 
 #import "NSString+UniqueIdentifier.h"
 
+#import <stdatomic.h>
+
 @implementation NSString (UniqueIdentifier)
 
 + (NSString *)ul_newUniqueIdentifier
@@ -40,4 +42,18 @@
 	return uuidString;
 }
 
++ (NSString *)ul_newSequentialIdentifier
+{
+	static uint64_t processNonce;
+	static atomic_uint_fast64_t sequenceCounter;
+	static dispatch_once_t onceToken;
+	
+	dispatch_once(&onceToken, ^{
+		arc4random_buf(&processNonce, sizeof(processNonce));
+	});
+	
+	uint64_t sequenceNumber = atomic_fetch_add_explicit(&sequenceCounter, 1, memory_order_relaxed);
+	return [[NSString alloc] initWithFormat: @"%016llx-%llx", (unsigned long long)processNonce, (unsigned long long)sequenceNumber];
+}
+
 @end
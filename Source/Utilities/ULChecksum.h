@@ -0,0 +1,44 @@
+//
+//  ULChecksum.h
+//
+//  Copyright © 2018 Ulysses GmbH & Co. KG
+//
+//	Permission is hereby granted, free of charge, to any person obtaining a copy
+//	of this software and associated documentation files (the "Software"), to deal
+//	in the Software without restriction, including without limitation the rights
+//	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//	copies of the Software, and to permit persons to whom the Software is
+//	furnished to do so, subject to the following conditions:
+//
+//	The above copyright notice and this permission notice shall be included in
+//	all copies or substantial portions of the Software.
+//
+//	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//	THE SOFTWARE.
+//
+
+#ifndef ULChecksum_h
+#define ULChecksum_h
+
+/*!
+ @abstract A fast, non-cryptographic 64-bit checksum (FNV-1a) used to detect damaged data on disk.
+ */
+static inline uint64_t ULChecksum(const void *bytes, size_t length)
+{
+	const uint8_t *byte = bytes;
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	
+	for (size_t index = 0; index < length; index ++) {
+		hash ^= byte[index];
+		hash *= 0x100000001b3ULL;
+	}
+	
+	return hash;
+}
+
+#endif
@@ -0,0 +1,54 @@
+//
+//  ULContainerFile.h
+//
+//  Copyright © 2018 Ulysses GmbH & Co. KG
+//
+//	Permission is hereby granted, free of charge, to any person obtaining a copy
+//	of this software and associated documentation files (the "Software"), to deal
+//	in the Software without restriction, including without limitation the rights
+//	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//	copies of the Software, and to permit persons to whom the Software is
+//	furnished to do so, subject to the following conditions:
+//
+//	The above copyright notice and this permission notice shall be included in
+//	all copies or substantial portions of the Software.
+//
+//	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//	THE SOFTWARE.
+//
+
+/*!
+ @abstract Stores the contents of a package inside a single container file.
+ @discussion A container consists of two alternating headers, the contents of all entries and an index of the entries. Saving to an existing container appends only changed entries and a new index, then commits the save by overwriting the older header. Each header checksums the index and the entries appended along with it, so a save that did not fully reach the disk falls back to the previous one. Unchanged entries are kept in place. Once unreferenced space exceeds the space of referenced entries, the container is compacted by rewriting it. Changed entries are detected by digests stored in the index, so saves do not read unchanged entries. Containers on local, non-removable volumes are read through a memory mapping, so contents of entries are only paged in when accessed or verified. Containers on other volumes are read into memory, since a mapping of a file that becomes unavailable crashes on access.
+ */
+@interface ULContainerFile : NSObject
+
+/*!
+ @abstract Whether the item at the passed URL is a container with a valid header.
+ @discussion Returns NO for package directories and other files.
+ */
++ (BOOL)isContainerAtURL:(NSURL *)url;
+
+/*!
+ @abstract Reads a container as a directory file wrapper.
+ @discussion The contents of regular files reference the memory mapping or the in-memory copy of the container.
+ */
++ (NSFileWrapper *)fileWrapperWithContentsOfURL:(NSURL *)url error:(NSError **)outError;
+
+/*!
+ @abstract Writes a directory file wrapper as container to the passed URL.
+ @discussion If the URL equals the original contents URL and references a container, changed entries are appended to it. Otherwise a new container is exchanged atomically with the item at the URL, including package directories.
+ */
++ (BOOL)writeFileWrapper:(NSFileWrapper *)fileWrapper toURL:(NSURL *)url originalContentsURL:(NSURL *)originalURL error:(NSError **)outError;
+
+/*!
+ @abstract The generation of the container at the passed URL. Changes with each save, also if the file's attributes do not. Returns 0 if there is no valid container.
+ */
++ (uint64_t)generationOfContainerAtURL:(NSURL *)url;
+
+@end
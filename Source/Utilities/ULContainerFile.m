@@ -0,0 +1,643 @@
+//
+//  ULContainerFile.m
+//
+//  Copyright © 2018 Ulysses GmbH & Co. KG
+//
+//	Permission is hereby granted, free of charge, to any person obtaining a copy
+//	of this software and associated documentation files (the "Software"), to deal
+//	in the Software without restriction, including without limitation the rights
+//	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//	copies of the Software, and to permit persons to whom the Software is
+//	furnished to do so, subject to the following conditions:
+//
+//	The above copyright notice and this permission notice shall be included in
+//	all copies or substantial portions of the Software.
+//
+//	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//	THE SOFTWARE.
+//
+
+#import "ULContainerFile.h"
+
+#import "ULChecksum.h"
+#import "ULStagingDirectoryPool.h"
+
+#import <CommonCrypto/CommonDigest.h>
+#import <fcntl.h>
+#import <sys/mman.h>
+#import <sys/stat.h>
+#import <unistd.h>
+
+// Identifies the container format
+#define ULContainerFileMagic					"ULC1"
+#define ULContainerFileVersion					3
+
+// Unreferenced space below this length never causes a compaction
+#define ULContainerFileMinimumCompactionLength	(256 * 1024)
+
+/*!
+ @abstract One of the headers at the begin of a container. The valid header with the highest generation is current, a save overwrites the other one.
+ */
+typedef struct {
+	char		magic[4];
+	uint32_t	version;
+	uint64_t	generation;
+	uint64_t	indexOffset;
+	uint64_t	indexLength;
+	uint64_t	liveLength;						// Length of all referenced entries and the index
+	uint64_t	indexChecksum;
+	uint64_t	appendedOffset;					// Begin of the entries written by the save that wrote this header, which end at the index
+	uint64_t	appendedChecksum;				// Of the entries written by the save that wrote this header
+	uint64_t	checksum;						// Of all preceding fields
+} ULContainerFileHeader;
+
+#define ULContainerFileHeaderCount				2
+#define ULContainerFileDataOffset				(ULContainerFileHeaderCount * sizeof(ULContainerFileHeader))
+
+typedef NS_ENUM(uint32_t, ULContainerFileEntryType) {
+	ULContainerFileEntryRegularFile				= 0,
+	ULContainerFileEntryDirectory				= 1,
+	ULContainerFileEntrySymbolicLink			= 2,
+};
+
+/*!
+ @abstract Precedes the path of each entry inside the index. Paths are padded to a multiple of 8 bytes.
+ */
+typedef struct {
+	uint64_t	offset;
+	uint64_t	length;
+	uint32_t	type;
+	uint32_t	pathLength;
+	uint8_t		digest[CC_SHA256_DIGEST_LENGTH];	// Of the contents, allows saves to detect unchanged entries without reading them
+} ULContainerFileIndexRecord;
+
+typedef NS_ENUM(NSUInteger, ULContainerFileAppendResult) {
+	ULContainerFileAppended,
+	ULContainerFileNeedsRewrite,
+	ULContainerFileAppendFailed,
+};
+
+
+/*!
+ @abstract An entry of a container. The contents of a symbolic link is its destination path.
+ */
+@interface ULContainerFileEntry : NSObject
+
+@property(nonatomic) NSString *path;
+@property(nonatomic) ULContainerFileEntryType type;
+@property(nonatomic) uint64_t offset;
+@property(nonatomic) uint64_t length;
+@property(nonatomic) NSData *digest;
+
+// Only set for entries that are about to be written
+@property(nonatomic) NSData *contents;
+
+@end
+
+@implementation ULContainerFileEntry
+@end
+
+
+static inline size_t ULContainerFilePaddedLength(size_t length)
+{
+	return (length + 7) & ~(size_t)7;
+}
+
+static NSError *ULContainerFilePOSIXError(int code, NSURL *url)
+{
+	return [NSError errorWithDomain:NSPOSIXErrorDomain code:code userInfo:@{NSURLErrorKey: url}];
+}
+
+static NSError *ULContainerFileCorruptError(NSURL *url)
+{
+	return [NSError errorWithDomain:NSCocoaErrorDomain code:NSFileReadCorruptFileError userInfo:@{NSURLErrorKey: url, NSLocalizedDescriptionKey: @"Invalid container file."}];
+}
+
+static NSData *ULContainerFileDigest(NSData *contents)
+{
+	NSMutableData *digest = [NSMutableData dataWithLength: CC_SHA256_DIGEST_LENGTH];
+	CC_SHA256(contents.bytes, (CC_LONG)contents.length, digest.mutableBytes);
+	
+	return digest;
+}
+
+/*!
+ @abstract Whether the file at the passed URL may be referenced by a memory mapping for a long time.
+ @discussion Accessing a mapping raises SIGBUS once the mapped file becomes unavailable, e.g. because its volume has been ejected or disconnected from the network.
+ */
+static BOOL ULContainerFileCanMapURL(NSURL *url)
+{
+	NSDictionary *values = [url resourceValuesForKeys:@[NSURLVolumeIsLocalKey, NSURLVolumeIsRemovableKey, NSURLVolumeIsEjectableKey] error:NULL];
+	return [values[NSURLVolumeIsLocalKey] boolValue] && ![values[NSURLVolumeIsRemovableKey] boolValue] && ![values[NSURLVolumeIsEjectableKey] boolValue];
+}
+
+/*!
+ @abstract Maps the file opened by the passed descriptor, or reads it into memory if mapping is not requested. The mapping remains valid after closing the file and is unmapped once the returned data has been released.
+ */
+static dispatch_data_t ULContainerFileLoad(int fd, BOOL mapsFile, const uint8_t **outBytes, size_t *outLength)
+{
+	struct stat status;
+	
+	if (fstat(fd, &status) != 0)
+		return nil;
+	
+	size_t length = (size_t)status.st_size;
+	*outLength = length;
+	*outBytes = NULL;
+	
+	if (!length)
+		return dispatch_data_empty;
+	
+	if (mapsFile) {
+		void *bytes = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+		if (bytes == MAP_FAILED)
+			return nil;
+		
+		*outBytes = bytes;
+		
+		return dispatch_data_create(bytes, length, NULL, ^{
+			munmap(bytes, length);
+		});
+	}
+	
+	uint8_t *bytes = malloc(length);
+	if (!bytes)
+		return nil;
+	
+	for (size_t readLength = 0; readLength < length; ) {
+		ssize_t result = pread(fd, bytes + readLength, length - readLength, (off_t)readLength);
+		
+		if (result < 0 && errno == EINTR)
+			continue;
+		
+		if (result <= 0) {
+			if (!result) errno = EIO;
+			free(bytes);
+			return nil;
+		}
+		
+		readLength += (size_t)result;
+	}
+	
+	*outBytes = bytes;
+	return dispatch_data_create(bytes, length, NULL, DISPATCH_DATA_DESTRUCTOR_FREE);
+}
+
+/*!
+ @abstract Synchronizes the file opened by the passed descriptor to permanent storage.
+ */
+static BOOL ULContainerFileSynchronize(int fd)
+{
+	// A plain fsync does not flush the drive's cache on Darwin
+#ifdef F_FULLFSYNC
+	if (fcntl(fd, F_FULLFSYNC) == 0)
+		return YES;
+#endif
+	
+	return (fsync(fd) == 0);
+}
+
+/*!
+ @abstract Finds the current header of a container and passes out its slot. The index and the entries written along with it are only validated if the passed bytes include them.
+ @discussion If the entries or the index of the most recent save did not fully reach the disk, the header of the previous save is used instead.
+ */
+static BOOL ULContainerFileReadHeader(const uint8_t *bytes, size_t length, BOOL validateIndex, ULContainerFileHeader *outHeader, NSUInteger *outSlot)
+{
+	BOOL didFindHeader = NO;
+	
+	for (NSUInteger slot = 0; slot < ULContainerFileHeaderCount && (slot + 1) * sizeof(ULContainerFileHeader) <= length; slot ++) {
+		ULContainerFileHeader header;
+		memcpy(&header, bytes + slot * sizeof(header), sizeof(header));
+		
+		if (memcmp(header.magic, ULContainerFileMagic, sizeof(header.magic)) != 0 || header.version != ULContainerFileVersion || header.checksum != ULChecksum(&header, offsetof(ULContainerFileHeader, checksum)))
+			continue;
+		
+		if (didFindHeader && header.generation <= outHeader->generation)
+			continue;
+		
+		if (validateIndex && (header.indexOffset < ULContainerFileDataOffset || header.indexOffset > length || header.indexLength > length - header.indexOffset || ULChecksum(bytes + header.indexOffset, header.indexLength) != header.indexChecksum))
+			continue;
+		
+		if (validateIndex && (header.appendedOffset < ULContainerFileDataOffset || header.appendedOffset > header.indexOffset || ULChecksum(bytes + header.appendedOffset, header.indexOffset - header.appendedOffset) != header.appendedChecksum))
+			continue;
+		
+		*outHeader = header;
+		if (outSlot) *outSlot = slot;
+		didFindHeader = YES;
+	}
+	
+	return didFindHeader;
+}
+
+/*!
+ @abstract Finds the current header of the container at the passed URL without reading its index. Fails for package directories and other files.
+ */
+static BOOL ULContainerFileReadHeaderAtURL(NSURL *url, ULContainerFileHeader *outHeader)
+{
+	int fd = open(url.fileSystemRepresentation, O_RDONLY);
+	if (fd < 0)
+		return NO;
+	
+	uint8_t bytes[ULContainerFileDataOffset];
+	ssize_t length = pread(fd, bytes, sizeof(bytes), 0);
+	close(fd);
+	
+	return (length >= 0) && ULContainerFileReadHeader(bytes, (size_t)length, NO, outHeader, NULL);
+}
+
+static NSArray *ULContainerFileParseIndex(const uint8_t *bytes, size_t length, const ULContainerFileHeader *header)
+{
+	NSMutableArray *entries = [NSMutableArray new];
+	const uint8_t *record = bytes + header->indexOffset;
+	const uint8_t *indexEnd = record + header->indexLength;
+	
+	while (record < indexEnd) {
+		ULContainerFileIndexRecord indexRecord;
+		
+		if ((size_t)(indexEnd - record) < sizeof(indexRecord))
+			return nil;
+		
+		memcpy(&indexRecord, record, sizeof(indexRecord));
+		record += sizeof(indexRecord);
+		
+		size_t paddedLength = ULContainerFilePaddedLength(indexRecord.pathLength);
+		if ((size_t)(indexEnd - record) < paddedLength || indexRecord.offset > length || indexRecord.length > length - indexRecord.offset)
+			return nil;
+		
+		ULContainerFileEntry *entry = [ULContainerFileEntry new];
+		entry.path = [[NSString alloc] initWithBytes:record length:indexRecord.pathLength encoding:NSUTF8StringEncoding];
+		entry.type = indexRecord.type;
+		entry.offset = indexRecord.offset;
+		entry.length = indexRecord.length;
+		entry.digest = [NSData dataWithBytes:indexRecord.digest length:sizeof(indexRecord.digest)];
+		
+		if (!entry.path.length)
+			return nil;
+		
+		[entries addObject: entry];
+		record += paddedLength;
+	}
+	
+	return entries;
+}
+
+static NSData *ULContainerFileIndexData(NSArray *entries)
+{
+	NSMutableData *data = [NSMutableData new];
+	
+	for (ULContainerFileEntry *entry in entries) {
+		NSData *path = [entry.path dataUsingEncoding: NSUTF8StringEncoding];
+		ULContainerFileIndexRecord record = {entry.offset, entry.length, entry.type, (uint32_t)path.length};
+		[entry.digest getBytes:record.digest length:sizeof(record.digest)];
+		
+		[data appendBytes:&record length:sizeof(record)];
+		[data appendData: path];
+		[data increaseLengthBy: ULContainerFilePaddedLength(path.length) - path.length];
+	}
+	
+	return data;
+}
+
+static ULContainerFileHeader ULContainerFileMakeHeader(uint64_t generation, uint64_t appendedOffset, NSData *appendedData, uint64_t indexOffset, NSData *indexData, uint64_t liveLength)
+{
+	ULContainerFileHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, ULContainerFileMagic, sizeof(header.magic));
+	
+	header.version = ULContainerFileVersion;
+	header.generation = generation;
+	header.indexOffset = indexOffset;
+	header.indexLength = indexData.length;
+	header.liveLength = liveLength;
+	header.indexChecksum = ULChecksum(indexData.bytes, indexData.length);
+	header.appendedOffset = appendedOffset;
+	header.appendedChecksum = ULChecksum(appendedData.bytes, appendedData.length);
+	header.checksum = ULChecksum(&header, offsetof(ULContainerFileHeader, checksum));
+	
+	return header;
+}
+
+/*!
+ @abstract Flattens a directory file wrapper into entries, sorted by path. Directories are stored as entries of their own, so empty directories survive.
+ */
+static void ULContainerFileCollectEntries(NSFileWrapper *fileWrapper, NSString *path, NSMutableArray *entries)
+{
+	NSDictionary *fileWrappers = fileWrapper.fileWrappers;
+	
+	for (NSString *name in [fileWrappers.allKeys sortedArrayUsingSelector: @selector(compare:)]) {
+		NSFileWrapper *childWrapper = fileWrappers[name];
+		
+		ULContainerFileEntry *entry = [ULContainerFileEntry new];
+		entry.path = path ? [path stringByAppendingPathComponent: name] : name;
+		
+		if (childWrapper.isDirectory) {
+			entry.type = ULContainerFileEntryDirectory;
+			entry.contents = [NSData new];
+		}
+		else if (childWrapper.isSymbolicLink) {
+			// Relative destinations are kept as they are, like their fingerprint does
+			entry.type = ULContainerFileEntrySymbolicLink;
+			entry.contents = [childWrapper.symbolicLinkDestinationURL.relativeString dataUsingEncoding: NSUTF8StringEncoding] ?: [NSData new];
+		}
+		else {
+			entry.type = ULContainerFileEntryRegularFile;
+			entry.contents = childWrapper.regularFileContents ?: [NSData new];
+		}
+		
+		entry.length = entry.contents.length;
+		entry.digest = ULContainerFileDigest(entry.contents);
+		[entries addObject: entry];
+		
+		if (childWrapper.isDirectory)
+			ULContainerFileCollectEntries(childWrapper, entry.path, entries);
+	}
+}
+
+static NSFileWrapper *ULContainerFileDirectoryWrapper(NSMutableDictionary *directoryWrappers, NSString *path)
+{
+	NSFileWrapper *directoryWrapper = directoryWrappers[path];
+	
+	// Creates intermediate directories that have no entry of their own
+	if (!directoryWrapper) {
+		directoryWrapper = [[NSFileWrapper alloc] initDirectoryWithFileWrappers: @{}];
+		directoryWrapper.preferredFilename = path.lastPathComponent;
+		directoryWrappers[path] = directoryWrapper;
+		
+		[ULContainerFileDirectoryWrapper(directoryWrappers, path.stringByDeletingLastPathComponent) addFileWrapper: directoryWrapper];
+	}
+	
+	return directoryWrapper;
+}
+
+static BOOL ULContainerFileWriteData(int fd, NSData *data, off_t offset)
+{
+	const uint8_t *bytes = data.bytes;
+	NSUInteger remainingLength = data.length;
+	
+	while (remainingLength) {
+		ssize_t writtenLength = pwrite(fd, bytes, remainingLength, offset);
+		
+		if (writtenLength < 0) {
+			if (errno == EINTR)
+				continue;
+			
+			return NO;
+		}
+		
+		bytes += writtenLength;
+		offset += writtenLength;
+		remainingLength -= writtenLength;
+	}
+	
+	return YES;
+}
+
+
+@implementation ULContainerFile
+
++ (BOOL)isContainerAtURL:(NSURL *)url
+{
+	ULContainerFileHeader header;
+	return ULContainerFileReadHeaderAtURL(url, &header);
+}
+
++ (NSFileWrapper *)fileWrapperWithContentsOfURL:(NSURL *)url error:(NSError **)outError
+{
+	int fd = open(url.fileSystemRepresentation, O_RDONLY);
+	
+	if (fd < 0) {
+		if (outError) *outError = ULContainerFilePOSIXError(errno, url);
+		return nil;
+	}
+	
+	// File wrappers reference the mapping as long as the document keeps them, which is only safe for files that cannot disappear
+	const uint8_t *bytes;
+	size_t length;
+	dispatch_data_t mapping NS_VALID_UNTIL_END_OF_SCOPE = ULContainerFileLoad(fd, ULContainerFileCanMapURL(url), &bytes, &length);
+	int mappingError = errno;
+	close(fd);
+	
+	if (!mapping) {
+		if (outError) *outError = ULContainerFilePOSIXError(mappingError, url);
+		return nil;
+	}
+	
+	ULContainerFileHeader header;
+	NSArray *entries = ULContainerFileReadHeader(bytes, length, YES, &header, NULL) ? ULContainerFileParseIndex(bytes, length, &header) : nil;
+	
+	if (!entries) {
+		if (outError) *outError = ULContainerFileCorruptError(url);
+		return nil;
+	}
+	
+	// Entries are sorted by path, so directories precede their contents
+	NSFileWrapper *rootWrapper = [[NSFileWrapper alloc] initDirectoryWithFileWrappers: @{}];
+	NSMutableDictionary *directoryWrappers = [NSMutableDictionary dictionaryWithObject:rootWrapper forKey:@""];
+	
+	for (ULContainerFileEntry *entry in entries) {
+		NSFileWrapper *wrapper;
+		
+		switch (entry.type) {
+			case ULContainerFileEntryDirectory:
+				ULContainerFileDirectoryWrapper(directoryWrappers, entry.path);
+				continue;
+				
+			case ULContainerFileEntrySymbolicLink: {
+				NSString *destination = [[NSString alloc] initWithBytes:bytes + entry.offset length:(NSUInteger)entry.length encoding:NSUTF8StringEncoding] ?: @"";
+				wrapper = [[NSFileWrapper alloc] initSymbolicLinkWithDestinationURL: [NSURL URLWithString: destination] ?: [NSURL fileURLWithPath: destination]];
+				break;
+			}
+				
+			default:
+				// References the loaded container instead of copying the contents
+				wrapper = [[NSFileWrapper alloc] initRegularFileWithContents: (NSData *)dispatch_data_create_subrange(mapping, (size_t)entry.offset, (size_t)entry.length)];
+				break;
+		}
+		
+		wrapper.preferredFilename = entry.path.lastPathComponent;
+		[ULContainerFileDirectoryWrapper(directoryWrappers, entry.path.stringByDeletingLastPathComponent) addFileWrapper: wrapper];
+	}
+	
+	return rootWrapper;
+}
+
++ (BOOL)writeFileWrapper:(NSFileWrapper *)fileWrapper toURL:(NSURL *)url originalContentsURL:(NSURL *)originalURL error:(NSError **)outError
+{
+	NSParameterAssert(fileWrapper.isDirectory);
+	
+	NSMutableArray *entries = [NSMutableArray new];
+	ULContainerFileCollectEntries(fileWrapper, nil, entries);
+	
+	// Saving in place appends changed entries, unless the container is unreadable or needs to be compacted
+	if (originalURL && [url.URLByStandardizingPath isEqual: originalURL.URLByStandardizingPath] && [self isContainerAtURL: url]) {
+		switch ([self appendEntries:entries toContainerAtURL:url error:outError]) {
+			case ULContainerFileAppended:
+				return YES;
+				
+			case ULContainerFileAppendFailed:
+				return NO;
+				
+			case ULContainerFileNeedsRewrite:
+				break;
+		}
+	}
+	
+	return [self writeEntries:entries toURL:url error:outError];
+}
+
++ (uint64_t)generationOfContainerAtURL:(NSURL *)url
+{
+	ULContainerFileHeader header;
+	
+	if (!ULContainerFileReadHeaderAtURL(url, &header))
+		return 0;
+	
+	return header.generation;
+}
+
+
+#pragma mark - Writing
+
++ (ULContainerFileAppendResult)appendEntries:(NSArray *)entries toContainerAtURL:(NSURL *)url error:(NSError **)outError
+{
+	int fd = open(url.fileSystemRepresentation, O_RDWR);
+	
+	if (fd < 0) {
+		if (outError) *outError = ULContainerFilePOSIXError(errno, url);
+		return ULContainerFileAppendFailed;
+	}
+	
+	// The mapping only lives while appending, so it pages in no more than the headers, the index and the entries appended last
+	const uint8_t *bytes;
+	size_t length;
+	dispatch_data_t mapping NS_VALID_UNTIL_END_OF_SCOPE = ULContainerFileLoad(fd, YES, &bytes, &length);
+	
+	ULContainerFileHeader header;
+	NSUInteger slot;
+	NSArray *currentEntries = (mapping && ULContainerFileReadHeader(bytes, length, YES, &header, &slot)) ? ULContainerFileParseIndex(bytes, length, &header) : nil;
+	
+	if (!currentEntries) {
+		close(fd);
+		return ULContainerFileNeedsRewrite;
+	}
+	
+	NSMutableDictionary *currentEntriesByPath = [NSMutableDictionary new];
+	
+	for (ULContainerFileEntry *entry in currentEntries)
+		currentEntriesByPath[entry.path] = entry;
+	
+	// Unchanged entries keep their location, changed entries are appended behind all existing data. Entries are compared by their digests, so unchanged entries are not read.
+	NSMutableData *appendedData = [NSMutableData new];
+	uint64_t liveLength = 0;
+	
+	for (ULContainerFileEntry *entry in entries) {
+		ULContainerFileEntry *currentEntry = currentEntriesByPath[entry.path];
+		
+		if (currentEntry && currentEntry.type == entry.type && currentEntry.length == entry.length && [currentEntry.digest isEqual: entry.digest]) {
+			entry.offset = currentEntry.offset;
+		}
+		else {
+			entry.offset = length + appendedData.length;
+			[appendedData appendData: entry.contents];
+		}
+		
+		liveLength += entry.length;
+	}
+	
+	NSData *indexData = ULContainerFileIndexData(entries);
+	uint64_t indexOffset = length + appendedData.length;
+	liveLength += indexData.length;
+	
+	// Nothing has changed
+	if (!appendedData.length && indexData.length == header.indexLength && memcmp(indexData.bytes, bytes + header.indexOffset, indexData.length) == 0) {
+		close(fd);
+		return ULContainerFileAppended;
+	}
+	
+	// Compact by rewriting once most of the container is unreferenced
+	uint64_t deadLength = indexOffset + indexData.length - ULContainerFileDataOffset - liveLength;
+	
+	if (deadLength > liveLength && deadLength > ULContainerFileMinimumCompactionLength) {
+		close(fd);
+		return ULContainerFileNeedsRewrite;
+	}
+	
+	ULContainerFileHeader updatedHeader = ULContainerFileMakeHeader(header.generation + 1, length, appendedData, indexOffset, indexData, liveLength);
+	NSData *headerData = [NSData dataWithBytes:&updatedHeader length:sizeof(updatedHeader)];
+	[appendedData appendData: indexData];
+	
+	// The save is committed by overwriting the older header only after entries and index reached the disk. An interrupted save leaves the current header intact, and the checksums of the new header reject entries that did not reach the disk in spite of the barrier.
+	BOOL success = ULContainerFileWriteData(fd, appendedData, (off_t)length) && ULContainerFileSynchronize(fd) && ULContainerFileWriteData(fd, headerData, (off_t)((1 - slot) * sizeof(updatedHeader))) && ULContainerFileSynchronize(fd);
+	int writeError = errno;
+	close(fd);
+	
+	if (!success) {
+		if (outError) *outError = ULContainerFilePOSIXError(writeError, url);
+		return ULContainerFileAppendFailed;
+	}
+	
+	return ULContainerFileAppended;
+}
+
++ (BOOL)writeEntries:(NSArray *)entries toURL:(NSURL *)url error:(NSError **)outError
+{
+	NSFileManager *fileManager = [NSFileManager new];
+	ULStagingDirectoryPool *stagingDirectoryPool = ULStagingDirectoryPool.sharedPool;
+	
+	NSURL *temporaryDirectoryURL = [stagingDirectoryPool acquireDirectoryForItemAtURL:url error:outError];
+	if (!temporaryDirectoryURL)
+		return NO;
+	
+	NSURL *temporaryURL = [temporaryDirectoryURL URLByAppendingPathComponent: url.lastPathComponent];
+	
+	// Lay out all entries behind the headers and the index behind all entries
+	NSMutableData *data = [NSMutableData dataWithLength: ULContainerFileDataOffset];
+	uint64_t liveLength = 0;
+	
+	for (ULContainerFileEntry *entry in entries) {
+		entry.offset = data.length;
+		[data appendData: entry.contents];
+		
+		liveLength += entry.length;
+	}
+	
+	NSData *indexData = ULContainerFileIndexData(entries);
+	uint64_t indexOffset = data.length;
+	[data appendData: indexData];
+	
+	// Generations of new containers start at random, so they differ from the generation of any replaced container
+	// All entries are synchronized before the container is moved into place, so there are no entries to verify on reading
+	ULContainerFileHeader header = ULContainerFileMakeHeader((uint64_t)arc4random() << 32, indexOffset, [NSData new], indexOffset, indexData, liveLength + indexData.length);
+	[data replaceBytesInRange:NSMakeRange(0, sizeof(header)) withBytes:&header];
+	
+	int fd = open(temporaryURL.fileSystemRepresentation, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	BOOL success = (fd >= 0) && ULContainerFileWriteData(fd, data, 0) && ULContainerFileSynchronize(fd);
+	NSError *error = success ? nil : ULContainerFilePOSIXError(errno, url);
+	
+	if (fd >= 0)
+		close(fd);
+	
+	// Existing items are exchanged with the new container, so the URL references either the old or the new contents at any time. This also replaces package directories, which cannot be replaced by renaming.
+	if (success && [fileManager fileExistsAtPath: url.path]) {
+		success = [fileManager replaceItemAtURL:url withItemAtURL:temporaryURL backupItemName:nil options:NSFileManagerItemReplacementUsingNewMetadataOnly resultingItemURL:NULL error:&error];
+	}
+	else if (success && rename(temporaryURL.fileSystemRepresentation, url.fileSystemRepresentation) != 0) {
+		error = ULContainerFilePOSIXError(errno, url);
+		success = NO;
+	}
+	
+	// The directory is removed if the new container or the replaced item have been left behind
+	[stagingDirectoryPool relinquishDirectory:temporaryDirectoryURL isEmpty:([fileManager contentsOfDirectoryAtPath:temporaryDirectoryURL.path error:NULL].count == 0)];
+	
+	if (!success && outError)
+		*outError = error;
+	
+	return success;
+}
+
+@end
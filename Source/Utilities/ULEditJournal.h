@@ -0,0 +1,84 @@
+//
+//  ULEditJournal.h
+//
+//  Copyright © 2018 Ulysses GmbH & Co. KG
+//
+//	Permission is hereby granted, free of charge, to any person obtaining a copy
+//	of this software and associated documentation files (the "Software"), to deal
+//	in the Software without restriction, including without limitation the rights
+//	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//	copies of the Software, and to permit persons to whom the Software is
+//	furnished to do so, subject to the following conditions:
+//
+//	The above copyright notice and this permission notice shall be included in
+//	all copies or substantial portions of the Software.
+//
+//	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//	THE SOFTWARE.
+//
+
+/*!
+ @abstract An append-only file of change records that have not been saved to a document yet.
+ @discussion Records are buffered in memory and written in batches, each batch is synchronized to permanent storage. Each record is framed by its length and a checksum, so a record torn by a crash ends the journal without invalidating preceding records. The journal is based on a token describing the persisted contents the records apply to. All methods are thread-safe.
+ */
+@interface ULEditJournal : NSObject
+
+/*!
+ @abstract The URL of the journal used for the item at the passed URL inside the passed directory.
+ */
++ (NSURL *)journalURLForItemAtURL:(NSURL *)itemURL inDirectory:(NSURL *)directoryURL;
+
+/*!
+ @abstract Creates a journal stored at the passed URL. The file is not created until the first record is written.
+ */
+- (instancetype)initWithURL:(NSURL *)url;
+
+/*!
+ @abstract The current location of the journal.
+ */
+@property(readonly) NSURL *URL;
+
+/*!
+ @abstract The number of records in the journal, including records not yet written.
+ */
+@property(readonly) NSUInteger recordCount;
+
+/*!
+ @abstract Appends a record.
+ @discussion If the journal is empty, it will be based on the passed base token. The record is written asynchronously within a short batching interval.
+ */
+- (void)appendRecord:(NSData *)record baseToken:(NSString *)baseToken;
+
+/*!
+ @abstract Synchronously writes all pending records to permanent storage.
+ */
+- (void)synchronize;
+
+/*!
+ @abstract Reads all intact records and the token the records are based on.
+ @discussion Pending records are written before. Returns an empty array if there is no journal.
+ */
+- (NSArray *)readRecordsWithBaseToken:(NSString **)outBaseToken;
+
+/*!
+ @abstract Removes all records appended before the record at the passed index, e.g. because they have been saved. Remaining records are based on the passed token.
+ @discussion Removing all records deletes the journal file.
+ */
+- (void)removeRecordsBeforeIndex:(NSUInteger)index baseToken:(NSString *)baseToken;
+
+/*!
+ @abstract Removes all records and deletes the journal file.
+ */
+- (void)discard;
+
+/*!
+ @abstract Moves the journal to a new location, e.g. because the document has been moved.
+ */
+- (void)moveToURL:(NSURL *)url;
+
+@end
@@ -0,0 +1,357 @@
+//
+//  ULEditJournal.m
+//
+//  Copyright © 2018 Ulysses GmbH & Co. KG
+//
+//	Permission is hereby granted, free of charge, to any person obtaining a copy
+//	of this software and associated documentation files (the "Software"), to deal
+//	in the Software without restriction, including without limitation the rights
+//	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//	copies of the Software, and to permit persons to whom the Software is
+//	furnished to do so, subject to the following conditions:
+//
+//	The above copyright notice and this permission notice shall be included in
+//	all copies or substantial portions of the Software.
+//
+//	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//	THE SOFTWARE.
+//
+
+#import "ULEditJournal.h"
+
+#import "ULChecksum.h"
+
+#import <fcntl.h>
+#import <sys/stat.h>
+#import <unistd.h>
+
+// Identifies the journal format
+#define ULEditJournalMagic					"ULJ1"
+
+// Time records are collected before they are written
+#define ULEditJournalBatchInterval			0.05
+
+// Length of pending records that causes an immediate write
+#define ULEditJournalMaximumBatchLength		(64 * 1024)
+
+/*!
+ @abstract Precedes each record on disk. The first record of a journal contains the base token.
+ */
+typedef struct {
+	uint32_t	length;
+	uint32_t	reserved;
+	uint64_t	checksum;
+} ULEditJournalRecordHeader;
+
+static void ULEditJournalAppendRecord(NSMutableData *data, NSData *record)
+{
+	ULEditJournalRecordHeader header = {(uint32_t)record.length, 0, ULChecksum(record.bytes, record.length)};
+	
+	[data appendBytes:&header length:sizeof(header)];
+	[data appendData: record];
+}
+
+static NSMutableData *ULEditJournalHeaderData(NSString *baseToken)
+{
+	NSMutableData *data = [NSMutableData dataWithBytes:ULEditJournalMagic length:strlen(ULEditJournalMagic)];
+	ULEditJournalAppendRecord(data, [baseToken ?: @"" dataUsingEncoding: NSUTF8StringEncoding]);
+	
+	return data;
+}
+
+/*!
+ @abstract Parses the records of a journal. Stops at the first torn or corrupted record and passes out the length of all intact records.
+ */
+static NSArray *ULEditJournalParseRecords(NSData *data, NSString **outBaseToken, NSUInteger *outIntactLength)
+{
+	NSMutableArray *records = [NSMutableArray new];
+	NSString *baseToken = nil;
+	NSUInteger offset = strlen(ULEditJournalMagic);
+	
+	if (data.length < offset || memcmp(data.bytes, ULEditJournalMagic, offset) != 0)
+		offset = 0;
+	
+	while (offset && offset + sizeof(ULEditJournalRecordHeader) <= data.length) {
+		ULEditJournalRecordHeader header;
+		[data getBytes:&header range:NSMakeRange(offset, sizeof(header))];
+		
+		NSUInteger recordOffset = offset + sizeof(header);
+		if (header.length > data.length - recordOffset || ULChecksum((const uint8_t *)data.bytes + recordOffset, header.length) != header.checksum)
+			break;
+		
+		NSData *record = [data subdataWithRange: NSMakeRange(recordOffset, header.length)];
+		
+		if (!baseToken)
+			baseToken = [[NSString alloc] initWithData:record encoding:NSUTF8StringEncoding] ?: @"";
+		else
+			[records addObject: record];
+		
+		offset = recordOffset + header.length;
+	}
+	
+	if (outBaseToken) *outBaseToken = baseToken;
+	if (outIntactLength) *outIntactLength = baseToken ? offset : 0;
+	
+	return records;
+}
+
+static BOOL ULEditJournalWriteData(int fd, NSData *data)
+{
+	const uint8_t *bytes = data.bytes;
+	NSUInteger remainingLength = data.length;
+	
+	while (remainingLength) {
+		ssize_t writtenLength = write(fd, bytes, remainingLength);
+		
+		if (writtenLength < 0) {
+			if (errno == EINTR)
+				continue;
+			
+			return NO;
+		}
+		
+		bytes += writtenLength;
+		remainingLength -= writtenLength;
+	}
+	
+	// A plain fsync does not flush the drive's cache on Darwin
+#ifdef F_FULLFSYNC
+	if (fcntl(fd, F_FULLFSYNC) == 0)
+		return YES;
+#endif
+	
+	return (fsync(fd) == 0);
+}
+
+
+@implementation ULEditJournal
+{
+	dispatch_queue_t	_queue;							// Serializes all access to the journal
+	NSURL				*_url;
+	NSString			*_baseToken;					// The base token used if the journal file needs to be created
+	NSMutableData		*_pendingData;					// Records that have been appended but not written yet
+	NSUInteger			_recordCount;
+	BOOL				_isWriteScheduled;
+}
+
++ (NSURL *)journalURLForItemAtURL:(NSURL *)itemURL inDirectory:(NSURL *)directoryURL
+{
+	const char *path = itemURL.URLByStandardizingPath.fileSystemRepresentation;
+	return [directoryURL URLByAppendingPathComponent: [NSString stringWithFormat: @"%016llx.journal", ULChecksum(path, strlen(path))]];
+}
+
+- (instancetype)initWithURL:(NSURL *)url
+{
+	NSParameterAssert(url.isFileURL);
+	self = [super init];
+	
+	if (self) {
+		_queue = dispatch_queue_create("com.soulmen.ulysses3.journal", DISPATCH_QUEUE_SERIAL);
+		_url = url;
+		_pendingData = [NSMutableData new];
+	}
+	
+	return self;
+}
+
+- (NSURL *)URL
+{
+	__block NSURL *url;
+	
+	dispatch_sync(_queue, ^{
+		url = self->_url;
+	});
+	
+	return url;
+}
+
+- (NSUInteger)recordCount
+{
+	__block NSUInteger recordCount;
+	
+	dispatch_sync(_queue, ^{
+		recordCount = self->_recordCount;
+	});
+	
+	return recordCount;
+}
+
+- (void)appendRecord:(NSData *)record baseToken:(NSString *)baseToken
+{
+	NSParameterAssert(record);
+	record = [record copy];
+	
+	dispatch_async(_queue, ^{
+		if (!self->_recordCount)
+			self->_baseToken = [baseToken copy];
+		
+		ULEditJournalAppendRecord(self->_pendingData, record);
+		self->_recordCount ++;
+		
+		// Write large batches immediately, collect small records for a short while
+		if (self->_pendingData.length >= ULEditJournalMaximumBatchLength) {
+			[self writePendingRecords];
+		}
+		else if (!self->_isWriteScheduled) {
+			self->_isWriteScheduled = YES;
+			
+			dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(ULEditJournalBatchInterval * NSEC_PER_SEC)), self->_queue, ^{
+				[self writePendingRecords];
+			});
+		}
+	});
+}
+
+- (void)synchronize
+{
+	dispatch_sync(_queue, ^{
+		[self writePendingRecords];
+	});
+}
+
+- (NSArray *)readRecordsWithBaseToken:(NSString **)outBaseToken
+{
+	__block NSArray *records;
+	__block NSString *baseToken;
+	
+	dispatch_sync(_queue, ^{
+		[self writePendingRecords];
+		
+		NSData *data = [NSData dataWithContentsOfURL:self->_url options:NSDataReadingUncached error:NULL];
+		NSUInteger intactLength;
+		
+		records = ULEditJournalParseRecords(data, &baseToken, &intactLength);
+		self->_recordCount = records.count;
+		self->_baseToken = baseToken;
+		
+		// Cut off torn records, so further records are not appended behind them
+		if (data && intactLength < data.length)
+			truncate(self->_url.fileSystemRepresentation, intactLength);
+	});
+	
+	if (outBaseToken) *outBaseToken = baseToken;
+	return records;
+}
+
+- (void)removeRecordsBeforeIndex:(NSUInteger)index baseToken:(NSString *)baseToken
+{
+	dispatch_sync(_queue, ^{
+		if (index >= self->_recordCount) {
+			[self removeJournalFile];
+			return;
+		}
+		
+		if (!index)
+			return;
+		
+		// Rewrite the journal with the remaining records
+		[self writePendingRecords];
+		
+		NSArray *records = ULEditJournalParseRecords([NSData dataWithContentsOfURL:self->_url options:NSDataReadingUncached error:NULL], NULL, NULL);
+		NSMutableData *data = ULEditJournalHeaderData(baseToken);
+		
+		for (NSUInteger recordIndex = MIN(index, records.count); recordIndex < records.count; recordIndex ++)
+			ULEditJournalAppendRecord(data, records[recordIndex]);
+		
+		NSString *temporaryPath = [self->_url.path stringByAppendingString: @".tmp"];
+		int fd = open(temporaryPath.fileSystemRepresentation, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+		if (fd < 0)
+			return;
+		
+		BOOL success = ULEditJournalWriteData(fd, data);
+		close(fd);
+		
+		if (success && rename(temporaryPath.fileSystemRepresentation, self->_url.fileSystemRepresentation) == 0) {
+			self->_recordCount = records.count - MIN(index, records.count);
+			self->_baseToken = [baseToken copy];
+		}
+		else {
+			unlink(temporaryPath.fileSystemRepresentation);
+		}
+	});
+}
+
+- (void)discard
+{
+	dispatch_sync(_queue, ^{
+		[self removeJournalFile];
+	});
+}
+
+- (void)moveToURL:(NSURL *)url
+{
+	NSParameterAssert(url.isFileURL);
+	
+	dispatch_sync(_queue, ^{
+		if ([url isEqual: self->_url])
+			return;
+		
+		rename(self->_url.fileSystemRepresentation, url.fileSystemRepresentation);
+		self->_url = url;
+	});
+}
+
+
+#pragma mark - Queue
+
+// Must be called on _queue.
+- (void)writePendingRecords
+{
+	_isWriteScheduled = NO;
+	
+	if (!_pendingData.length)
+		return;
+	
+	int fd = open(_url.fileSystemRepresentation, O_WRONLY | O_CREAT | O_APPEND, 0600);
+	
+	if (fd < 0 && errno == ENOENT) {
+		[NSFileManager.defaultManager createDirectoryAtURL:_url.URLByDeletingLastPathComponent withIntermediateDirectories:YES attributes:nil error:NULL];
+		fd = open(_url.fileSystemRepresentation, O_WRONLY | O_CREAT | O_APPEND, 0600);
+	}
+	
+	// Records are kept pending and retried with the next batch
+	if (fd < 0)
+		return;
+	
+	// The length before writing is needed to take back failed writes
+	struct stat status;
+	
+	if (fstat(fd, &status) != 0) {
+		close(fd);
+		return;
+	}
+	
+	// A new journal starts with its base token
+	NSData *data = _pendingData;
+	
+	if (status.st_size == 0) {
+		NSMutableData *headerData = ULEditJournalHeaderData(_baseToken);
+		[headerData appendData: _pendingData];
+		data = headerData;
+	}
+	
+	// Records written but not synchronized are cut off again, so retrying the batch does not duplicate them
+	if (ULEditJournalWriteData(fd, data))
+		_pendingData = [NSMutableData new];
+	else
+		ftruncate(fd, status.st_size);
+	
+	close(fd);
+}
+
+// Must be called on _queue.
+- (void)removeJournalFile
+{
+	_pendingData = [NSMutableData new];
+	_recordCount = 0;
+	_baseToken = nil;
+	
+	unlink(_url.fileSystemRepresentation);
+}
+
+@end
@@ -25,15 +25,35 @@
 #import "ULFilePresentationProxy.h"
 #import "ULWeakify.h"
 
+#import <pthread.h>
+
+/*!
+ @abstract The delay used to collect moved directory presenters before re-registering them at once.
+ */
+static NSTimeInterval ULFilePresentationProxyReregistrationDelay = 0.05;
+
+/*!
+ @abstract Proxies of moved directories that still need to be re-registered.
+ @discussion Must be accessed while holding ULFilePresentationProxyReregistrationLock.
+ */
+static NSHashTable *ULFilePresentationProxyPendingReregistrations;
+static pthread_mutex_t ULFilePresentationProxyReregistrationLock = PTHREAD_MUTEX_INITIALIZER;
+
 @interface ULFilePresentationProxy ()
 {
 	NSOperationQueue			*_queue;
-	NSURL						*_url;
+	NSURL						*_url;							// Changed by moves and re-registrations. Must be accessed while synchronized on self.
+	BOOL						_isReregistering;				// Whether the proxy is re-registered by a pending coordination. Relinquish requests are not forwarded to the owner meanwhile. Must be accessed atomically.
 	
 	id			_deactivationHandler;
 	id			_activationHandler;
 }
 
+/*!
+ @abstract Changes the location of the presented item, notifying observers of presentedItemURL.
+ */
+- (void)setPresentedItemURL:(NSURL *)url;
+
 @end
 
 @implementation ULFilePresentationProxy
@@ -58,9 +78,11 @@
 
 - (void)beginPresentationOnURL:(NSURL *)url
 {
-	NSAssert(!_url, @"Presenter already initialized.");
+	@synchronized(self) {
+		NSAssert(!_url, @"Presenter already initialized.");
+		_url = url;
+	}
 	
-	_url = url;
 	[NSFileCoordinator addFilePresenter: self];
 	
 #if TARGET_OS_IPHONE
@@ -114,7 +136,9 @@
 
 - (NSURL *)presentedItemURL
 {
-	return _url;
+	@synchronized(self) {
+		return _url;
+	}
 }
 
 
@@ -139,22 +163,88 @@
 			[owner presentedItemDidMoveToURL: newURL];
 	}
 	
-	// File presenters will stop to receive subitem notifications after moving the item. So we need to re-register presenters here.
-	dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
-		[self willChangeValueForKey: @"presentedItemURL"];
+	// The file coordinator keeps track of moved presenters by itself
+	[self setPresentedItemURL: newURL];
+	
+	// Presenters of directories stop to receive subitem notifications after moving the item. So we need to re-register them.
+	NSNumber *isDirectory;
+	if ([newURL getResourceValue:&isDirectory forKey:NSURLIsDirectoryKey error:NULL] && isDirectory.boolValue)
+		[self.class scheduleReregistrationOfProxy: self];
+}
+
+
+#pragma mark - Re-registration
+
+- (void)setPresentedItemURL:(NSURL *)url
+{
+	[self willChangeValueForKey: @"presentedItemURL"];
+	
+	@synchronized(self) {
+		_url = url;
+	}
+	
+	[self didChangeValueForKey: @"presentedItemURL"];
+}
+
++ (void)scheduleReregistrationOfProxy:(ULFilePresentationProxy *)proxy
+{
+	pthread_mutex_lock(&ULFilePresentationProxyReregistrationLock);
+	if (!ULFilePresentationProxyPendingReregistrations)
+		ULFilePresentationProxyPendingReregistrations = [NSHashTable weakObjectsHashTable];
+	
+	BOOL isScheduled = (ULFilePresentationProxyPendingReregistrations.count > 0);
+	[ULFilePresentationProxyPendingReregistrations addObject: proxy];
+	pthread_mutex_unlock(&ULFilePresentationProxyReregistrationLock);
+	
+	// Moves usually arrive in bursts, e.g. when a folder is reorganized. Collect them to re-register all proxies using a single coordination.
+	if (!isScheduled) {
+		dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(ULFilePresentationProxyReregistrationDelay * NSEC_PER_SEC)), dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+			[self reregisterPendingProxies];
+		});
+	}
+}
+
++ (void)reregisterPendingProxies
+{
+	pthread_mutex_lock(&ULFilePresentationProxyReregistrationLock);
+	NSArray *proxies = ULFilePresentationProxyPendingReregistrations.allObjects;
+	[ULFilePresentationProxyPendingReregistrations removeAllObjects];
+	pthread_mutex_unlock(&ULFilePresentationProxyReregistrationLock);
+	
+	NSMutableArray *activeProxies = [NSMutableArray new];
+	NSMutableArray *intents = [NSMutableArray new];
+	
+	for (ULFilePresentationProxy *proxy in proxies) {
+		NSURL *url = proxy.presentedItemURL;
+		if (!proxy.owner || !url)
+			continue;
 		
-		[[[NSFileCoordinator alloc] initWithFilePresenter: self] coordinateReadingItemAtURL:newURL options:0 error:NULL byAccessor:^(NSURL *newURL) {
-			id owner = self->_owner;
-			if (!owner)
-				return;
+		[activeProxies addObject: proxy];
+		[intents addObject: [NSFileAccessIntent readingIntentWithURL:url options:NSFileCoordinatorReadingWithoutChanges]];
+	}
+	
+	if (!intents.count)
+		return;
+	
+	// Prevents further moves while swapping the registrations
+	NSOperationQueue *accessQueue = [NSOperationQueue new];
+	
+	// The coordination asks the proxies to relinquish their items before access is granted. Re-registration only needs a stable location, so these requests are not forwarded to the owners.
+	for (ULFilePresentationProxy *proxy in activeProxies)
+		__atomic_store_n(&proxy->_isReregistering, YES, __ATOMIC_RELEASE);
+	
+	// The accessor is also called if the coordination failed
+	[[[NSFileCoordinator alloc] initWithFilePresenter: nil] coordinateAccessWithIntents:intents queue:accessQueue byAccessor:^(NSError *error) {
+		[activeProxies enumerateObjectsUsingBlock:^(ULFilePresentationProxy *proxy, NSUInteger index, BOOL *stop) {
+			if (!error && proxy.owner) {
+				[NSFileCoordinator removeFilePresenter: proxy];
+				[proxy setPresentedItemURL: [intents[index] URL]];
+				[NSFileCoordinator addFilePresenter: proxy];
+			}
 			
-			[NSFileCoordinator removeFilePresenter: self];
-			self->_url = newURL;
-			[NSFileCoordinator addFilePresenter: self];
+			__atomic_store_n(&proxy->_isReregistering, NO, __ATOMIC_RELEASE);
 		}];
-		
-		[self didChangeValueForKey: @"presentedItemURL"];
-	});
+	}];
 }
 
 - (void)presentedItemDidChange
@@ -169,7 +259,8 @@
 {
 	id owner = _owner;
 	
-	if (owner && [owner respondsToSelector: @selector(relinquishPresentedItemToReader:)])
+	// Re-registrations only need a stable location, not the owner's contents
+	if (owner && !__atomic_load_n(&_isReregistering, __ATOMIC_ACQUIRE) && [owner respondsToSelector: @selector(relinquishPresentedItemToReader:)])
 		[owner relinquishPresentedItemToReader: reader];
 	else
 		reader(^{ });
@@ -0,0 +1,81 @@
+//
+//  ULSiblingPrefetcher.h
+//
+//  Copyright © 2018 Ulysses GmbH & Co. KG
+//
+//	Permission is hereby granted, free of charge, to any person obtaining a copy
+//	of this software and associated documentation files (the "Software"), to deal
+//	in the Software without restriction, including without limitation the rights
+//	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//	copies of the Software, and to permit persons to whom the Software is
+//	furnished to do so, subject to the following conditions:
+//
+//	The above copyright notice and this permission notice shall be included in
+//	all copies or substantial portions of the Software.
+//
+//	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//	THE SOFTWARE.
+//
+
+#import <Foundation/Foundation.h>
+
+/*!
+ @abstract Statistics of a sibling prefetcher.
+ 
+ @field prefetchedItemCount	The number of items that have been warmed.
+ @field prefetchedBytes		The number of bytes the page cache has been advised to read.
+ @field hitCount			The number of opened items that have been warmed before.
+ @field missCount			The number of opened items that have not been warmed before.
+ @field wastedBytes			The number of prefetched bytes of items that have been dropped from the prediction without being opened.
+ */
+typedef struct {
+	NSUInteger			prefetchedItemCount;
+	unsigned long long	prefetchedBytes;
+	NSUInteger			hitCount;
+	NSUInteger			missCount;
+	unsigned long long	wastedBytes;
+} ULSiblingPrefetcherStatistics;
+
+/*!
+ @abstract Predicts the items opened next from the order items are opened inside a directory and warms the page cache for them.
+ @discussion Siblings are ordered by name and restricted to the path extension of the opened item. The direction of browsing is derived from the previous open inside the same directory. The page cache is advised to read predicted items asynchronously on a background queue, without reading them into memory. Packages are warmed by all regular files they contain. iCloud items that have not been downloaded are skipped. All methods are thread-safe.
+ */
+@interface ULSiblingPrefetcher : NSObject
+
+/*!
+ @abstract Creates a prefetcher predicting the passed number of siblings on each open.
+ */
+- (instancetype)initWithPrefetchCount:(NSUInteger)prefetchCount;
+
+/*!
+ @abstract The number of siblings predicted on each open.
+ */
+@property(readonly) NSUInteger prefetchCount;
+
+/*!
+ @abstract Notes that the item at the passed URL has been opened and warms its predicted successors.
+ @discussion The prefetch handler is executed on a background queue for each warmed item with the number of bytes advised, e.g. to parse its contents ahead of time. Returns whether the opened item has been warmed before.
+ */
+- (BOOL)noteOpenOfItemAtURL:(NSURL *)url prefetchHandler:(void (^)(NSURL *url, unsigned long long length))prefetchHandler;
+
+/*!
+ @abstract Blocks until all pending prefetches have been performed.
+ */
+- (void)waitUntilIdle;
+
+/*!
+ @abstract The statistics collected so far.
+ */
+@property(readonly) ULSiblingPrefetcherStatistics statistics;
+
+/*!
+ @abstract Discards all collected statistics.
+ */
+- (void)resetStatistics;
+
+@end
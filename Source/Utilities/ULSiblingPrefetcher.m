@@ -0,0 +1,308 @@
+//
+//  ULSiblingPrefetcher.m
+//
+//  Copyright © 2018 Ulysses GmbH & Co. KG
+//
+//	Permission is hereby granted, free of charge, to any person obtaining a copy
+//	of this software and associated documentation files (the "Software"), to deal
+//	in the Software without restriction, including without limitation the rights
+//	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//	copies of the Software, and to permit persons to whom the Software is
+//	furnished to do so, subject to the following conditions:
+//
+//	The above copyright notice and this permission notice shall be included in
+//	all copies or substantial portions of the Software.
+//
+//	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//	THE SOFTWARE.
+//
+
+#import "ULSiblingPrefetcher.h"
+
+#import <fcntl.h>
+#import <pthread.h>
+#import <sys/stat.h>
+#import <unistd.h>
+
+// Bytes advised at most for a single item, including all files of a package
+#define ULSiblingPrefetcherMaximumItemLength		(16 * 1024 * 1024)
+
+// Minimum number of warmed items remembered until they are opened
+#define ULSiblingPrefetcherMinimumOutstandingCount	16
+
+// Number of directories whose listing and browsing direction are remembered
+#define ULSiblingPrefetcherMaximumDirectoryCount	32
+
+/*!
+ @abstract Advises the page cache to read the file at the passed path. Returns the number of bytes advised.
+ */
+static unsigned long long ULSiblingPrefetcherAdviseFile(NSString *path, unsigned long long maximumLength)
+{
+	int fd = open(path.fileSystemRepresentation, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+	
+	struct stat status;
+	unsigned long long length = 0;
+	
+	if (fstat(fd, &status) == 0 && S_ISREG(status.st_mode) && status.st_size > 0) {
+		length = MIN((unsigned long long)status.st_size, maximumLength);
+		
+		// Darwin provides read advisories instead of posix_fadvise
+#ifdef F_RDADVISE
+		struct radvisory advisory = {.ra_offset = 0, .ra_count = (int)MIN(length, (unsigned long long)INT_MAX)};
+		
+		if (fcntl(fd, F_RDADVISE, &advisory) != 0)
+			length = 0;
+#else
+		if (posix_fadvise(fd, 0, (off_t)length, POSIX_FADV_WILLNEED) != 0)
+			length = 0;
+#endif
+	}
+	
+	close(fd);
+	return length;
+}
+
+/*!
+ @abstract Whether the item at the passed URL has a local copy. Reading an evicted iCloud item would download it.
+ */
+static BOOL ULSiblingPrefetcherIsItemDownloaded(NSURL *url)
+{
+	NSDictionary *values = [url resourceValuesForKeys:@[NSURLIsUbiquitousItemKey, NSURLUbiquitousItemDownloadingStatusKey] error:NULL];
+	
+	if (![values[NSURLIsUbiquitousItemKey] boolValue])
+		return YES;
+	
+	return ![values[NSURLUbiquitousItemDownloadingStatusKey] isEqual: NSURLUbiquitousItemDownloadingStatusNotDownloaded];
+}
+
+/*!
+ @abstract Advises the page cache to read the item at the passed URL. Packages are advised by all regular files they contain. Returns the number of bytes advised.
+ */
+static unsigned long long ULSiblingPrefetcherAdviseItem(NSURL *url)
+{
+	NSNumber *isDirectory;
+	[url getResourceValue:&isDirectory forKey:NSURLIsDirectoryKey error:NULL];
+	
+	if (!isDirectory.boolValue)
+		return ULSiblingPrefetcherAdviseFile(url.path, ULSiblingPrefetcherMaximumItemLength);
+	
+	unsigned long long length = 0;
+	NSDirectoryEnumerator *enumerator = [NSFileManager.defaultManager enumeratorAtURL:url includingPropertiesForKeys:@[NSURLIsRegularFileKey] options:0 errorHandler:nil];
+	
+	for (NSURL *fileURL in enumerator) {
+		NSNumber *isRegularFile;
+		[fileURL getResourceValue:&isRegularFile forKey:NSURLIsRegularFileKey error:NULL];
+		
+		if (isRegularFile.boolValue)
+			length += ULSiblingPrefetcherAdviseFile(fileURL.path, ULSiblingPrefetcherMaximumItemLength - length);
+		
+		if (length >= ULSiblingPrefetcherMaximumItemLength)
+			break;
+	}
+	
+	return length;
+}
+
+
+@implementation ULSiblingPrefetcher
+{
+	dispatch_queue_t				_queue;						// Serializes prediction and warming
+	NSMutableDictionary				*_listings;					// Sorted sibling names and modification date per directory and path extension, only accessed on _queue
+	NSMutableDictionary				*_lastOpenedNames;			// The name of the item opened last per directory, only accessed on _queue
+	
+	pthread_mutex_t					_lock;						// Protects all members below
+	NSMutableArray					*_outstandingPaths;			// Warmed items that have not been opened yet, oldest first
+	NSMutableDictionary				*_outstandingLengths;		// Bytes advised for each outstanding item
+	ULSiblingPrefetcherStatistics	_statistics;
+}
+
+- (instancetype)initWithPrefetchCount:(NSUInteger)prefetchCount
+{
+	self = [super init];
+	
+	if (self) {
+		_prefetchCount = prefetchCount;
+		_queue = dispatch_queue_create("com.soulmen.ulysses3.prefetch", dispatch_queue_attr_make_with_qos_class(DISPATCH_QUEUE_SERIAL, QOS_CLASS_UTILITY, 0));
+		_listings = [NSMutableDictionary new];
+		_lastOpenedNames = [NSMutableDictionary new];
+		
+		pthread_mutex_init(&_lock, NULL);
+		_outstandingPaths = [NSMutableArray new];
+		_outstandingLengths = [NSMutableDictionary new];
+	}
+	
+	return self;
+}
+
+- (void)dealloc
+{
+	pthread_mutex_destroy(&_lock);
+}
+
+- (BOOL)noteOpenOfItemAtURL:(NSURL *)url prefetchHandler:(void (^)(NSURL *url, unsigned long long length))prefetchHandler
+{
+	NSParameterAssert(url.isFileURL);
+	NSString *path = url.URLByStandardizingPath.path;
+	
+	pthread_mutex_lock(&_lock);
+	
+	BOOL isHit = (_outstandingLengths[path] != nil);
+	
+	if (isHit) {
+		[_outstandingPaths removeObject: path];
+		[_outstandingLengths removeObjectForKey: path];
+		_statistics.hitCount ++;
+	}
+	else {
+		_statistics.missCount ++;
+	}
+	
+	pthread_mutex_unlock(&_lock);
+	
+	if (_prefetchCount) {
+		dispatch_async(_queue, ^{
+			[self prefetchSiblingsOfItemAtPath:path prefetchHandler:prefetchHandler];
+		});
+	}
+	
+	return isHit;
+}
+
+- (void)waitUntilIdle
+{
+	dispatch_sync(_queue, ^{});
+}
+
+- (ULSiblingPrefetcherStatistics)statistics
+{
+	pthread_mutex_lock(&_lock);
+	ULSiblingPrefetcherStatistics statistics = _statistics;
+	pthread_mutex_unlock(&_lock);
+	
+	return statistics;
+}
+
+- (void)resetStatistics
+{
+	pthread_mutex_lock(&_lock);
+	memset(&_statistics, 0, sizeof(_statistics));
+	pthread_mutex_unlock(&_lock);
+}
+
+
+#pragma mark - Prediction
+
+- (void)prefetchSiblingsOfItemAtPath:(NSString *)path prefetchHandler:(void (^)(NSURL *url, unsigned long long length))prefetchHandler
+{
+	NSString *directoryPath = path.stringByDeletingLastPathComponent;
+	NSString *name = path.lastPathComponent;
+	
+	NSArray *siblingNames = [self siblingNamesInDirectoryAtPath:directoryPath pathExtension:name.pathExtension];
+	NSUInteger index = [siblingNames indexOfObject: name];
+	
+	// Items are browsed backwards if the previously opened sibling succeeds the current one
+	NSString *previousName = _lastOpenedNames[directoryPath];
+	NSUInteger previousIndex = previousName ? [siblingNames indexOfObject: previousName] : NSNotFound;
+	BOOL isBrowsingBackwards = (previousIndex != NSNotFound && index != NSNotFound && previousIndex > index);
+	
+	if (_lastOpenedNames.count >= ULSiblingPrefetcherMaximumDirectoryCount && !previousName)
+		[_lastOpenedNames removeAllObjects];
+	
+	_lastOpenedNames[directoryPath] = name;
+	
+	if (index == NSNotFound)
+		return;
+	
+	for (NSUInteger distance = 1; distance <= _prefetchCount; distance ++) {
+		if (isBrowsingBackwards ? (distance > index) : (index + distance >= siblingNames.count))
+			break;
+		
+		NSString *siblingPath = [directoryPath stringByAppendingPathComponent: siblingNames[isBrowsingBackwards ? index - distance : index + distance]];
+		
+		pthread_mutex_lock(&_lock);
+		BOOL isOutstanding = (_outstandingLengths[siblingPath] != nil);
+		pthread_mutex_unlock(&_lock);
+		
+		if (isOutstanding)
+			continue;
+		
+		// Predictions must not download items that have been evicted from the device
+		NSURL *siblingURL = [NSURL fileURLWithPath: siblingPath];
+		if (!ULSiblingPrefetcherIsItemDownloaded(siblingURL))
+			continue;
+		
+		unsigned long long length = ULSiblingPrefetcherAdviseItem(siblingURL);
+		
+		[self addOutstandingItemAtPath:siblingPath length:length];
+		
+		if (prefetchHandler)
+			prefetchHandler(siblingURL, length);
+	}
+}
+
+- (void)addOutstandingItemAtPath:(NSString *)path length:(unsigned long long)length
+{
+	NSUInteger maximumOutstandingCount = MAX(ULSiblingPrefetcherMinimumOutstandingCount, 4 * _prefetchCount);
+	
+	pthread_mutex_lock(&_lock);
+	
+	[_outstandingPaths addObject: path];
+	_outstandingLengths[path] = @(length);
+	
+	_statistics.prefetchedItemCount ++;
+	_statistics.prefetchedBytes += length;
+	
+	// Items dropped from the prediction have been warmed in vain
+	while (_outstandingPaths.count > maximumOutstandingCount) {
+		NSString *droppedPath = _outstandingPaths.firstObject;
+		
+		_statistics.wastedBytes += [_outstandingLengths[droppedPath] unsignedLongLongValue];
+		
+		[_outstandingPaths removeObjectAtIndex: 0];
+		[_outstandingLengths removeObjectForKey: droppedPath];
+	}
+	
+	pthread_mutex_unlock(&_lock);
+}
+
+- (NSArray *)siblingNamesInDirectoryAtPath:(NSString *)directoryPath pathExtension:(NSString *)pathExtension
+{
+	NSURL *directoryURL = [NSURL fileURLWithPath:directoryPath isDirectory:YES];
+	NSString *listingKey = [directoryPath stringByAppendingFormat: @"\n%@", pathExtension.lowercaseString];
+	
+	// Listings are reused as long as the directory did not change
+	NSDate *modificationDate;
+	[directoryURL getResourceValue:&modificationDate forKey:NSURLContentModificationDateKey error:NULL];
+	
+	NSDictionary *listing = _listings[listingKey];
+	
+	if (listing && modificationDate && [listing[@"date"] isEqual: modificationDate])
+		return listing[@"names"];
+	
+	NSMutableArray *names = [NSMutableArray new];
+	
+	for (NSURL *siblingURL in [NSFileManager.defaultManager contentsOfDirectoryAtURL:directoryURL includingPropertiesForKeys:nil options:NSDirectoryEnumerationSkipsHiddenFiles error:NULL]) {
+		if ([siblingURL.pathExtension caseInsensitiveCompare: pathExtension] == NSOrderedSame)
+			[names addObject: siblingURL.lastPathComponent];
+	}
+	
+	// Use the order of the Finder
+	[names sortUsingSelector: @selector(localizedStandardCompare:)];
+	
+	if (_listings.count >= ULSiblingPrefetcherMaximumDirectoryCount)
+		[_listings removeAllObjects];
+	
+	if (modificationDate)
+		_listings[listingKey] = @{@"date": modificationDate, @"names": names};
+	
+	return names;
+}
+
+@end
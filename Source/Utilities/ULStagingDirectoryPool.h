@@ -0,0 +1,50 @@
+//
+//  ULStagingDirectoryPool.h
+//
+//  Copyright © 2018 Ulysses GmbH & Co. KG
+//
+//	Permission is hereby granted, free of charge, to any person obtaining a copy
+//	of this software and associated documentation files (the "Software"), to deal
+//	in the Software without restriction, including without limitation the rights
+//	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//	copies of the Software, and to permit persons to whom the Software is
+//	furnished to do so, subject to the following conditions:
+//
+//	The above copyright notice and this permission notice shall be included in
+//	all copies or substantial portions of the Software.
+//
+//	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//	THE SOFTWARE.
+//
+
+#import <Foundation/Foundation.h>
+
+/*!
+ @abstract A pool of empty directories for staging items next to the files they replace.
+ @discussion Directories are created in the temporary items folder of the volume of the replaced file, so items can be moved between both without copying. Relinquished directories are reused by later saves on the same volume. Surplus and idle directories are removed lazily on a background queue. All methods are thread-safe.
+ */
+@interface ULStagingDirectoryPool : NSObject
+
+/*!
+ @abstract The pool used by all documents.
+ */
++ (instancetype)sharedPool;
+
+/*!
+ @abstract Provides an empty directory on the volume of the item at the passed URL.
+ @discussion The directory is used exclusively by the caller until it is passed to -relinquishDirectory:isEmpty:. Returns nil and an error if no directory could be created.
+ */
+- (NSURL *)acquireDirectoryForItemAtURL:(NSURL *)url error:(NSError **)outError;
+
+/*!
+ @abstract Returns a directory obtained by -acquireDirectoryForItemAtURL:error: to the pool.
+ @discussion Directories that still contain items are removed instead of being reused.
+ */
+- (void)relinquishDirectory:(NSURL *)directoryURL isEmpty:(BOOL)isEmpty;
+
+@end
@@ -0,0 +1,208 @@
+//
+//  ULStagingDirectoryPool.m
+//
+//  Copyright © 2018 Ulysses GmbH & Co. KG
+//
+//	Permission is hereby granted, free of charge, to any person obtaining a copy
+//	of this software and associated documentation files (the "Software"), to deal
+//	in the Software without restriction, including without limitation the rights
+//	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//	copies of the Software, and to permit persons to whom the Software is
+//	furnished to do so, subject to the following conditions:
+//
+//	The above copyright notice and this permission notice shall be included in
+//	all copies or substantial portions of the Software.
+//
+//	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//	THE SOFTWARE.
+//
+
+#import "ULStagingDirectoryPool.h"
+
+#import "NSString+UniqueIdentifier.h"
+
+#import <pthread.h>
+#import <sys/stat.h>
+
+// Number of unused directories kept per volume
+#define ULStagingDirectoryPoolMaximumFreeCount		8
+
+// Time after which unused directories are removed, long before the system cleans up temporary items
+#define ULStagingDirectoryPoolMaximumIdleInterval	300.
+
+/*!
+ @abstract An unused directory of the pool.
+ */
+@interface ULStagingDirectory : NSObject
+{
+	@public
+	NSURL			*_url;
+	NSTimeInterval	_relinquishTime;				// System uptime when the directory has been returned to the pool
+}
+
+@end
+
+@implementation ULStagingDirectory
+
+@end
+
+
+@implementation ULStagingDirectoryPool
+{
+	pthread_mutex_t			_lock;					// Protects all members below
+	NSMutableDictionary		*_rootURLs;				// The folder containing the staging directories of each volume, keyed by device number
+	NSMutableDictionary		*_freeDirectories;		// Unused directories by path of their root folder, least recently used first
+	
+	dispatch_queue_t		_cleanupQueue;			// Removes directories that are no longer used
+}
+
++ (instancetype)sharedPool
+{
+	static ULStagingDirectoryPool *sharedPool;
+	static dispatch_once_t onceToken;
+	
+	dispatch_once(&onceToken, ^{
+		sharedPool = [self new];
+	});
+	
+	return sharedPool;
+}
+
+- (instancetype)init
+{
+	self = [super init];
+	
+	if (self) {
+		pthread_mutex_init(&_lock, NULL);
+		_rootURLs = [NSMutableDictionary new];
+		_freeDirectories = [NSMutableDictionary new];
+		_cleanupQueue = dispatch_queue_create("com.soulmen.ulysses3.staging-cleanup", dispatch_queue_attr_make_with_qos_class(DISPATCH_QUEUE_SERIAL, QOS_CLASS_BACKGROUND, 0));
+	}
+	
+	return self;
+}
+
+- (void)dealloc
+{
+	pthread_mutex_destroy(&_lock);
+}
+
+- (NSURL *)acquireDirectoryForItemAtURL:(NSURL *)url error:(NSError **)outError
+{
+	NSParameterAssert(url.isFileURL);
+	
+	// The parent exists even if the item does not yet
+	struct stat status;
+	
+	if (stat(url.URLByDeletingLastPathComponent.fileSystemRepresentation, &status) != 0) {
+		if (outError)
+			*outError = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:@{NSURLErrorKey: url}];
+		
+		return nil;
+	}
+	
+	NSNumber *device = @(status.st_dev);
+	NSTimeInterval now = NSProcessInfo.processInfo.systemUptime;
+	NSMutableArray *expiredDirectoryURLs = [NSMutableArray new];
+	ULStagingDirectory *directory;
+	
+	pthread_mutex_lock(&_lock);
+	
+	NSURL *rootURL = _rootURLs[device];
+	NSMutableArray *freeDirectories = rootURL ? _freeDirectories[rootURL.path] : nil;
+	
+	// Most recently used directories are reused first, idle ones expire from the front
+	directory = freeDirectories.lastObject;
+	[freeDirectories removeLastObject];
+	
+	while (freeDirectories.count && now - ((ULStagingDirectory *)freeDirectories.firstObject)->_relinquishTime > ULStagingDirectoryPoolMaximumIdleInterval) {
+		[expiredDirectoryURLs addObject: ((ULStagingDirectory *)freeDirectories.firstObject)->_url];
+		[freeDirectories removeObjectAtIndex: 0];
+	}
+	
+	pthread_mutex_unlock(&_lock);
+	
+	if (directory && now - directory->_relinquishTime > ULStagingDirectoryPoolMaximumIdleInterval) {
+		[expiredDirectoryURLs addObject: directory->_url];
+		directory = nil;
+	}
+	
+	[self removeDirectoriesLazily: expiredDirectoryURLs];
+	
+	// Pooled directories may have been removed by the system while unused, a new one is created instead
+	struct stat directoryStatus;
+	
+	if (directory && stat(directory->_url.fileSystemRepresentation, &directoryStatus) == 0 && S_ISDIR(directoryStatus.st_mode))
+		return directory->_url;
+	
+	// Determine the temporary items folder of a volume only once
+	if (!rootURL) {
+		NSURL *replacementDirectoryURL = [NSFileManager.defaultManager URLForDirectory:NSItemReplacementDirectory inDomain:NSUserDomainMask appropriateForURL:url create:NO error:outError];
+		if (!replacementDirectoryURL)
+			return nil;
+		
+		// ULYSSES-4940: We're using siblings of the suggested directory due to random failures when accessing the replacement directory
+		[NSFileManager.defaultManager removeItemAtURL:replacementDirectoryURL error:NULL];
+		rootURL = replacementDirectoryURL.URLByDeletingLastPathComponent;
+		
+		pthread_mutex_lock(&_lock);
+		
+		_rootURLs[device] = rootURL;
+		
+		if (!_freeDirectories[rootURL.path])
+			_freeDirectories[rootURL.path] = [NSMutableArray new];
+		
+		pthread_mutex_unlock(&_lock);
+	}
+	
+	NSURL *directoryURL = [rootURL URLByAppendingPathComponent:NSString.ul_newSequentialIdentifier isDirectory:YES];
+	
+	// The root folder may have been removed by the system in the meantime
+	if (mkdir(directoryURL.fileSystemRepresentation, 0777) != 0 && ![NSFileManager.defaultManager createDirectoryAtURL:directoryURL withIntermediateDirectories:YES attributes:nil error:outError])
+		return nil;
+	
+	return directoryURL;
+}
+
+- (void)relinquishDirectory:(NSURL *)directoryURL isEmpty:(BOOL)isEmpty
+{
+	NSParameterAssert(directoryURL);
+	
+	if (isEmpty) {
+		pthread_mutex_lock(&_lock);
+		
+		NSMutableArray *freeDirectories = _freeDirectories[directoryURL.URLByDeletingLastPathComponent.path];
+		
+		if (freeDirectories && freeDirectories.count < ULStagingDirectoryPoolMaximumFreeCount) {
+			ULStagingDirectory *directory = [ULStagingDirectory new];
+			directory->_url = directoryURL;
+			directory->_relinquishTime = NSProcessInfo.processInfo.systemUptime;
+			
+			[freeDirectories addObject: directory];
+			directoryURL = nil;
+		}
+		
+		pthread_mutex_unlock(&_lock);
+	}
+	
+	if (directoryURL)
+		[self removeDirectoriesLazily: @[directoryURL]];
+}
+
+- (void)removeDirectoriesLazily:(NSArray *)directoryURLs
+{
+	if (!directoryURLs.count)
+		return;
+	
+	dispatch_async(_cleanupQueue, ^{
+		for (NSURL *directoryURL in directoryURLs)
+			[NSFileManager.defaultManager removeItemAtURL:directoryURL error:NULL];
+	});
+}
+
+@end
@@ -0,0 +1,145 @@
+//
+//  ULTraceRecorder.h
+//
+//  Copyright © 2018 Ulysses GmbH & Co. KG
+//
+//	Permission is hereby granted, free of charge, to any person obtaining a copy
+//	of this software and associated documentation files (the "Software"), to deal
+//	in the Software without restriction, including without limitation the rights
+//	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//	copies of the Software, and to permit persons to whom the Software is
+//	furnished to do so, subject to the following conditions:
+//
+//	The above copyright notice and this permission notice shall be included in
+//	all copies or substantial portions of the Software.
+//
+//	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//	THE SOFTWARE.
+//
+
+#import "ULDocumentTrace.h"
+
+#import <mach/mach_time.h>
+
+/*!
+ @abstract The number of events kept per thread.
+ */
+#define ULTraceRecorderRingCapacity		1024
+
+/*!
+ @abstract The number of buckets per histogram. Bucket 0 counts durations below 1µs, bucket n durations below 2^n µs.
+ */
+#define ULTraceRecorderBucketCount		32
+
+/*!
+ @abstract The histogram index used for phases outside of any interaction.
+ */
+#define ULTraceRecorderNoInteraction	ULDocumentInteractionCount
+
+/*!
+ @abstract An event as stored in the ring buffer of a thread.
+ */
+typedef struct {
+	uint64_t		beginTime;				// Absolute begin time
+	uint64_t		duration;				// Duration in absolute time units
+	uintptr_t		document;				// Address of the document, used as opaque identifier only
+	uint32_t		thread;					// The recording thread's index
+	uint8_t			interaction;			// ULDocumentInteraction or ULTraceRecorderNoInteraction
+	uint8_t			phase;					// ULDocumentTracePhase
+} ULTraceRecorderEvent;
+
+/*!
+ @abstract A copy of a histogram. Durations are measured in absolute time units.
+ */
+typedef struct {
+	uint64_t		count;
+	uint64_t		totalDuration;
+	uint64_t		maximumDuration;
+	uint64_t		buckets[ULTraceRecorderBucketCount];
+} ULTraceRecorderHistogram;
+
+/*!
+ @abstract Whether events are recorded. Read without synchronization to keep disabled tracing free.
+ */
+extern volatile BOOL ULTraceRecorderIsEnabled;
+
+/*!
+ @abstract Enables or disables recording.
+ */
+void ULTraceRecorderSetEnabled(BOOL enabled);
+
+/*!
+ @abstract Starts measuring a phase. Returns zero if recording is disabled.
+ */
+static inline uint64_t ULTraceRecorderBeginPhase(void)
+{
+	return ULTraceRecorderIsEnabled ? mach_absolute_time() : 0;
+}
+
+/*!
+ @abstract Records a phase started by ULTraceRecorderBeginPhase for the innermost interaction of the current thread.
+ @discussion Does nothing if the phase was begun while recording was disabled.
+ */
+void ULTraceRecorderEndPhase(ULDocumentTracePhase phase, uint64_t beginTime);
+
+/*!
+ @abstract Marks the begin of an interaction of a document on the current thread.
+ @discussion Phases recorded on the current thread are attributed to the innermost interaction until it is ended. Interactions may be nested up to a small depth.
+ */
+void ULTraceRecorderBeginInteraction(ULDocumentInteraction interaction, const void *document);
+
+/*!
+ @abstract Ends the innermost interaction of the current thread and records its duration.
+ */
+void ULTraceRecorderEndInteraction(void);
+
+/*!
+ @abstract Notes that the innermost interaction of the current thread starts waiting for file coordination.
+ */
+void ULTraceRecorderBeginCoordination(void);
+
+/*!
+ @abstract Records the coordination wait of the innermost interaction of the current thread.
+ @discussion File coordinators call their accessors synchronously on the waiting thread, so begin and end of a wait are always recorded on the same thread.
+ */
+void ULTraceRecorderEndCoordination(void);
+
+/*!
+ @abstract Records a notice message for the innermost interaction of the current thread.
+ */
+void ULTraceRecorderRecordNotice(NSString *message);
+
+/*!
+ @abstract Copies the histogram of a phase during an interaction. Pass ULTraceRecorderNoInteraction to get phases outside of any interaction.
+ */
+void ULTraceRecorderCopyHistogram(NSUInteger interaction, ULDocumentTracePhase phase, ULTraceRecorderHistogram *outHistogram);
+
+/*!
+ @abstract Copies the ring buffers of all threads. The data contains an unordered array of ULTraceRecorderEvent.
+ */
+NSData *ULTraceRecorderCopyEvents(void);
+
+/*!
+ @abstract Copies the recent notices of all threads. Each notice is a dictionary with the keys "time" (absolute time), "thread", "interaction", "document" and "message".
+ */
+NSArray *ULTraceRecorderCopyNotices(void);
+
+/*!
+ @abstract Clears all histograms, ring buffers and notices.
+ */
+void ULTraceRecorderReset(void);
+
+/*!
+ @abstract The absolute time recording was first enabled at.
+ */
+uint64_t ULTraceRecorderEpoch(void);
+
+/*!
+ @abstract Converts a duration in absolute time units to seconds.
+ */
+NSTimeInterval ULTraceRecorderSecondsForDuration(uint64_t duration);
@@ -0,0 +1,367 @@
+//
+//  ULTraceRecorder.m
+//
+//  Copyright © 2018 Ulysses GmbH & Co. KG
+//
+//	Permission is hereby granted, free of charge, to any person obtaining a copy
+//	of this software and associated documentation files (the "Software"), to deal
+//	in the Software without restriction, including without limitation the rights
+//	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//	copies of the Software, and to permit persons to whom the Software is
+//	furnished to do so, subject to the following conditions:
+//
+//	The above copyright notice and this permission notice shall be included in
+//	all copies or substantial portions of the Software.
+//
+//	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//	THE SOFTWARE.
+//
+
+#import "ULTraceRecorder.h"
+
+#import <pthread.h>
+
+// Maximum nesting of interactions on a single thread. Deeper interactions are not attributed.
+#define ULTraceRecorderStackDepth		4
+
+// Maximum number of notices kept
+#define ULTraceRecorderNoticeCapacity	64
+
+/*!
+ @abstract An interaction running on a thread.
+ */
+typedef struct {
+	uint8_t			interaction;
+	const void		*document;
+	uint64_t		beginTime;
+	uint64_t		coordinationTime;		// Absolute time the interaction started to wait for coordination, zero if not waiting
+	BOOL			isRecorded;				// Whether recording was enabled when the interaction began
+} ULTraceRecorderFrame;
+
+/*!
+ @abstract The recording state of a thread.
+ @discussion States are never freed. The state of an exited thread is reused by the next new thread, which bounds memory by the number of concurrently tracing threads. The lock is only contended while a snapshot is taken.
+ */
+typedef struct ULTraceRecorderThread {
+	struct ULTraceRecorderThread	*next;
+	pthread_mutex_t					lock;
+	uint32_t						index;
+	BOOL							isRetired;
+
+	ULTraceRecorderFrame			frames[ULTraceRecorderStackDepth];
+	NSUInteger						depth;
+
+	uint64_t						eventCount;		// Total number of events written, the ring holds the last ULTraceRecorderRingCapacity of them
+	ULTraceRecorderEvent			events[ULTraceRecorderRingCapacity];
+} ULTraceRecorderThread;
+
+volatile BOOL ULTraceRecorderIsEnabled;
+
+static pthread_mutex_t ULTraceRecorderLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ULTraceRecorderThreadKey;
+static ULTraceRecorderThread *ULTraceRecorderThreads;
+static uint32_t ULTraceRecorderThreadCount;
+
+static NSMutableArray *ULTraceRecorderNotices;
+
+static mach_timebase_info_data_t ULTraceRecorderTimebase;
+static uint64_t ULTraceRecorderEpochTime;
+
+// Updated with atomic operations only
+static ULTraceRecorderHistogram ULTraceRecorderHistograms[ULTraceRecorderNoInteraction + 1][ULDocumentTracePhaseCount];
+
+
+#pragma mark - Setup
+
+static void ULTraceRecorderRetireThread(void *state)
+{
+	pthread_mutex_lock(&ULTraceRecorderLock);
+	((ULTraceRecorderThread *)state)->isRetired = YES;
+	pthread_mutex_unlock(&ULTraceRecorderLock);
+}
+
+static void ULTraceRecorderSetup(void)
+{
+	static dispatch_once_t onceToken;
+	dispatch_once(&onceToken, ^{
+		mach_timebase_info(&ULTraceRecorderTimebase);
+		pthread_key_create(&ULTraceRecorderThreadKey, ULTraceRecorderRetireThread);
+		ULTraceRecorderNotices = [NSMutableArray new];
+		ULTraceRecorderEpochTime = mach_absolute_time();
+	});
+}
+
+void ULTraceRecorderSetEnabled(BOOL enabled)
+{
+	ULTraceRecorderSetup();
+	ULTraceRecorderIsEnabled = enabled;
+}
+
+uint64_t ULTraceRecorderEpoch(void)
+{
+	ULTraceRecorderSetup();
+	return ULTraceRecorderEpochTime;
+}
+
+NSTimeInterval ULTraceRecorderSecondsForDuration(uint64_t duration)
+{
+	ULTraceRecorderSetup();
+	return (NSTimeInterval)(duration * ULTraceRecorderTimebase.numer / ULTraceRecorderTimebase.denom) / NSEC_PER_SEC;
+}
+
+static ULTraceRecorderThread *ULTraceRecorderCurrentThread(void)
+{
+	ULTraceRecorderThread *state = pthread_getspecific(ULTraceRecorderThreadKey);
+	if (state)
+		return state;
+
+	pthread_mutex_lock(&ULTraceRecorderLock);
+
+	// Reuse the state of an exited thread
+	for (ULTraceRecorderThread *candidate = ULTraceRecorderThreads; candidate; candidate = candidate->next) {
+		if (candidate->isRetired) {
+			state = candidate;
+			break;
+		}
+	}
+
+	if (state) {
+		state->isRetired = NO;
+		state->depth = 0;
+	}
+	else {
+		state = calloc(1, sizeof(ULTraceRecorderThread));
+		pthread_mutex_init(&state->lock, NULL);
+		state->next = ULTraceRecorderThreads;
+		ULTraceRecorderThreads = state;
+	}
+
+	state->index = ++ULTraceRecorderThreadCount;
+
+	pthread_mutex_unlock(&ULTraceRecorderLock);
+
+	pthread_setspecific(ULTraceRecorderThreadKey, state);
+	return state;
+}
+
+static ULTraceRecorderThread *ULTraceRecorderExistingThread(void)
+{
+	// The thread key does not exist before recording was enabled for the first time
+	return ULTraceRecorderEpochTime ? pthread_getspecific(ULTraceRecorderThreadKey) : NULL;
+}
+
+
+#pragma mark - Recording
+
+static void ULTraceRecorderAddToHistogram(ULTraceRecorderHistogram *histogram, uint64_t duration)
+{
+	uint64_t microseconds = duration * ULTraceRecorderTimebase.numer / ULTraceRecorderTimebase.denom / NSEC_PER_USEC;
+	NSUInteger bucket = microseconds ? MIN(ULTraceRecorderBucketCount - 1, 64 - __builtin_clzll(microseconds)) : 0;
+
+	__atomic_fetch_add(&histogram->buckets[bucket], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&histogram->count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&histogram->totalDuration, duration, __ATOMIC_RELAXED);
+
+	uint64_t maximum = __atomic_load_n(&histogram->maximumDuration, __ATOMIC_RELAXED);
+	while (duration > maximum && !__atomic_compare_exchange_n(&histogram->maximumDuration, &maximum, duration, YES, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static void ULTraceRecorderRecord(ULTraceRecorderThread *state, ULDocumentTracePhase phase, uint64_t beginTime, uint64_t endTime)
+{
+	ULTraceRecorderFrame *frame = (state->depth && state->depth <= ULTraceRecorderStackDepth) ? &state->frames[state->depth - 1] : NULL;
+	uint8_t interaction = frame ? frame->interaction : ULTraceRecorderNoInteraction;
+	uint64_t duration = (endTime > beginTime) ? (endTime - beginTime) : 0;
+
+	ULTraceRecorderAddToHistogram(&ULTraceRecorderHistograms[interaction][phase], duration);
+
+	pthread_mutex_lock(&state->lock);
+
+	ULTraceRecorderEvent *event = &state->events[state->eventCount % ULTraceRecorderRingCapacity];
+	event->beginTime = beginTime;
+	event->duration = duration;
+	event->document = (uintptr_t)(frame ? frame->document : NULL);
+	event->thread = state->index;
+	event->interaction = interaction;
+	event->phase = phase;
+	state->eventCount ++;
+
+	pthread_mutex_unlock(&state->lock);
+}
+
+void ULTraceRecorderEndPhase(ULDocumentTracePhase phase, uint64_t beginTime)
+{
+	if (!beginTime || !ULTraceRecorderIsEnabled)
+		return;
+
+	ULTraceRecorderRecord(ULTraceRecorderCurrentThread(), phase, beginTime, mach_absolute_time());
+}
+
+void ULTraceRecorderBeginInteraction(ULDocumentInteraction interaction, const void *document)
+{
+	// Threads with a state push every interaction, so begin and end stay balanced if recording is toggled in between. Other threads stay free while recording is disabled.
+	BOOL isEnabled = ULTraceRecorderIsEnabled;
+	ULTraceRecorderThread *state = isEnabled ? ULTraceRecorderCurrentThread() : ULTraceRecorderExistingThread();
+	if (!state)
+		return;
+
+	// Too deeply nested interactions are only counted to keep begin and end balanced
+	if (state->depth < ULTraceRecorderStackDepth) {
+		ULTraceRecorderFrame *frame = &state->frames[state->depth];
+		frame->interaction = interaction;
+		frame->document = document;
+		frame->beginTime = mach_absolute_time();
+		frame->coordinationTime = 0;
+		frame->isRecorded = isEnabled;
+	}
+
+	state->depth ++;
+}
+
+void ULTraceRecorderEndInteraction(void)
+{
+	// Interactions begun before the thread had a state have not been pushed. They end after all interactions nested into them, so the depth is zero by then.
+	ULTraceRecorderThread *state = ULTraceRecorderExistingThread();
+	if (!state || !state->depth)
+		return;
+
+	if (state->depth <= ULTraceRecorderStackDepth && state->frames[state->depth - 1].isRecorded && ULTraceRecorderIsEnabled)
+		ULTraceRecorderRecord(state, ULDocumentTracePhaseInteraction, state->frames[state->depth - 1].beginTime, mach_absolute_time());
+
+	state->depth --;
+}
+
+void ULTraceRecorderBeginCoordination(void)
+{
+	if (!ULTraceRecorderIsEnabled)
+		return;
+
+	ULTraceRecorderThread *state = ULTraceRecorderCurrentThread();
+	if (state->depth && state->depth <= ULTraceRecorderStackDepth)
+		state->frames[state->depth - 1].coordinationTime = mach_absolute_time();
+}
+
+void ULTraceRecorderEndCoordination(void)
+{
+	ULTraceRecorderThread *state = ULTraceRecorderExistingThread();
+	if (!state || !state->depth || state->depth > ULTraceRecorderStackDepth)
+		return;
+
+	ULTraceRecorderFrame *frame = &state->frames[state->depth - 1];
+	if (!frame->coordinationTime)
+		return;
+
+	if (ULTraceRecorderIsEnabled)
+		ULTraceRecorderRecord(state, ULDocumentTracePhaseCoordinationWait, frame->coordinationTime, mach_absolute_time());
+
+	frame->coordinationTime = 0;
+}
+
+void ULTraceRecorderRecordNotice(NSString *message)
+{
+	if (!ULTraceRecorderIsEnabled)
+		return;
+
+	ULTraceRecorderThread *state = ULTraceRecorderCurrentThread();
+	ULTraceRecorderFrame *frame = (state->depth && state->depth <= ULTraceRecorderStackDepth) ? &state->frames[state->depth - 1] : NULL;
+
+	NSDictionary *notice = @{
+		@"time":		@(mach_absolute_time()),
+		@"thread":		@(state->index),
+		@"interaction":	@(frame ? frame->interaction : ULTraceRecorderNoInteraction),
+		@"document":	@((uintptr_t)(frame ? frame->document : NULL)),
+		@"message":		message ?: @""
+	};
+
+	pthread_mutex_lock(&ULTraceRecorderLock);
+
+	if (ULTraceRecorderNotices.count >= ULTraceRecorderNoticeCapacity)
+		[ULTraceRecorderNotices removeObjectAtIndex: 0];
+
+	[ULTraceRecorderNotices addObject: notice];
+
+	pthread_mutex_unlock(&ULTraceRecorderLock);
+}
+
+
+#pragma mark - Snapshots
+
+void ULTraceRecorderCopyHistogram(NSUInteger interaction, ULDocumentTracePhase phase, ULTraceRecorderHistogram *outHistogram)
+{
+	NSCParameterAssert(interaction <= ULTraceRecorderNoInteraction && phase < ULDocumentTracePhaseCount);
+	ULTraceRecorderHistogram *histogram = &ULTraceRecorderHistograms[interaction][phase];
+
+	outHistogram->count = __atomic_load_n(&histogram->count, __ATOMIC_RELAXED);
+	outHistogram->totalDuration = __atomic_load_n(&histogram->totalDuration, __ATOMIC_RELAXED);
+	outHistogram->maximumDuration = __atomic_load_n(&histogram->maximumDuration, __ATOMIC_RELAXED);
+
+	for (NSUInteger bucket = 0; bucket < ULTraceRecorderBucketCount; bucket ++)
+		outHistogram->buckets[bucket] = __atomic_load_n(&histogram->buckets[bucket], __ATOMIC_RELAXED);
+}
+
+NSData *ULTraceRecorderCopyEvents(void)
+{
+	NSMutableData *events = [NSMutableData new];
+
+	pthread_mutex_lock(&ULTraceRecorderLock);
+
+	for (ULTraceRecorderThread *state = ULTraceRecorderThreads; state; state = state->next) {
+		pthread_mutex_lock(&state->lock);
+
+		uint64_t count = MIN(state->eventCount, ULTraceRecorderRingCapacity);
+		for (uint64_t index = state->eventCount - count; index < state->eventCount; index ++)
+			[events appendBytes:&state->events[index % ULTraceRecorderRingCapacity] length:sizeof(ULTraceRecorderEvent)];
+
+		pthread_mutex_unlock(&state->lock);
+	}
+
+	pthread_mutex_unlock(&ULTraceRecorderLock);
+
+	return events;
+}
+
+NSArray *ULTraceRecorderCopyNotices(void)
+{
+	ULTraceRecorderSetup();
+
+	pthread_mutex_lock(&ULTraceRecorderLock);
+	NSArray *notices = [ULTraceRecorderNotices copy];
+	pthread_mutex_unlock(&ULTraceRecorderLock);
+
+	return notices;
+}
+
+void ULTraceRecorderReset(void)
+{
+	ULTraceRecorderSetup();
+
+	pthread_mutex_lock(&ULTraceRecorderLock);
+
+	for (ULTraceRecorderThread *state = ULTraceRecorderThreads; state; state = state->next) {
+		pthread_mutex_lock(&state->lock);
+		state->eventCount = 0;
+		pthread_mutex_unlock(&state->lock);
+	}
+
+	[ULTraceRecorderNotices removeAllObjects];
+
+	// Concurrent recordings may still be added partially. This is acceptable for statistics.
+	for (NSUInteger interaction = 0; interaction <= ULTraceRecorderNoInteraction; interaction ++) {
+		for (NSUInteger phase = 0; phase < ULDocumentTracePhaseCount; phase ++) {
+			ULTraceRecorderHistogram *histogram = &ULTraceRecorderHistograms[interaction][phase];
+
+			__atomic_store_n(&histogram->count, 0, __ATOMIC_RELAXED);
+			__atomic_store_n(&histogram->totalDuration, 0, __ATOMIC_RELAXED);
+			__atomic_store_n(&histogram->maximumDuration, 0, __ATOMIC_RELAXED);
+
+			for (NSUInteger bucket = 0; bucket < ULTraceRecorderBucketCount; bucket ++)
+				__atomic_store_n(&histogram->buckets[bucket], 0, __ATOMIC_RELAXED);
+		}
+	}
+
+	pthread_mutex_unlock(&ULTraceRecorderLock);
+}
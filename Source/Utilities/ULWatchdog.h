@@ -0,0 +1,126 @@
+//
+//  ULWatchdog.h
+//
+//  Copyright © 2018 Ulysses GmbH & Co. KG
+//
+//	Permission is hereby granted, free of charge, to any person obtaining a copy
+//	of this software and associated documentation files (the "Software"), to deal
+//	in the Software without restriction, including without limitation the rights
+//	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//	copies of the Software, and to permit persons to whom the Software is
+//	furnished to do so, subject to the following conditions:
+//
+//	The above copyright notice and this permission notice shall be included in
+//	all copies or substantial portions of the Software.
+//
+//	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//	THE SOFTWARE.
+//
+
+@protocol ULWatchdogDelegate;
+@class ULWatchdogReport;
+
+/*!
+ @abstract Identifies an operation tracked by a watchdog.
+ @discussion Tokens are plain values and can be passed around freely. Ending an operation invalidates its token, any further use of the token is ignored.
+ */
+typedef uint64_t ULWatchdogToken;
+
+/*!
+ @abstract A token that never identifies an operation.
+ */
+extern const ULWatchdogToken ULWatchdogInvalidToken;
+
+/*!
+ @abstract Tracks the duration of (asynchronous) operations and detects whether they exceed their deadlines.
+ @discussion All operations of the process share a single hierarchical timer wheel that is driven by one timer. The timer only runs while operations are pending. Beginning and ending an operation reuses pooled bookkeeping records and does not allocate memory in the common case.
+ */
+@interface ULWatchdog : NSObject
+
+/*!
+ @abstract The process-wide watchdog.
+ */
++ (instancetype)sharedWatchdog;
+
+/*!
+ @abstract Starts tracking an operation.
+ @discussion The delegate is notified once, if the operation is not ended within the given deadline. The kind and context are specific to the delegate and passed back in the report. The delegate is not retained.
+ */
+- (ULWatchdogToken)beginOperationOfKind:(NSUInteger)kind context:(NSUInteger)context deadline:(NSTimeInterval)deadline delegate:(id<ULWatchdogDelegate>)delegate;
+
+/*!
+ @abstract Notes that the operation is about to wait for the passed file coordinator.
+ @discussion The coordinator will be reported if the deadline is exceeded before -operationDidAcquireCoordination: is called. The coordinator is not retained.
+ */
+- (void)operation:(ULWatchdogToken)token willWaitForCoordinator:(NSFileCoordinator *)coordinator;
+
+/*!
+ @abstract Notes that the operation is no longer waiting for a file coordinator.
+ */
+- (void)operationDidAcquireCoordination:(ULWatchdogToken)token;
+
+/*!
+ @abstract Stops tracking an operation.
+ */
+- (void)endOperation:(ULWatchdogToken)token;
+
+/*!
+ @abstract The number of operations that are currently tracked.
+ */
+@property(nonatomic, readonly) NSUInteger activeOperationCount;
+
+@end
+
+
+/*!
+ @abstract Describes an operation that exceeded its deadline.
+ */
+@interface ULWatchdogReport : NSObject
+
+/*!
+ @abstract The delegate-specific kind of the operation.
+ */
+@property(nonatomic, readonly) NSUInteger kind;
+
+/*!
+ @abstract The delegate-specific context of the operation.
+ */
+@property(nonatomic, readonly) NSUInteger context;
+
+/*!
+ @abstract The deadline the operation was started with.
+ */
+@property(nonatomic, readonly) NSTimeInterval deadline;
+
+/*!
+ @abstract The time that has passed since the operation was started.
+ */
+@property(nonatomic, readonly) NSTimeInterval duration;
+
+/*!
+ @abstract The file coordinator the operation is waiting for. Nil, if the operation is not waiting for a coordinator.
+ */
+@property(nonatomic, readonly) NSFileCoordinator *coordinator;
+
+/*!
+ @abstract The time the operation has been waiting for the coordinator. Zero, if the operation is not waiting for a coordinator.
+ */
+@property(nonatomic, readonly) NSTimeInterval coordinationDuration;
+
+@end
+
+
+@protocol ULWatchdogDelegate <NSObject>
+
+/*!
+ @abstract Notifies the delegate that an operation exceeded its deadline.
+ @discussion Called on a background queue. The operation is still tracked until it is ended.
+ */
+- (void)watchdog:(ULWatchdog *)watchdog operationDidExceedDeadline:(ULWatchdogReport *)report;
+
+@end
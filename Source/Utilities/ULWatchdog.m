@@ -0,0 +1,496 @@
+//
+//  ULWatchdog.m
+//
+//  Copyright © 2018 Ulysses GmbH & Co. KG
+//
+//	Permission is hereby granted, free of charge, to any person obtaining a copy
+//	of this software and associated documentation files (the "Software"), to deal
+//	in the Software without restriction, including without limitation the rights
+//	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//	copies of the Software, and to permit persons to whom the Software is
+//	furnished to do so, subject to the following conditions:
+//
+//	The above copyright notice and this permission notice shall be included in
+//	all copies or substantial portions of the Software.
+//
+//	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//	THE SOFTWARE.
+//
+
+#import "ULWatchdog.h"
+
+#import <mach/mach_time.h>
+#import <pthread.h>
+
+// The resolution of the innermost wheel
+#define ULWatchdogTickDuration		(NSEC_PER_SEC / 4)
+
+// Each wheel has 64 slots. Each level spans 64 times the range of the level below: 16 seconds, 17 minutes and 18 hours.
+#define ULWatchdogWheelBits			6
+#define ULWatchdogWheelSize			(1 << ULWatchdogWheelBits)
+#define ULWatchdogWheelMask			(ULWatchdogWheelSize - 1)
+#define ULWatchdogWheelLevels		3
+
+// Initial number of pooled entries
+#define ULWatchdogInitialCapacity	64
+
+#define ULWatchdogNoEntry			(-1)
+
+const ULWatchdogToken ULWatchdogInvalidToken = 0;
+
+/*!
+ @abstract Bookkeeping record of a tracked operation.
+ @discussion Records are pooled and linked by their index, either into a slot of the timer wheel or into the free list.
+ */
+typedef struct {
+	uint32_t		generation;				// Incremented whenever the record is released. Used to detect stale tokens.
+	BOOL			isActive;				// Whether the record belongs to a running operation
+
+	int32_t			next;					// Next record in the same slot or free list
+	int32_t			previous;				// Previous record in the same slot
+	int32_t			slot;					// The wheel slot the record is linked into, or ULWatchdogNoEntry if the record is not armed
+
+	NSUInteger		kind;
+	NSUInteger		context;
+	NSTimeInterval	deadline;
+
+	uint64_t		beginTime;				// Absolute time the operation was started
+	uint64_t		coordinationTime;		// Absolute time the operation started to wait for a coordinator, zero if not waiting
+	uint64_t		expirationTick;			// The wheel tick the operation expires at
+} ULWatchdogEntry;
+
+static mach_timebase_info_data_t ULWatchdogTimebase;
+
+static inline NSTimeInterval ULWatchdogSecondsForDuration(uint64_t duration)
+{
+	return (NSTimeInterval)(duration * ULWatchdogTimebase.numer / ULWatchdogTimebase.denom) / NSEC_PER_SEC;
+}
+
+
+@interface ULWatchdogReport ()
+
+@property(nonatomic, readwrite) NSUInteger kind;
+@property(nonatomic, readwrite) NSUInteger context;
+@property(nonatomic, readwrite) NSTimeInterval deadline;
+@property(nonatomic, readwrite) NSTimeInterval duration;
+@property(nonatomic, readwrite) NSFileCoordinator *coordinator;
+@property(nonatomic, readwrite) NSTimeInterval coordinationDuration;
+
+// The delegate to be notified. Kept alive until the report has been delivered.
+@property(nonatomic, readwrite) id<ULWatchdogDelegate> delegate;
+
+@end
+
+@implementation ULWatchdogReport
+@end
+
+
+@interface ULWatchdog ()
+{
+	pthread_mutex_t		_lock;
+	dispatch_queue_t	_queue;
+	dispatch_source_t	_timer;
+	BOOL				_isTimerRunning;
+
+	uint64_t			_epoch;								// Absolute time of tick zero
+	uint64_t			_currentTick;						// Last tick processed by the wheel
+
+	int32_t				_slots[ULWatchdogWheelLevels * ULWatchdogWheelSize];
+
+	ULWatchdogEntry		*_entries;
+	int32_t				_capacity;
+	int32_t				_freeList;
+
+	NSPointerArray		*_delegates;						// Weak delegates by record index
+	NSPointerArray		*_coordinators;						// Weak coordinators by record index
+
+	NSUInteger			_armedCount;						// Number of records linked into the wheel
+	NSUInteger			_activeCount;						// Number of running operations
+}
+
+@end
+
+@implementation ULWatchdog
+
++ (instancetype)sharedWatchdog
+{
+	static ULWatchdog *sharedWatchdog;
+	static dispatch_once_t onceToken;
+
+	dispatch_once(&onceToken, ^{
+		sharedWatchdog = [self new];
+	});
+
+	return sharedWatchdog;
+}
+
+- (instancetype)init
+{
+	self = [super init];
+
+	if (self) {
+		static dispatch_once_t onceToken;
+		dispatch_once(&onceToken, ^{
+			mach_timebase_info(&ULWatchdogTimebase);
+		});
+
+		pthread_mutex_init(&_lock, NULL);
+
+		_queue = dispatch_queue_create("com.soulmen.ulysses3.watchdog", DISPATCH_QUEUE_SERIAL);
+		dispatch_set_target_queue(_queue, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0));
+
+		// The timer is created suspended and will only be resumed while operations are armed
+		_timer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, _queue);
+
+		__weak ULWatchdog *weakSelf = self;
+		dispatch_source_set_event_handler(_timer, ^{
+			[weakSelf processTicks];
+		});
+
+		_epoch = mach_absolute_time();
+
+		for (NSUInteger slot = 0; slot < ULWatchdogWheelLevels * ULWatchdogWheelSize; slot ++)
+			_slots[slot] = ULWatchdogNoEntry;
+
+		_freeList = ULWatchdogNoEntry;
+		_delegates = [NSPointerArray weakObjectsPointerArray];
+		_coordinators = [NSPointerArray weakObjectsPointerArray];
+
+		[self growPool];
+	}
+
+	return self;
+}
+
+- (void)dealloc
+{
+	if (!_isTimerRunning)
+		dispatch_resume(_timer);
+
+	dispatch_source_cancel(_timer);
+	pthread_mutex_destroy(&_lock);
+	free(_entries);
+}
+
+
+#pragma mark - Operation tracking
+
+- (ULWatchdogToken)beginOperationOfKind:(NSUInteger)kind context:(NSUInteger)context deadline:(NSTimeInterval)deadline delegate:(id<ULWatchdogDelegate>)delegate
+{
+	uint64_t now = mach_absolute_time();
+	uint64_t nowTick = [self tickForTime: now];
+
+	pthread_mutex_lock(&_lock);
+
+	if (_freeList == ULWatchdogNoEntry)
+		[self growPool];
+
+	int32_t index = _freeList;
+	ULWatchdogEntry *entry = &_entries[index];
+	_freeList = entry->next;
+
+	entry->isActive = YES;
+	entry->kind = kind;
+	entry->context = context;
+	entry->deadline = deadline;
+	entry->beginTime = now;
+	entry->coordinationTime = 0;
+	entry->expirationTick = nowTick + (uint64_t)ceil(deadline * NSEC_PER_SEC / ULWatchdogTickDuration);
+
+	[_delegates replacePointerAtIndex:index withPointer:(__bridge void *)delegate];
+	[_coordinators replacePointerAtIndex:index withPointer:NULL];
+
+	// The wheel is empty while the timer is not running, so it can safely be moved to the current tick
+	if (!_isTimerRunning) {
+		_currentTick = nowTick;
+		[self startTimer];
+	}
+
+	[self linkEntryAtIndex: index];
+	_armedCount ++;
+	_activeCount ++;
+
+	ULWatchdogToken token = ((uint64_t)entry->generation << 32) | (uint64_t)(index + 1);
+
+	pthread_mutex_unlock(&_lock);
+
+	return token;
+}
+
+- (void)operation:(ULWatchdogToken)token willWaitForCoordinator:(NSFileCoordinator *)coordinator
+{
+	pthread_mutex_lock(&_lock);
+
+	int32_t index = [self indexForToken: token];
+	if (index != ULWatchdogNoEntry) {
+		_entries[index].coordinationTime = mach_absolute_time();
+		[_coordinators replacePointerAtIndex:index withPointer:(__bridge void *)coordinator];
+	}
+
+	pthread_mutex_unlock(&_lock);
+}
+
+- (void)operationDidAcquireCoordination:(ULWatchdogToken)token
+{
+	pthread_mutex_lock(&_lock);
+
+	int32_t index = [self indexForToken: token];
+	if (index != ULWatchdogNoEntry) {
+		_entries[index].coordinationTime = 0;
+		[_coordinators replacePointerAtIndex:index withPointer:NULL];
+	}
+
+	pthread_mutex_unlock(&_lock);
+}
+
+- (void)endOperation:(ULWatchdogToken)token
+{
+	pthread_mutex_lock(&_lock);
+
+	int32_t index = [self indexForToken: token];
+	if (index != ULWatchdogNoEntry) {
+		ULWatchdogEntry *entry = &_entries[index];
+
+		// Disarm if not yet expired
+		if (entry->slot != ULWatchdogNoEntry) {
+			[self unlinkEntryAtIndex: index];
+			_armedCount --;
+		}
+
+		[_delegates replacePointerAtIndex:index withPointer:NULL];
+		[_coordinators replacePointerAtIndex:index withPointer:NULL];
+
+		// Release record to pool
+		entry->isActive = NO;
+		entry->generation ++;
+		entry->next = _freeList;
+		_freeList = index;
+
+		_activeCount --;
+
+		// No need to wake up anymore
+		if (!_armedCount)
+			[self stopTimer];
+	}
+
+	pthread_mutex_unlock(&_lock);
+}
+
+- (NSUInteger)activeOperationCount
+{
+	pthread_mutex_lock(&_lock);
+	NSUInteger count = _activeCount;
+	pthread_mutex_unlock(&_lock);
+
+	return count;
+}
+
+
+#pragma mark - Record management
+
+- (void)growPool
+{
+	int32_t oldCapacity = _capacity;
+	int32_t newCapacity = MAX(oldCapacity * 2, ULWatchdogInitialCapacity);
+
+	_entries = reallocf(_entries, newCapacity * sizeof(ULWatchdogEntry));
+	NSAssert(_entries, @"Cannot allocate watchdog records.");
+
+	// Link new records into the free list
+	for (int32_t index = newCapacity - 1; index >= oldCapacity; index --) {
+		_entries[index] = (ULWatchdogEntry){.generation = 1, .next = _freeList, .previous = ULWatchdogNoEntry, .slot = ULWatchdogNoEntry};
+		_freeList = index;
+	}
+
+	_delegates.count = newCapacity;
+	_coordinators.count = newCapacity;
+	_capacity = newCapacity;
+}
+
+- (int32_t)indexForToken:(ULWatchdogToken)token
+{
+	int64_t index = (int64_t)(token & UINT32_MAX) - 1;
+	uint32_t generation = (uint32_t)(token >> 32);
+
+	if (index < 0 || index >= _capacity || !_entries[index].isActive || _entries[index].generation != generation)
+		return ULWatchdogNoEntry;
+
+	return (int32_t)index;
+}
+
+
+#pragma mark - Timer wheel
+
+- (uint64_t)tickForTime:(uint64_t)time
+{
+	return (time - _epoch) * ULWatchdogTimebase.numer / ULWatchdogTimebase.denom / ULWatchdogTickDuration;
+}
+
+- (void)linkEntryAtIndex:(int32_t)index
+{
+	ULWatchdogEntry *entry = &_entries[index];
+
+	// Records that are already due will fire on the next tick
+	uint64_t expirationTick = MAX(entry->expirationTick, _currentTick + 1);
+	uint64_t delta = expirationTick - _currentTick;
+
+	// Find the innermost wheel that covers the remaining time. Records beyond the outermost wheel are clamped to its range and re-inserted when cascading.
+	NSUInteger level = 0;
+	while (level < ULWatchdogWheelLevels - 1 && delta >= (1ULL << ((level + 1) * ULWatchdogWheelBits)))
+		level ++;
+
+	uint64_t maximumDelta = (1ULL << ((level + 1) * ULWatchdogWheelBits)) - 1;
+	if (delta > maximumDelta)
+		expirationTick = _currentTick + maximumDelta;
+
+	int32_t slot = (int32_t)(level * ULWatchdogWheelSize + ((expirationTick >> (level * ULWatchdogWheelBits)) & ULWatchdogWheelMask));
+
+	// Push front
+	entry->slot = slot;
+	entry->previous = ULWatchdogNoEntry;
+	entry->next = _slots[slot];
+
+	if (entry->next != ULWatchdogNoEntry)
+		_entries[entry->next].previous = index;
+
+	_slots[slot] = index;
+}
+
+- (void)unlinkEntryAtIndex:(int32_t)index
+{
+	ULWatchdogEntry *entry = &_entries[index];
+
+	if (entry->previous != ULWatchdogNoEntry)
+		_entries[entry->previous].next = entry->next;
+	else
+		_slots[entry->slot] = entry->next;
+
+	if (entry->next != ULWatchdogNoEntry)
+		_entries[entry->next].previous = entry->previous;
+
+	entry->slot = ULWatchdogNoEntry;
+	entry->next = ULWatchdogNoEntry;
+	entry->previous = ULWatchdogNoEntry;
+}
+
+- (int32_t)detachSlot:(int32_t)slot
+{
+	int32_t head = _slots[slot];
+	_slots[slot] = ULWatchdogNoEntry;
+
+	for (int32_t index = head; index != ULWatchdogNoEntry; index = _entries[index].next)
+		_entries[index].slot = ULWatchdogNoEntry;
+
+	return head;
+}
+
+- (void)advanceTickCollectingReports:(NSMutableArray **)reports
+{
+	_currentTick ++;
+
+	// Whenever an inner wheel completes a turn, the next slot of the outer wheel is redistributed. Outer wheels go first, so their records may be cascaded further down.
+	NSUInteger cascadingLevels = 0;
+	while (cascadingLevels < ULWatchdogWheelLevels - 1 && !(_currentTick & ((1ULL << ((cascadingLevels + 1) * ULWatchdogWheelBits)) - 1)))
+		cascadingLevels ++;
+
+	for (NSUInteger level = cascadingLevels; level >= 1; level --) {
+		int32_t slot = (int32_t)(level * ULWatchdogWheelSize + ((_currentTick >> (level * ULWatchdogWheelBits)) & ULWatchdogWheelMask));
+
+		for (int32_t index = [self detachSlot: slot], next; index != ULWatchdogNoEntry; index = next) {
+			next = _entries[index].next;
+			[self linkEntryAtIndex: index];
+		}
+	}
+
+	// Fire all due records of the innermost wheel
+	uint64_t now = mach_absolute_time();
+
+	for (int32_t index = [self detachSlot: (int32_t)(_currentTick & ULWatchdogWheelMask)], next; index != ULWatchdogNoEntry; index = next) {
+		ULWatchdogEntry *entry = &_entries[index];
+		next = entry->next;
+
+		// Clamped records are not due yet
+		if (entry->expirationTick > _currentTick) {
+			[self linkEntryAtIndex: index];
+			continue;
+		}
+
+		entry->next = ULWatchdogNoEntry;
+		entry->previous = ULWatchdogNoEntry;
+		_armedCount --;
+
+		// Skip reports for gone delegates
+		id<ULWatchdogDelegate> delegate = [_delegates pointerAtIndex: index];
+		if (!delegate)
+			continue;
+
+		ULWatchdogReport *report = [ULWatchdogReport new];
+		report.kind = entry->kind;
+		report.context = entry->context;
+		report.deadline = entry->deadline;
+		report.duration = ULWatchdogSecondsForDuration(now - entry->beginTime);
+		report.delegate = delegate;
+
+		if (entry->coordinationTime) {
+			report.coordinator = [_coordinators pointerAtIndex: index];
+			report.coordinationDuration = ULWatchdogSecondsForDuration(now - entry->coordinationTime);
+		}
+
+		if (!*reports)
+			*reports = [NSMutableArray new];
+
+		[*reports addObject: report];
+	}
+}
+
+- (void)processTicks
+{
+	NSMutableArray *reports;
+
+	pthread_mutex_lock(&_lock);
+
+	uint64_t nowTick = [self tickForTime: mach_absolute_time()];
+
+	while (_currentTick < nowTick && _armedCount)
+		[self advanceTickCollectingReports: &reports];
+
+	if (!_armedCount)
+		[self stopTimer];
+
+	pthread_mutex_unlock(&_lock);
+
+	// Notify delegates outside of the lock, so they may begin or end operations
+	for (ULWatchdogReport *report in reports) {
+		dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+			[report.delegate watchdog:self operationDidExceedDeadline:report];
+			report.delegate = nil;
+		});
+	}
+}
+
+- (void)startTimer
+{
+	if (_isTimerRunning)
+		return;
+
+	dispatch_source_set_timer(_timer, dispatch_time(DISPATCH_TIME_NOW, ULWatchdogTickDuration), ULWatchdogTickDuration, ULWatchdogTickDuration / 2);
+	dispatch_resume(_timer);
+
+	_isTimerRunning = YES;
+}
+
+- (void)stopTimer
+{
+	if (!_isTimerRunning)
+		return;
+
+	dispatch_suspend(_timer);
+	_isTimerRunning = NO;
+}
+
+@end
@@ -0,0 +1,104 @@
+//
+//  ULBenchmarkDocument.h
+//
+//  Copyright © 2018 Ulysses GmbH & Co. KG
+//
+//	Permission is hereby granted, free of charge, to any person obtaining a copy
+//	of this software and associated documentation files (the "Software"), to deal
+//	in the Software without restriction, including without limitation the rights
+//	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//	copies of the Software, and to permit persons to whom the Software is
+//	furnished to do so, subject to the following conditions:
+//
+//	The above copyright notice and this permission notice shall be included in
+//	all copies or substantial portions of the Software.
+//
+//	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//	THE SOFTWARE.
+//
+
+#import "ULDocument.h"
+#import "ULDocument_Subclassing.h"
+
+/*!
+ @abstract The shape of the documents used by benchmarks.
+ */
+typedef struct {
+	BOOL		isPackage;				// Whether documents are packages instead of flat files
+	BOOL		usesContainer;			// Whether packages are stored as single container file
+	NSUInteger	subitemCount;			// Number of files inside a package
+	NSUInteger	itemLength;				// Bytes of a flat file or of each file inside a package
+} ULBenchmarkDocumentConfiguration;
+
+/*!
+ @abstract The configuration used by all benchmark documents. Must not be changed while documents are open.
+ */
+extern ULBenchmarkDocumentConfiguration ULBenchmarkConfiguration;
+
+/*!
+ @abstract Reads the configuration from the environment variables ULDOCUMENT_BENCHMARK_PACKAGE, ULDOCUMENT_BENCHMARK_CONTAINER, ULDOCUMENT_BENCHMARK_SUBITEMS and ULDOCUMENT_BENCHMARK_BYTES.
+ */
+void ULBenchmarkConfigurationLoadFromEnvironment(void);
+
+/*!
+ @abstract Describes the configuration in a JSON-compatible dictionary.
+ */
+NSDictionary *ULBenchmarkConfigurationDescription(void);
+
+/*!
+ @abstract A document of random binary items, shaped according to ULBenchmarkConfiguration.
+ @discussion The first 8 bytes of each document carry a marker that identifies the write that produced the contents.
+ */
+@interface ULBenchmarkDocument : ULDocument
+
+/*!
+ @abstract The contents of the document, one NSData for each item.
+ */
+@property(atomic, copy) NSArray *items;
+
+/*!
+ @abstract The marker of the current contents.
+ */
+@property(atomic, readonly) uint64_t marker;
+
+/*!
+ @abstract Executed once after the next read finished. Used to detect completed reverts.
+ */
+@property(atomic, copy) void (^didReadHandler)(void);
+
+/*!
+ @abstract Executed after each read with the marker that has been read.
+ */
+@property(atomic, copy) void (^readObserver)(ULBenchmarkDocument *document, uint64_t marker);
+
+/*!
+ @abstract Creates random items carrying the passed marker.
+ */
++ (NSArray *)randomItemsWithMarker:(uint64_t)marker;
+
+/*!
+ @abstract Creates a file wrapper for the passed items.
+ */
++ (NSFileWrapper *)fileWrapperWithItems:(NSArray *)items;
+
+/*!
+ @abstract Writes the passed items to the passed URL atomically and without coordination, using the storage of benchmark documents.
+ */
++ (BOOL)writeItems:(NSArray *)items toURL:(NSURL *)url error:(NSError **)outError;
+
+/*!
+ @abstract Reads the marker of the document stored at the passed URL without coordination. Returns 0 if unreadable.
+ */
++ (uint64_t)markerOfItemAtURL:(NSURL *)url;
+
+/*!
+ @abstract Replaces the first item by random data carrying the passed marker and marks the document as changed. Other items of a package remain unchanged.
+ */
+- (void)touchWithMarker:(uint64_t)marker;
+
+@end
@@ -0,0 +1,221 @@
+//
+//  ULBenchmarkDocument.m
+//
+//  Copyright © 2018 Ulysses GmbH & Co. KG
+//
+//	Permission is hereby granted, free of charge, to any person obtaining a copy
+//	of this software and associated documentation files (the "Software"), to deal
+//	in the Software without restriction, including without limitation the rights
+//	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//	copies of the Software, and to permit persons to whom the Software is
+//	furnished to do so, subject to the following conditions:
+//
+//	The above copyright notice and this permission notice shall be included in
+//	all copies or substantial portions of the Software.
+//
+//	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//	THE SOFTWARE.
+//
+
+#import "ULBenchmarkDocument.h"
+
+ULBenchmarkDocumentConfiguration ULBenchmarkConfiguration = {NO, NO, 8, 4096};
+
+// The name of the item carrying the marker inside packages
+static NSString *ULBenchmarkDocumentFirstItemName = @"item-0.dat";
+
+void ULBenchmarkConfigurationLoadFromEnvironment(void)
+{
+	NSDictionary *environment = NSProcessInfo.processInfo.environment;
+
+	if (environment[@"ULDOCUMENT_BENCHMARK_PACKAGE"])
+		ULBenchmarkConfiguration.isPackage = [environment[@"ULDOCUMENT_BENCHMARK_PACKAGE"] boolValue];
+	if (environment[@"ULDOCUMENT_BENCHMARK_CONTAINER"])
+		ULBenchmarkConfiguration.usesContainer = [environment[@"ULDOCUMENT_BENCHMARK_CONTAINER"] boolValue];
+	if (environment[@"ULDOCUMENT_BENCHMARK_SUBITEMS"])
+		ULBenchmarkConfiguration.subitemCount = MAX(1, [environment[@"ULDOCUMENT_BENCHMARK_SUBITEMS"] integerValue]);
+	if (environment[@"ULDOCUMENT_BENCHMARK_BYTES"])
+		ULBenchmarkConfiguration.itemLength = [environment[@"ULDOCUMENT_BENCHMARK_BYTES"] integerValue];
+
+	// Space for the marker
+	ULBenchmarkConfiguration.itemLength = MAX(sizeof(uint64_t), ULBenchmarkConfiguration.itemLength);
+}
+
+NSDictionary *ULBenchmarkConfigurationDescription(void)
+{
+	return @{
+		@"package":		@(ULBenchmarkConfiguration.isPackage),
+		@"container":	@(ULBenchmarkConfiguration.isPackage && ULBenchmarkConfiguration.usesContainer),
+		@"subitems":	@(ULBenchmarkConfiguration.isPackage ? ULBenchmarkConfiguration.subitemCount : 1),
+		@"bytes":		@(ULBenchmarkConfiguration.itemLength),
+	};
+}
+
+static NSData *ULBenchmarkRandomData(NSUInteger length)
+{
+	NSMutableData *data = [NSMutableData dataWithLength: length];
+	arc4random_buf(data.mutableBytes, length);
+	return data;
+}
+
+static NSData *ULBenchmarkRandomItemWithMarker(uint64_t marker)
+{
+	NSMutableData *item = [ULBenchmarkRandomData(ULBenchmarkConfiguration.itemLength) mutableCopy];
+	[item replaceBytesInRange:NSMakeRange(0, sizeof(marker)) withBytes:&marker];
+	
+	return item;
+}
+
+static uint64_t ULBenchmarkMarkerOfData(NSData *data)
+{
+	uint64_t marker = 0;
+
+	if (data.length >= sizeof(marker))
+		[data getBytes:&marker length:sizeof(marker)];
+
+	return marker;
+}
+
+
+@interface ULBenchmarkDocument ()
+
+@property(atomic, readwrite) uint64_t marker;
+
+@end
+
+@implementation ULBenchmarkDocument
+
++ (NSString *)defaultFileType
+{
+	return ULBenchmarkConfiguration.isPackage ? @"com.ulyssesapp.benchmark-package" : @"com.ulyssesapp.benchmark";
+}
+
++ (NSString *)defaultPathExtension
+{
+	return ULBenchmarkConfiguration.isPackage ? @"ulbenchpkg" : @"ulbench";
+}
+
++ (BOOL)shouldHandleSubitemChanges
+{
+	return ULBenchmarkConfiguration.isPackage && !ULBenchmarkConfiguration.usesContainer;
+}
+
++ (BOOL)usesContainerStorage
+{
+	return ULBenchmarkConfiguration.isPackage && ULBenchmarkConfiguration.usesContainer;
+}
+
++ (NSArray *)randomItemsWithMarker:(uint64_t)marker
+{
+	NSMutableArray *items = [NSMutableArray new];
+	NSUInteger count = ULBenchmarkConfiguration.isPackage ? ULBenchmarkConfiguration.subitemCount : 1;
+	
+	[items addObject: ULBenchmarkRandomItemWithMarker(marker)];
+	
+	for (NSUInteger index = 1; index < count; index ++)
+		[items addObject: ULBenchmarkRandomData(ULBenchmarkConfiguration.itemLength)];
+	
+	return items;
+}
+
++ (NSFileWrapper *)fileWrapperWithItems:(NSArray *)items
+{
+	if (!ULBenchmarkConfiguration.isPackage)
+		return [[NSFileWrapper alloc] initRegularFileWithContents: items.firstObject];
+
+	NSMutableDictionary *wrappers = [NSMutableDictionary new];
+
+	[items enumerateObjectsUsingBlock:^(NSData *item, NSUInteger index, BOOL *stop) {
+		wrappers[[NSString stringWithFormat: @"item-%lu.dat", index]] = [[NSFileWrapper alloc] initRegularFileWithContents: item];
+	}];
+
+	return [[NSFileWrapper alloc] initDirectoryWithFileWrappers: wrappers];
+}
+
++ (BOOL)writeItems:(NSArray *)items toURL:(NSURL *)url error:(NSError **)outError
+{
+	if (!self.usesContainerStorage)
+		return [[self fileWrapperWithItems: items] writeToURL:url options:NSFileWrapperWritingAtomic originalContentsURL:nil error:outError];
+	
+	// Containers are only written by documents
+	ULBenchmarkDocument *document = [[self alloc] initWithFileURL:url readOnly:YES];
+	document.items = items;
+	
+	return [document writeToURL:url forSaveOperation:ULDocumentSaveTo originalContentsURL:nil error:outError];
+}
+
++ (uint64_t)markerOfItemAtURL:(NSURL *)url
+{
+	if (self.usesContainerStorage) {
+		ULBenchmarkDocument *document = [[self alloc] initWithFileURL:url readOnly:YES];
+		return [document readFromURL:url error:NULL] ? document.marker : 0;
+	}
+	
+	if (ULBenchmarkConfiguration.isPackage)
+		url = [url URLByAppendingPathComponent: ULBenchmarkDocumentFirstItemName];
+
+	NSFileHandle *fileHandle = [NSFileHandle fileHandleForReadingFromURL:url error:NULL];
+	NSData *data = [fileHandle readDataOfLength: sizeof(uint64_t)];
+	[fileHandle closeFile];
+
+	return ULBenchmarkMarkerOfData(data);
+}
+
+- (BOOL)readFromFileWrapper:(NSFileWrapper *)fileWrapper error:(NSError **)outError
+{
+	if (fileWrapper.isDirectory) {
+		NSMutableArray *items = [NSMutableArray new];
+
+		for (NSUInteger index = 0; index < fileWrapper.fileWrappers.count; index ++)
+			[items addObject: [fileWrapper.fileWrappers[[NSString stringWithFormat: @"item-%lu.dat", index]] regularFileContents] ?: [NSData new]];
+
+		self.items = items;
+	}
+	else {
+		self.items = @[fileWrapper.regularFileContents ?: [NSData new]];
+	}
+
+	uint64_t marker = ULBenchmarkMarkerOfData(self.items.firstObject);
+	self.marker = marker;
+
+	void (^didReadHandler)(void) = self.didReadHandler;
+	self.didReadHandler = nil;
+
+	if (didReadHandler)
+		didReadHandler();
+
+	void (^readObserver)(ULBenchmarkDocument *, uint64_t) = self.readObserver;
+
+	if (readObserver)
+		readObserver(self, marker);
+
+	return YES;
+}
+
+- (NSFileWrapper *)fileWrapperWithError:(NSError **)outError
+{
+	return [self.class fileWrapperWithItems: self.items];
+}
+
+- (void)touchWithMarker:(uint64_t)marker
+{
+	// Like a typical edit, only the first item of a package changes
+	NSMutableArray *items = [self.items mutableCopy];
+	
+	if (items.count)
+		items[0] = ULBenchmarkRandomItemWithMarker(marker);
+	else
+		items = [[self.class randomItemsWithMarker: marker] mutableCopy];
+	
+	self.items = items;
+	self.marker = marker;
+	
+	[self updateChangeCount: ULDocumentChangeDone];
+}
+
+@end
@@ -0,0 +1,321 @@
+//
+//  ULDocumentBenchmarks.m
+//
+//  Copyright © 2018 Ulysses GmbH & Co. KG
+//
+//	Permission is hereby granted, free of charge, to any person obtaining a copy
+//	of this software and associated documentation files (the "Software"), to deal
+//	in the Software without restriction, including without limitation the rights
+//	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//	copies of the Software, and to permit persons to whom the Software is
+//	furnished to do so, subject to the following conditions:
+//
+//	The above copyright notice and this permission notice shall be included in
+//	all copies or substantial portions of the Software.
+//
+//	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//	THE SOFTWARE.
+//
+
+#import "ULBenchmarkDocument.h"
+
+#import "XCTestCase+TestExtensions.h"
+
+#import <mach/mach.h>
+#import <mach/mach_time.h>
+#import <sys/resource.h>
+
+// The benchmark is configured through environment variables. When running through xcodebuild, prefix them with TEST_RUNNER_.
+// The document shape is read from ULDOCUMENT_BENCHMARK_PACKAGE, ULDOCUMENT_BENCHMARK_CONTAINER, ULDOCUMENT_BENCHMARK_SUBITEMS and ULDOCUMENT_BENCHMARK_BYTES, see ULBenchmarkDocument.h.
+#define ULBenchmarkScalesVariable			@"ULDOCUMENT_BENCHMARK_SCALES"			// Comma-separated numbers of open documents. Default: 1,100,10000
+#define ULBenchmarkResultsVariable			@"ULDOCUMENT_BENCHMARK_RESULTS"			// Path of the JSON results. Default: ULDocumentBenchmarks.json in the temporary directory
+#define ULBenchmarkLabelVariable			@"ULDOCUMENT_BENCHMARK_LABEL"			// Free-form label stored with the results, e.g. a revision
+
+// Version of the results format
+#define ULBenchmarkResultsFormatVersion		3
+
+// Number of autosaves performed in a row at a scale of one document. Larger scales perform fewer autosaves per document.
+#define ULBenchmarkSustainedAutosaveCount	1000
+
+static mach_timebase_info_data_t ULBenchmarkTimebase;
+
+static inline NSTimeInterval ULBenchmarkSecondsSince(uint64_t beginTime)
+{
+	return (NSTimeInterval)((mach_absolute_time() - beginTime) * ULBenchmarkTimebase.numer / ULBenchmarkTimebase.denom) / NSEC_PER_SEC;
+}
+
+/*!
+ @abstract I/O performed by the whole process, including unrelated threads.
+ */
+typedef struct {
+	uint64_t	systemCalls;				// BSD system calls
+	uint64_t	blockReads;					// Reads that were not served by the buffer cache
+	uint64_t	blockWrites;
+} ULBenchmarkIOCounters;
+
+static ULBenchmarkIOCounters ULBenchmarkCurrentIOCounters(void)
+{
+	ULBenchmarkIOCounters counters = {0};
+	
+	task_events_info_data_t eventsInfo;
+	mach_msg_type_number_t count = TASK_EVENTS_INFO_COUNT;
+	
+	if (task_info(mach_task_self(), TASK_EVENTS_INFO, (task_info_t)&eventsInfo, &count) == KERN_SUCCESS)
+		counters.systemCalls = eventsInfo.syscalls_unix;
+	
+	struct rusage usage;
+	
+	if (getrusage(RUSAGE_SELF, &usage) == 0) {
+		counters.blockReads = usage.ru_inblock;
+		counters.blockWrites = usage.ru_oublock;
+	}
+	
+	return counters;
+}
+
+
+@interface ULDocumentBenchmarks : XCTestCase
+@end
+
+@implementation ULDocumentBenchmarks
+
+// Results of all measurements in this run
+static NSMutableArray *ULBenchmarkResults;
+
++ (void)setUp
+{
+	[super setUp];
+
+	mach_timebase_info(&ULBenchmarkTimebase);
+	ULBenchmarkResults = [NSMutableArray new];
+
+	ULBenchmarkConfigurationLoadFromEnvironment();
+}
+
++ (void)tearDown
+{
+	NSDictionary *environment = NSProcessInfo.processInfo.environment;
+	NSProcessInfo *processInfo = NSProcessInfo.processInfo;
+
+	NSString *path = environment[ULBenchmarkResultsVariable] ?: [NSTemporaryDirectory() stringByAppendingPathComponent: @"ULDocumentBenchmarks.json"];
+
+	NSDictionary *report = @{
+		@"format":			@(ULBenchmarkResultsFormatVersion),
+		@"date":			@(NSDate.date.timeIntervalSince1970),
+		@"label":			environment[ULBenchmarkLabelVariable] ?: @"",
+		@"environment":		@{
+			@"os":				processInfo.operatingSystemVersionString,
+			@"processors":		@(processInfo.activeProcessorCount),
+			@"memory":			@(processInfo.physicalMemory),
+		},
+		@"configuration":	ULBenchmarkConfigurationDescription(),
+		@"results":			ULBenchmarkResults
+	};
+
+	NSData *data = [NSJSONSerialization dataWithJSONObject:report options:NSJSONWritingPrettyPrinted error:NULL];
+	[data writeToFile:path atomically:YES];
+	NSLog(@"Benchmark results written to %@", path);
+
+	[super tearDown];
+}
+
+- (void)setUp
+{
+	[super setUp];
+
+	// Neither timed autosaves nor versions should interfere with measurements
+	[ULDocument setAutosaveDelay: 100000];
+	[ULDocument setAutoversioningInterval: 0];
+}
+
+- (void)testDocumentLifecycle
+{
+	NSString *scales = NSProcessInfo.processInfo.environment[ULBenchmarkScalesVariable] ?: @"1,100,10000";
+
+	for (NSString *scale in [scales componentsSeparatedByString: @","]) {
+		NSUInteger count = MAX(1, scale.integerValue);
+
+		@autoreleasepool {
+			[self measureLifecycleWithDocumentCount: count];
+		}
+	}
+}
+
+
+#pragma mark - Measurements
+
+- (void)measureLifecycleWithDocumentCount:(NSUInteger)count
+{
+	NSURL *directoryURL = self.ul_newTemporarySubdirectory;
+	NSMutableArray *documents = [NSMutableArray new];
+
+	// Create documents on disk without measuring
+	for (NSUInteger index = 0; index < count; index ++) {
+		NSURL *url = [directoryURL URLByAppendingPathComponent: [NSString stringWithFormat: @"document-%lu.%@", index, ULBenchmarkDocument.defaultPathExtension]];
+		XCTAssertTrue([ULBenchmarkDocument writeItems:[ULBenchmarkDocument randomItemsWithMarker: 0] toURL:url error:NULL], @"Cannot create document");
+
+		[documents addObject: [[ULBenchmarkDocument alloc] initWithFileURL:url readOnly:NO]];
+	}
+
+	[self measureOperation:@"open" onDocuments:documents usingBlock:^(ULBenchmarkDocument *document, NSUInteger index, void (^completionHandler)(BOOL)) {
+		[document openWithCompletionHandler: completionHandler];
+	}];
+
+	[self measureOperation:@"save" onDocuments:documents usingBlock:^(ULBenchmarkDocument *document, NSUInteger index, void (^completionHandler)(BOOL)) {
+		[document touchWithMarker: 0];
+		[document saveWithCompletionHandler: completionHandler];
+	}];
+
+	[self measureOperation:@"autosave" onDocuments:documents usingBlock:^(ULBenchmarkDocument *document, NSUInteger index, void (^completionHandler)(BOOL)) {
+		[document touchWithMarker: 0];
+		[document autosaveWithCompletionHandler: completionHandler];
+	}];
+
+	// Each document is saved again as soon as its previous autosave finished, as with very short autosave delays
+	[self measureOperation:@"sustained autosave" onDocuments:documents repetitions:MAX(1, ULBenchmarkSustainedAutosaveCount / count) usingBlock:^(ULBenchmarkDocument *document, NSUInteger index, void (^completionHandler)(BOOL)) {
+		[document touchWithMarker: 0];
+		[document autosaveWithCompletionHandler: completionHandler];
+	}];
+
+	// Latency from the begin of an external coordinated write until the document has re-read its contents
+	[self measureOperation:@"revert" onDocuments:documents usingBlock:^(ULBenchmarkDocument *document, NSUInteger index, void (^completionHandler)(BOOL)) {
+		document.didReadHandler = ^{
+			completionHandler(YES);
+		};
+
+		NSArray *items = [ULBenchmarkDocument randomItemsWithMarker: 0];
+
+		[[[NSFileCoordinator alloc] initWithFilePresenter: nil] coordinateWritingItemAtURL:document.fileURL options:NSFileCoordinatorWritingForReplacing error:NULL byAccessor:^(NSURL *newURL) {
+			if (![ULBenchmarkDocument writeItems:items toURL:newURL error:NULL]) {
+				document.didReadHandler = nil;
+				completionHandler(NO);
+			}
+		}];
+	}];
+
+	[self measureOperation:@"move" onDocuments:documents usingBlock:^(ULBenchmarkDocument *document, NSUInteger index, void (^completionHandler)(BOOL)) {
+		NSURL *url = [directoryURL URLByAppendingPathComponent: [NSString stringWithFormat: @"moved-%lu.%@", index, ULBenchmarkDocument.defaultPathExtension]];
+		[document touchWithMarker: 0];
+		[document saveToURL:url forSaveOperation:ULDocumentSave completionHandler:completionHandler];
+	}];
+
+	[self measureOperation:@"delete" onDocuments:documents usingBlock:^(ULBenchmarkDocument *document, NSUInteger index, void (^completionHandler)(BOOL)) {
+		[document deleteWithCompletionHandler: completionHandler];
+	}];
+
+	for (ULBenchmarkDocument *document in documents)
+		[document close];
+}
+
+/*!
+ @abstract Starts an operation on all documents concurrently and records the latency of each operation, the throughput of all operations and the I/O per operation.
+ @discussion Operations that did not complete within the timeout are reported as incomplete.
+ */
+- (void)measureOperation:(NSString *)operation onDocuments:(NSArray *)documents usingBlock:(void (^)(ULBenchmarkDocument *document, NSUInteger index, void (^completionHandler)(BOOL success)))block
+{
+	[self measureOperation:operation onDocuments:documents repetitions:1 usingBlock:block];
+}
+
+/*!
+ @abstract Like -measureOperation:onDocuments:usingBlock:, but repeats the operation on each document the passed number of times.
+ @discussion Each repetition starts as soon as the previous one on the same document completed. Latencies, throughput and I/O are reported per repetition.
+ */
+- (void)measureOperation:(NSString *)operation onDocuments:(NSArray *)documents repetitions:(NSUInteger)repetitions usingBlock:(void (^)(ULBenchmarkDocument *document, NSUInteger index, void (^completionHandler)(BOOL success)))block
+{
+	NSUInteger count = documents.count * repetitions;
+
+	// Captured by the completion handlers, so late completions after a timeout remain safe
+	NSMutableData *latencyData = [NSMutableData dataWithLength: count * sizeof(NSTimeInterval)];
+	__block NSUInteger completedCount = 0;
+	__block NSUInteger failureCount = 0;
+	NSObject *lock = [NSObject new];
+
+	dispatch_group_t group = dispatch_group_create();
+	ULBenchmarkIOCounters beginCounters = ULBenchmarkCurrentIOCounters();
+	uint64_t beginTime = mach_absolute_time();
+
+	[documents enumerateObjectsUsingBlock:^(ULBenchmarkDocument *document, NSUInteger index, BOOL *stop) {
+		dispatch_group_enter(group);
+
+		[self repeatOperationOnDocument:document index:index repetitions:repetitions usingBlock:block completionHandler:^(NSTimeInterval latency, BOOL success, BOOL isLastRepetition) {
+			@synchronized (lock) {
+				((NSTimeInterval *)latencyData.mutableBytes)[completedCount ++] = latency;
+
+				if (!success)
+					failureCount ++;
+			}
+
+			if (isLastRepetition)
+				dispatch_group_leave(group);
+		}];
+	}];
+
+	NSTimeInterval timeout = 60 + count * 0.05;
+	BOOL didComplete = !dispatch_group_wait(group, dispatch_time(DISPATCH_TIME_NOW, (int64_t)(timeout * NSEC_PER_SEC)));
+	NSTimeInterval duration = ULBenchmarkSecondsSince(beginTime);
+	ULBenchmarkIOCounters endCounters = ULBenchmarkCurrentIOCounters();
+
+	NSMutableArray *sortedLatencies = [NSMutableArray new];
+	NSUInteger reportedFailures;
+
+	@synchronized (lock) {
+		for (NSUInteger index = 0; index < completedCount; index ++)
+			[sortedLatencies addObject: @(((NSTimeInterval *)latencyData.mutableBytes)[index])];
+
+		reportedFailures = failureCount;
+	}
+
+	[sortedLatencies sortUsingSelector: @selector(compare:)];
+
+	NSTimeInterval (^percentile)(double) = ^NSTimeInterval(double fraction) {
+		if (!sortedLatencies.count)
+			return 0;
+
+		NSUInteger index = MIN(sortedLatencies.count - 1, (NSUInteger)ceil(fraction * sortedLatencies.count) - 1);
+		return [sortedLatencies[index] doubleValue];
+	};
+
+	NSDictionary *result = @{
+		@"operation":		operation,
+		@"documents":		@(documents.count),
+		@"repetitions":		@(repetitions),
+		@"completed":		@(sortedLatencies.count),
+		@"failures":		@(reportedFailures),
+		@"duration":		@(duration),
+		@"throughput":		@(sortedLatencies.count / duration),
+		@"p50":				@(percentile(0.5)),
+		@"p99":				@(percentile(0.99)),
+		@"max":				@([sortedLatencies.lastObject doubleValue]),
+		@"syscalls":		@((endCounters.systemCalls - beginCounters.systemCalls) / (double)count),
+		@"blockReads":		@((endCounters.blockReads - beginCounters.blockReads) / (double)count),
+		@"blockWrites":		@((endCounters.blockWrites - beginCounters.blockWrites) / (double)count),
+	};
+
+	[ULBenchmarkResults addObject: result];
+	NSLog(@"%@ x%lu: %.1f ops/s, p50 %.2fms, p99 %.2fms, %.0f syscalls/op, %lu incomplete, %lu failed", operation, count, [result[@"throughput"] doubleValue], percentile(0.5) * 1000, percentile(0.99) * 1000, [result[@"syscalls"] doubleValue], count - sortedLatencies.count, reportedFailures);
+
+	XCTAssertTrue(didComplete, @"%@ did not complete for %lu of %lu operations", operation, count - sortedLatencies.count, count);
+	XCTAssertEqual(reportedFailures, 0, @"%@ failed %lu times", operation, reportedFailures);
+}
+
+/*!
+ @abstract Performs an operation on a document the passed number of times in a row. Calls the completion handler with the latency of each repetition.
+ */
+- (void)repeatOperationOnDocument:(ULBenchmarkDocument *)document index:(NSUInteger)index repetitions:(NSUInteger)repetitions usingBlock:(void (^)(ULBenchmarkDocument *document, NSUInteger index, void (^completionHandler)(BOOL success)))block completionHandler:(void (^)(NSTimeInterval latency, BOOL success, BOOL isLastRepetition))completionHandler
+{
+	uint64_t beginTime = mach_absolute_time();
+
+	block(document, index, ^(BOOL success) {
+		completionHandler(ULBenchmarkSecondsSince(beginTime), success, repetitions <= 1);
+
+		if (repetitions > 1)
+			[self repeatOperationOnDocument:document index:index repetitions:repetitions - 1 usingBlock:block completionHandler:completionHandler];
+	});
+}
+
+@end
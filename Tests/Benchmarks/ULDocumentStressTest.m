@@ -0,0 +1,409 @@
+//
+//  ULDocumentStressTest.m
+//
+//  Copyright © 2018 Ulysses GmbH & Co. KG
+//
+//	Permission is hereby granted, free of charge, to any person obtaining a copy
+//	of this software and associated documentation files (the "Software"), to deal
+//	in the Software without restriction, including without limitation the rights
+//	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//	copies of the Software, and to permit persons to whom the Software is
+//	furnished to do so, subject to the following conditions:
+//
+//	The above copyright notice and this permission notice shall be included in
+//	all copies or substantial portions of the Software.
+//
+//	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//	THE SOFTWARE.
+//
+
+#import "ULBenchmarkDocument.h"
+
+#import "XCTestCase+TestExtensions.h"
+
+#import <mach/mach_time.h>
+
+// The stress test is configured through environment variables. When running through xcodebuild, prefix them with TEST_RUNNER_.
+// The document shape is read from ULDOCUMENT_BENCHMARK_PACKAGE, ULDOCUMENT_BENCHMARK_SUBITEMS and ULDOCUMENT_BENCHMARK_BYTES, see ULBenchmarkDocument.h.
+#define ULStressDocumentsVariable				@"ULDOCUMENT_STRESS_DOCUMENTS"				// Number of open documents. Default: 50
+#define ULStressCoordinatedWritersVariable		@"ULDOCUMENT_STRESS_COORDINATED_WRITERS"	// Number of external writers using file coordination. Default: 2
+#define ULStressUncoordinatedWritersVariable	@"ULDOCUMENT_STRESS_UNCOORDINATED_WRITERS"	// Number of external writers bypassing file coordination. Default: 2
+#define ULStressEditorsVariable					@"ULDOCUMENT_STRESS_EDITORS"				// Number of local editors changing and autosaving documents. Default: 1
+#define ULStressDurationVariable				@"ULDOCUMENT_STRESS_DURATION"				// Seconds to run writers and editors. Default: 10
+#define ULStressIntervalVariable				@"ULDOCUMENT_STRESS_INTERVAL"				// Seconds each writer or editor pauses between two writes. Default: 0.02
+#define ULStressSettleTimeoutVariable			@"ULDOCUMENT_STRESS_SETTLE_TIMEOUT"			// Seconds to wait for documents to catch up after writing stopped. Default: 30
+#define ULStressResultsVariable					@"ULDOCUMENT_STRESS_RESULTS"				// Path of the JSON results. Default: ULDocumentStress.json in the temporary directory
+
+// Interval for sampling the interaction backlog
+#define ULStressSamplingInterval				0.1
+
+// Version of the results format
+#define ULStressResultsFormatVersion			1
+
+static mach_timebase_info_data_t ULStressTimebase;
+
+static inline NSTimeInterval ULStressSecondsBetween(uint64_t beginTime, uint64_t endTime)
+{
+	return (NSTimeInterval)((endTime - beginTime) * ULStressTimebase.numer / ULStressTimebase.denom) / NSEC_PER_SEC;
+}
+
+/*!
+ @abstract The origin of a write.
+ */
+typedef enum : NSUInteger {
+	ULStressWriteSourceCoordinated,
+	ULStressWriteSourceUncoordinated,
+	ULStressWriteSourceEditor,
+} ULStressWriteSource;
+
+
+/*!
+ @abstract Bookkeeping of a single write.
+ */
+@interface ULStressWrite : NSObject
+
+@property(nonatomic) NSUInteger documentIndex;
+@property(nonatomic) ULStressWriteSource source;
+@property(nonatomic) uint64_t writeTime;
+
+// Time from the begin of the write until a revert read it. Negative if never read.
+@property(nonatomic) NSTimeInterval latency;
+
+@end
+
+@implementation ULStressWrite
+@end
+
+
+@interface ULDocumentStressTest : XCTestCase
+{
+	NSArray *_documents;
+	NSArray *_documentURLs;
+	NSArray *_documentLocks;						// Serializes writes to the same document, so the order on disk matches the order of markers
+
+	uint64_t _nextMarker;
+	NSMutableDictionary *_writes;					// ULStressWrite by marker. Synchronized on itself.
+	NSMutableArray *_currentMarkers;				// The marker each document is expected to hold in memory. Synchronized on _writes.
+	NSUInteger _revertCount;
+	NSUInteger _duplicateRevertCount;
+
+	NSMutableArray *_backlogSamples;
+	uint64_t _beginTime;
+}
+
+@end
+
+@implementation ULDocumentStressTest
+
+- (void)setUp
+{
+	[super setUp];
+
+	mach_timebase_info(&ULStressTimebase);
+	ULBenchmarkConfigurationLoadFromEnvironment();
+
+	// Neither timed autosaves nor versions should interfere with measurements
+	[ULDocument setAutosaveDelay: 100000];
+	[ULDocument setAutoversioningInterval: 0];
+}
+
+- (void)testConcurrentExternalWriters
+{
+	NSDictionary *environment = NSProcessInfo.processInfo.environment;
+
+	NSUInteger documentCount = MAX(1, [environment[ULStressDocumentsVariable] ?: @"50" integerValue]);
+	NSUInteger coordinatedWriterCount = [environment[ULStressCoordinatedWritersVariable] ?: @"2" integerValue];
+	NSUInteger uncoordinatedWriterCount = [environment[ULStressUncoordinatedWritersVariable] ?: @"2" integerValue];
+	NSUInteger editorCount = [environment[ULStressEditorsVariable] ?: @"1" integerValue];
+	NSTimeInterval duration = [environment[ULStressDurationVariable] ?: @"10" doubleValue];
+	NSTimeInterval interval = [environment[ULStressIntervalVariable] ?: @"0.02" doubleValue];
+	NSTimeInterval settleTimeout = [environment[ULStressSettleTimeoutVariable] ?: @"30" doubleValue];
+
+	[self openDocuments: documentCount];
+
+	// Sample the interaction backlog of all documents
+	_backlogSamples = [NSMutableArray new];
+	_beginTime = mach_absolute_time();
+
+	dispatch_queue_t samplerQueue = dispatch_queue_create("com.soulmen.ulysses3.stress.sampler", DISPATCH_QUEUE_SERIAL);
+	dispatch_source_t sampler = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, samplerQueue);
+	dispatch_source_set_timer(sampler, DISPATCH_TIME_NOW, ULStressSamplingInterval * NSEC_PER_SEC, ULStressSamplingInterval * NSEC_PER_SEC / 10);
+	dispatch_source_set_event_handler(sampler, ^{
+		[self sampleBacklog];
+	});
+	dispatch_resume(sampler);
+
+	// Run writers and editors concurrently
+	dispatch_group_t group = dispatch_group_create();
+	uint64_t endTime = _beginTime + (uint64_t)(duration * NSEC_PER_SEC * ULStressTimebase.denom / ULStressTimebase.numer);
+
+	for (NSUInteger index = 0; index < coordinatedWriterCount; index ++)
+		[self startWriterWithSource:ULStressWriteSourceCoordinated interval:interval endTime:endTime group:group];
+
+	for (NSUInteger index = 0; index < uncoordinatedWriterCount; index ++)
+		[self startWriterWithSource:ULStressWriteSourceUncoordinated interval:interval endTime:endTime group:group];
+
+	for (NSUInteger index = 0; index < editorCount; index ++)
+		[self startWriterWithSource:ULStressWriteSourceEditor interval:interval endTime:endTime group:group];
+
+	dispatch_group_wait(group, DISPATCH_TIME_FOREVER);
+
+	// Wait until all documents represent the state on disk and have no more pending interactions
+	BOOL didSettle = [self ul_waitForCondition:^BOOL{
+		return !self.unsettledDocumentIndexes.count;
+	} onMainLoop:NO otherQueues:nil timeout:settleTimeout];
+
+	// Samples are not taken after a pending event handler has finished
+	dispatch_source_cancel(sampler);
+	dispatch_sync(samplerQueue, ^{});
+
+	NSIndexSet *lostIndexes = self.unsettledDocumentIndexes;
+	NSDictionary *results = [self resultsWithLostDocuments: lostIndexes];
+
+	NSString *path = environment[ULStressResultsVariable] ?: [NSTemporaryDirectory() stringByAppendingPathComponent: @"ULDocumentStress.json"];
+	[[NSJSONSerialization dataWithJSONObject:results options:NSJSONWritingPrettyPrinted error:NULL] writeToFile:path atomically:YES];
+	NSLog(@"Stress results written to %@: %@", path, results[@"summary"]);
+
+	for (ULBenchmarkDocument *document in _documents)
+		[document close];
+
+	XCTAssertTrue(didSettle, @"Documents did not settle after %.0fs", settleTimeout);
+	XCTAssertEqual(lostIndexes.count, 0, @"Lost reverts on %lu documents", lostIndexes.count);
+}
+
+
+#pragma mark - Setup
+
+- (void)openDocuments:(NSUInteger)count
+{
+	NSURL *directoryURL = self.ul_newTemporarySubdirectory;
+	NSMutableArray *documents = [NSMutableArray new];
+	NSMutableArray *documentURLs = [NSMutableArray new];
+	NSMutableArray *documentLocks = [NSMutableArray new];
+
+	_writes = [NSMutableDictionary new];
+	_currentMarkers = [NSMutableArray new];
+	_nextMarker = 1;
+	_revertCount = 0;
+	_duplicateRevertCount = 0;
+
+	for (NSUInteger index = 0; index < count; index ++) {
+		NSURL *url = [directoryURL URLByAppendingPathComponent: [NSString stringWithFormat: @"document-%lu.%@", index, ULBenchmarkDocument.defaultPathExtension]];
+		XCTAssertTrue([ULBenchmarkDocument writeItems:[ULBenchmarkDocument randomItemsWithMarker: 0] toURL:url error:NULL], @"Cannot create document");
+
+		ULBenchmarkDocument *document = [[ULBenchmarkDocument alloc] initWithFileURL:url readOnly:NO];
+
+		BOOL success = [self ul_performOperation:^(void (^handler)(BOOL)) {
+			[document openWithCompletionHandler: handler];
+		}];
+		XCTAssertTrue(success, @"Opening failed");
+
+		document.readObserver = ^(ULBenchmarkDocument *document, uint64_t marker) {
+			[self document:document didReadMarker:marker];
+		};
+
+		[documents addObject: document];
+		[documentURLs addObject: url];
+		[documentLocks addObject: [NSLock new]];
+		[_currentMarkers addObject: @0];
+	}
+
+	_documents = documents;
+	_documentURLs = documentURLs;
+	_documentLocks = documentLocks;
+}
+
+
+#pragma mark - Writing
+
+- (void)startWriterWithSource:(ULStressWriteSource)source interval:(NSTimeInterval)interval endTime:(uint64_t)endTime group:(dispatch_group_t)group
+{
+	dispatch_group_async(group, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+		while (mach_absolute_time() < endTime) {
+			@autoreleasepool {
+				[self performWriteWithSource: source];
+			}
+
+			[NSThread sleepForTimeInterval: interval];
+		}
+	});
+}
+
+- (void)performWriteWithSource:(ULStressWriteSource)source
+{
+	NSUInteger index = arc4random_uniform((uint32_t)_documents.count);
+	ULBenchmarkDocument *document = _documents[index];
+	NSURL *url = _documentURLs[index];
+	NSLock *lock = _documentLocks[index];
+
+	[lock lock];
+
+	ULStressWrite *write = [ULStressWrite new];
+	write.documentIndex = index;
+	write.source = source;
+	write.latency = -1;
+
+	uint64_t marker;
+
+	@synchronized(_writes) {
+		marker = _nextMarker ++;
+		_writes[@(marker)] = write;
+	}
+
+	NSArray *items = (source != ULStressWriteSourceEditor) ? [ULBenchmarkDocument randomItemsWithMarker: marker] : nil;
+	write.writeTime = mach_absolute_time();
+
+	switch (source) {
+		case ULStressWriteSourceCoordinated:
+			[[[NSFileCoordinator alloc] initWithFilePresenter: nil] coordinateWritingItemAtURL:url options:NSFileCoordinatorWritingForReplacing error:NULL byAccessor:^(NSURL *newURL) {
+				[ULBenchmarkDocument writeItems:items toURL:newURL error:NULL];
+			}];
+			break;
+
+		case ULStressWriteSourceUncoordinated:
+			[ULBenchmarkDocument writeItems:items toURL:url error:NULL];
+			break;
+
+		case ULStressWriteSourceEditor:
+			@synchronized(_writes) {
+				_currentMarkers[index] = @(marker);
+			}
+
+			[document touchWithMarker: marker];
+			[document autosaveWithCompletionHandler: nil];
+			break;
+	}
+
+	[lock unlock];
+}
+
+- (void)document:(ULBenchmarkDocument *)document didReadMarker:(uint64_t)marker
+{
+	uint64_t readTime = mach_absolute_time();
+	NSUInteger index = [_documents indexOfObjectIdenticalTo: document];
+
+	if (index == NSNotFound)
+		return;
+
+	@synchronized(_writes) {
+		_revertCount ++;
+
+		// Reverting to the contents already in memory is redundant
+		if ([_currentMarkers[index] unsignedLongLongValue] == marker)
+			_duplicateRevertCount ++;
+
+		_currentMarkers[index] = @(marker);
+
+		ULStressWrite *write = _writes[@(marker)];
+		if (write && write.latency < 0)
+			write.latency = ULStressSecondsBetween(write.writeTime, readTime);
+	}
+}
+
+
+#pragma mark - Evaluation
+
+- (void)sampleBacklog
+{
+	NSUInteger totalBacklog = 0;
+	NSUInteger maximumBacklog = 0;
+
+	for (ULBenchmarkDocument *document in _documents) {
+		NSUInteger backlog = document.pendingInteractionCount;
+		totalBacklog += backlog;
+		maximumBacklog = MAX(maximumBacklog, backlog);
+	}
+
+	[_backlogSamples addObject: @{
+		@"time":		@(ULStressSecondsBetween(_beginTime, mach_absolute_time())),
+		@"total":		@(totalBacklog),
+		@"max":		@(maximumBacklog),
+	}];
+}
+
+- (NSIndexSet *)unsettledDocumentIndexes
+{
+	NSMutableIndexSet *indexes = [NSMutableIndexSet new];
+
+	[_documents enumerateObjectsUsingBlock:^(ULBenchmarkDocument *document, NSUInteger index, BOOL *stop) {
+		if (document.pendingInteractionCount || document.hasUnsavedChanges || document.marker != [ULBenchmarkDocument markerOfItemAtURL: self->_documentURLs[index]])
+			[indexes addIndex: index];
+	}];
+
+	return indexes;
+}
+
+- (NSDictionary *)resultsWithLostDocuments:(NSIndexSet *)lostIndexes
+{
+	NSMutableDictionary *latenciesBySource = [NSMutableDictionary new];
+	NSMutableDictionary *writeCountsBySource = [NSMutableDictionary new];
+	NSUInteger supersededCount = 0;
+
+	NSArray *sourceNames = @[@"coordinated", @"uncoordinated", @"editor"];
+
+	@synchronized(_writes) {
+		for (ULStressWrite *write in _writes.allValues) {
+			NSString *sourceName = sourceNames[write.source];
+			writeCountsBySource[sourceName] = @([writeCountsBySource[sourceName] unsignedIntegerValue] + 1);
+
+			// Local edits are not expected to be reverted
+			if (write.source == ULStressWriteSourceEditor)
+				continue;
+
+			// Unread writes have been replaced by a later write before the document could revert
+			if (write.latency < 0) {
+				supersededCount ++;
+				continue;
+			}
+
+			if (!latenciesBySource[sourceName])
+				latenciesBySource[sourceName] = [NSMutableArray new];
+
+			[latenciesBySource[sourceName] addObject: @(write.latency)];
+		}
+	}
+
+	NSMutableDictionary *latencyResults = [NSMutableDictionary new];
+
+	for (NSString *sourceName in latenciesBySource) {
+		NSArray *latencies = [latenciesBySource[sourceName] sortedArrayUsingSelector: @selector(compare:)];
+
+		latencyResults[sourceName] = @{
+			@"count":	@(latencies.count),
+			@"p50":		latencies[MIN(latencies.count - 1, (NSUInteger)ceil(0.5 * latencies.count) - 1)],
+			@"p99":		latencies[MIN(latencies.count - 1, (NSUInteger)ceil(0.99 * latencies.count) - 1)],
+			@"max":		latencies.lastObject,
+		};
+	}
+
+	NSUInteger maximumBacklog = 0;
+	for (NSDictionary *sample in _backlogSamples)
+		maximumBacklog = MAX(maximumBacklog, [sample[@"total"] unsignedIntegerValue]);
+
+	NSDictionary *environment = NSProcessInfo.processInfo.environment;
+
+	return @{
+		@"format":			@(ULStressResultsFormatVersion),
+		@"date":			@(NSDate.date.timeIntervalSince1970),
+		@"label":			environment[@"ULDOCUMENT_BENCHMARK_LABEL"] ?: @"",
+		@"configuration":	ULBenchmarkConfigurationDescription(),
+		@"summary":			@{
+			@"documents":			@(_documents.count),
+			@"writes":				writeCountsBySource,
+			@"reverts":				@(_revertCount),
+			@"duplicateReverts":	@(_duplicateRevertCount),
+			@"supersededWrites":	@(supersededCount),
+			@"lostDocuments":		@(lostIndexes.count),
+			@"maximumBacklog":		@(maximumBacklog),
+		},
+		@"revertLatency":	latencyResults,
+		@"backlog":			_backlogSamples,
+	};
+}
+
+@end
@@ -24,23 +24,80 @@
 
 #import "ULDocument.h"
 #import "ULDocument_Subclassing.h"
+#import "ULDocumentTrace.h"
+#import "ULEditJournal.h"
+#import "ULStagingDirectoryPool.h"
 
 #import "NSDate+Utilities.h"
 #import "NSString+UniqueIdentifier.h"
 #import "NSURL+PathUtilities.h"
 #import "XCTestCase+TestExtensions.h"
 
+#import <objc/runtime.h>
+
 #define dispatch_async_on_global_queue(__block)			dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), (__block))
 #define break_undo_coalesing()		[NSRunLoop.currentRunLoop runUntilDate: [NSDate dateWithTimeIntervalSinceNow: 0.0001]];
 
 BOOL ULTestDocumentUsesConsistentPersistenceFormat		= YES;
 BOOL ULTestDocumentShouldHandleSubitemChanges			= NO;
+BOOL ULTestDocumentUsesContainerStorage					= NO;
+BOOL ULTestDocumentUsesEditJournal						= NO;
+BOOL ULTestDocumentSupportsHibernation					= NO;
+BOOL ULTestDocumentUsesHibernationCache					= NO;
+BOOL ULTestDocumentFingerprintsContentsWhenOpening		= NO;
+NSURL *ULTestDocumentEditJournalDirectoryURL			= nil;
 
 NSString *kTestText1	= @"Vivamus et turpis in dui blandit pulvinar nec dignissim diam.";
 NSString *kTestText2	= @"Cum sociis natoque penatibus et magnis dis parturient montes, nascetur ridiculus mus.";
 NSString *kTestText3	= @"Fusce tincidunt erat sit amet magna porttitor nec iaculis diam varius.";
 
 
+/*!
+ @abstract Counts coordinated reads and presenter registrations while ULTestCountsCoordinations is set.
+ */
+BOOL ULTestCountsCoordinations							= NO;
+volatile int32_t ULTestCoordinationCount				= 0;
+volatile int32_t ULTestPresenterRegistrationCount		= 0;
+
+@implementation NSFileCoordinator (ULTestCoordinationCounting)
+
++ (void)ul_installCoordinationCounting
+{
+	static dispatch_once_t onceToken;
+	dispatch_once(&onceToken, ^{
+		method_exchangeImplementations(class_getClassMethod(self, @selector(addFilePresenter:)), class_getClassMethod(self, @selector(ul_countingAddFilePresenter:)));
+		method_exchangeImplementations(class_getInstanceMethod(self, @selector(coordinateReadingItemAtURL:options:error:byAccessor:)), class_getInstanceMethod(self, @selector(ul_countingCoordinateReadingItemAtURL:options:error:byAccessor:)));
+		method_exchangeImplementations(class_getInstanceMethod(self, @selector(coordinateAccessWithIntents:queue:byAccessor:)), class_getInstanceMethod(self, @selector(ul_countingCoordinateAccessWithIntents:queue:byAccessor:)));
+	});
+}
+
++ (void)ul_countingAddFilePresenter:(id<NSFilePresenter>)presenter
+{
+	if (ULTestCountsCoordinations)
+		__sync_fetch_and_add(&ULTestPresenterRegistrationCount, 1);
+	
+	[self ul_countingAddFilePresenter: presenter];
+}
+
+- (void)ul_countingCoordinateReadingItemAtURL:(NSURL *)url options:(NSFileCoordinatorReadingOptions)options error:(NSError **)outError byAccessor:(void (^)(NSURL *newURL))reader
+{
+	if (ULTestCountsCoordinations)
+		__sync_fetch_and_add(&ULTestCoordinationCount, 1);
+	
+	[self ul_countingCoordinateReadingItemAtURL:url options:options error:outError byAccessor:reader];
+}
+
+- (void)ul_countingCoordinateAccessWithIntents:(NSArray *)intents queue:(NSOperationQueue *)queue byAccessor:(void (^)(NSError *error))accessor
+{
+	if (ULTestCountsCoordinations)
+		__sync_fetch_and_add(&ULTestCoordinationCount, 1);
+	
+	[self ul_countingCoordinateAccessWithIntents:intents queue:queue byAccessor:accessor];
+}
+
+@end
+
+
 @interface ULStubDocument : ULDocument
 @end
 
@@ -59,6 +116,7 @@ NSString *kTestText3	= @"Fusce tincidunt erat sit amet magna porttitor nec iacul
 @property(nonatomic, copy) NSString *text;
 
 @property(nonatomic, readwrite) NSUInteger writeCount;
+@property(nonatomic, readwrite) NSUInteger readCount;
 @property(nonatomic, readwrite) dispatch_semaphore_t afterWriteLock;
 
 @property(nonatomic, readwrite) NSString *recognizedFilenameChange;
@@ -96,7 +154,9 @@ NSString *kTestText3	= @"Fusce tincidunt erat sit amet magna porttitor nec iacul
 
 - (BOOL)readFromFileWrapper:(NSFileWrapper *)fileWrapper error:(NSError **)outError
 {
-	if (self.class.shouldHandleSubitemChanges) {
+	_readCount ++;
+	
+	if (self.class.shouldHandleSubitemChanges || self.class.usesContainerStorage) {
 		self.text = [[NSString alloc] initWithData:[fileWrapper.fileWrappers[@"content.txt"] regularFileContents] encoding:NSUTF8StringEncoding];
 		return YES;
 	}
@@ -109,12 +169,13 @@ NSString *kTestText3	= @"Fusce tincidunt erat sit amet magna porttitor nec iacul
 {
 	NSFileWrapper *wrapper = [[NSFileWrapper alloc] initRegularFileWithContents: [self.text dataUsingEncoding: NSUTF8StringEncoding]];
 	
-	if (self.class.shouldHandleSubitemChanges) {
+	if (self.class.shouldHandleSubitemChanges || self.class.usesContainerStorage) {
 		NSFileWrapper *secondaryWrapper = [[NSFileWrapper alloc] initRegularFileWithContents: [@"otherFile" dataUsingEncoding: NSUTF8StringEncoding]];
 		wrapper = [[NSFileWrapper alloc] initDirectoryWithFileWrappers:@{@"content.txt": wrapper, @"otherFile.txt": secondaryWrapper}];
 	}
 	
 	_writeCount ++;
+	[self markJournalRecordsAsSerialized];
 	
 	// Allows to inject changes immediately after writing
 	if (_afterWriteLock) {
@@ -130,6 +191,11 @@ NSString *kTestText3	= @"Fusce tincidunt erat sit amet magna porttitor nec iacul
 	return ULTestDocumentShouldHandleSubitemChanges;
 }
 
++ (BOOL)usesContainerStorage
+{
+	return ULTestDocumentUsesContainerStorage;
+}
+
 - (void)didChangeFileURLBySaving
 {
 	_recognizedFilenameChange = self.fileURL.lastPathComponent;
@@ -145,6 +211,46 @@ NSString *kTestText3	= @"Fusce tincidunt erat sit amet magna porttitor nec iacul
 	return ULTestDocumentUsesConsistentPersistenceFormat;
 }
 
++ (BOOL)usesEditJournal
+{
+	return ULTestDocumentUsesEditJournal;
+}
+
++ (BOOL)fingerprintsContentsWhenOpening
+{
+	return ULTestDocumentFingerprintsContentsWhenOpening;
+}
+
++ (NSURL *)editJournalDirectoryURL
+{
+	return ULTestDocumentEditJournalDirectoryURL;
+}
+
+- (BOOL)replayJournalRecord:(NSData *)record error:(NSError **)outError
+{
+	_text = [[NSString alloc] initWithData:record encoding:NSUTF8StringEncoding];
+	return YES;
+}
+
++ (BOOL)supportsHibernation
+{
+	return ULTestDocumentSupportsHibernation;
+}
+
+- (id)releaseContentsForHibernation
+{
+	NSData *cache = ULTestDocumentUsesHibernationCache ? [_text dataUsingEncoding: NSUTF8StringEncoding] : nil;
+	_text = nil;
+	
+	return cache;
+}
+
+- (BOOL)restoreContentsFromHibernationCache:(id)cache error:(NSError **)outError
+{
+	_text = [[NSString alloc] initWithData:cache encoding:NSUTF8StringEncoding];
+	return YES;
+}
+
 @end
 
 @interface ULDocumentTest : XCTestCase
@@ -159,6 +265,14 @@ NSString *kTestText3	= @"Fusce tincidunt erat sit amet magna porttitor nec iacul
 	// By default, test document uses a consistent persistence format
 	ULTestDocumentUsesConsistentPersistenceFormat = YES;
 	ULTestDocumentShouldHandleSubitemChanges = NO;
+	ULTestDocumentUsesContainerStorage = NO;
+	ULTestDocumentUsesEditJournal = NO;
+	ULTestDocumentSupportsHibernation = NO;
+	ULTestDocumentUsesHibernationCache = NO;
+	ULTestDocumentFingerprintsContentsWhenOpening = NO;
+	
+	[ULDocument setSiblingPrefetchCount: 0];
+	[ULDocument setReadAheadCacheLimit: 0];
 	
 	// Large delays while testing
 	[ULDocument setAutosaveDelay: 3000];
@@ -360,6 +474,178 @@ NSString *kTestText3	= @"Fusce tincidunt erat sit amet magna porttitor nec iacul
 	[NSNotificationCenter.defaultCenter removeObserver: handler];
 }
 
+- (void)testPostingStallNotificationsOnBlockedInteractions
+{
+	NSURL *url = [self createTestDocument];
+	
+	ULTestDocument *document = [[ULTestDocument alloc] initWithFileURL:url readOnly:NO];
+	XCTAssertNotNil(document, @"Document not created");
+	
+	// Setup observer
+	__block NSNotification *notification;
+	id handler = [NSNotificationCenter.defaultCenter addObserverForName:ULDocumentStalledInteractionNotification object:document queue:nil usingBlock:^(NSNotification *note) {
+		notification = note;
+	}];
+	
+	// Lock document access
+	__block BOOL isFileLocked = NO;
+	
+	dispatch_async_on_global_queue(^{
+		[[[NSFileCoordinator alloc] initWithFilePresenter: nil] coordinateWritingItemAtURL:url options:0 error:NULL byAccessor:^(NSURL * _Nonnull newURL) {
+			isFileLocked = YES;
+			[NSThread sleepForTimeInterval: 3];
+			isFileLocked = NO;
+		}];
+	});
+	
+	ULWaitOnAssertion(isFileLocked, @"Test precondition: No simulated deadlock.");
+	
+	// Perform blocked open
+	[ULDocument setMaximumDuration:1 forInteraction:ULDocumentInteractionOpen];
+	
+	__block BOOL didOpen = NO;
+	[document openWithCompletionHandler:^(BOOL success) {
+		didOpen = success;
+	}];
+	
+	ULWaitOnAssertion(notification, @"Awaiting stall notification");
+	[ULDocument setMaximumDuration:60 forInteraction:ULDocumentInteractionOpen];
+	
+	XCTAssertEqual(document, notification.object, @"Invalid object");
+	XCTAssertEqualObjects(notification.userInfo[ULDocumentStalledInteractionNotificationInteractionKey], @(ULDocumentInteractionOpen), @"Invalid interaction");
+	XCTAssertNotNil(notification.userInfo[ULDocumentStalledInteractionNotificationCoordinatorKey], @"Waiting coordinator should be reported");
+	XCTAssertGreaterThanOrEqual([notification.userInfo[ULDocumentStalledInteractionNotificationDurationKey] doubleValue], 1, @"Invalid duration");
+	XCTAssertGreaterThan([notification.userInfo[ULDocumentStalledInteractionNotificationCoordinationDurationKey] doubleValue], 0, @"Invalid coordination duration");
+	
+	// Stalled interaction should still complete
+	ULWaitOnAssertion(didOpen, @"Document should be opened after the simulated deadlock ended");
+	XCTAssertFalse(isFileLocked, @"Document should not be opened while locked");
+	
+	// Close document
+	[document close];
+	
+	[NSNotificationCenter.defaultCenter removeObserver: handler];
+}
+
+- (void)testInteractionPriorities
+{
+	NSURL *url = [self createTestDocument];
+	
+	ULTestDocument *document = [[ULTestDocument alloc] initWithFileURL:url readOnly:NO];
+	BOOL success = [self ul_performOperation:^(void (^handler)(BOOL)) {
+		[document openWithCompletionHandler: handler];
+	}];
+	XCTAssertTrue(success, @"Opening failed");
+	
+	[ULDocument resetWaitStatistics];
+	
+	// Lock document access, so interactions pile up
+	__block BOOL isFileLocked = NO;
+	
+	dispatch_async_on_global_queue(^{
+		[[[NSFileCoordinator alloc] initWithFilePresenter: nil] coordinateWritingItemAtURL:url options:0 error:NULL byAccessor:^(NSURL * _Nonnull newURL) {
+			isFileLocked = YES;
+			[NSThread sleepForTimeInterval: 2];
+			isFileLocked = NO;
+		}];
+	});
+	
+	ULWaitOnAssertion(isFileLocked, @"Test precondition: No simulated deadlock.");
+	
+	document.text = kTestText2;
+	break_undo_coalesing();
+	
+	NSMutableArray *completions = [NSMutableArray new];
+	void (^recordCompletion)(NSString *) = ^(NSString *name) {
+		@synchronized(completions) {
+			[completions addObject: name];
+		}
+	};
+	
+	[document autosaveWithCompletionHandler:^(BOOL success) { recordCompletion(@"blocked autosave"); }];
+	[document autosaveWithCompletionHandler:^(BOOL success) { recordCompletion(@"queued autosave"); }];
+	[document saveWithCompletionHandler:^(BOOL success) { recordCompletion(@"save"); }];
+	[document revertToContentsOfURL:url completionHandler:^(BOOL success) { recordCompletion(@"revert"); }];
+	
+	ULWaitOnAssertion(completions.count == 4, @"Interactions should complete");
+	
+	// The explicit save overtakes the queued autosave, while the revert waits for both
+	NSArray *expectedCompletions = @[@"blocked autosave", @"save", @"queued autosave", @"revert"];
+	XCTAssertEqualObjects(completions, expectedCompletions, @"Invalid interaction order");
+	XCTAssertFalse(document.hasUnsavedChanges, @"Changes should be saved");
+	
+	ULDocumentInteractionWaitStatistics userStatistics = [ULDocument waitStatisticsForInteractionPriority: ULDocumentInteractionPriorityUserInitiated];
+	ULDocumentInteractionWaitStatistics autosaveStatistics = [ULDocument waitStatisticsForInteractionPriority: ULDocumentInteractionPriorityAutosave];
+	ULDocumentInteractionWaitStatistics reconciliationStatistics = [ULDocument waitStatisticsForInteractionPriority: ULDocumentInteractionPriorityReconciliation];
+	
+	XCTAssertGreaterThanOrEqual(userStatistics.count, 1, @"User-initiated waits should be recorded");
+	XCTAssertGreaterThanOrEqual(autosaveStatistics.count, 2, @"Autosave waits should be recorded");
+	XCTAssertEqual(reconciliationStatistics.count, 1, @"Reconciliation waits should be recorded");
+	XCTAssertGreaterThan(reconciliationStatistics.maximumDuration, 0, @"Reverts should have waited for the blocked autosave");
+	
+	[document close];
+}
+
+- (void)testTracingInteractionPhases
+{
+	NSURL *url = [self createTestDocument];
+	
+	[ULDocumentTrace setEnabled: YES];
+	[ULDocumentTrace reset];
+	
+	ULTestDocument *document = [[ULTestDocument alloc] initWithFileURL:url readOnly:NO];
+	XCTAssertNotNil(document, @"Document not created");
+	
+	// Open, change and save document
+	BOOL success = [self ul_performOperation:^(void (^handler)(BOOL)) {
+		[document openWithCompletionHandler: handler];
+	}];
+	XCTAssertTrue(success, @"Opening failed");
+	
+	document.text = kTestText2;
+	
+	success = [self ul_performOperation:^(void (^handler)(BOOL)) {
+		[document saveWithCompletionHandler: handler];
+	}];
+	XCTAssertTrue(success, @"Saving failed");
+	
+	ULDocumentTraceSnapshot *snapshot = [ULDocumentTrace snapshot];
+	[ULDocumentTrace setEnabled: NO];
+	
+	// Each interaction and its phases should have been recorded
+	XCTAssertEqual([snapshot histogramForPhase:ULDocumentTracePhaseInteraction ofInteraction:ULDocumentInteractionOpen].count, 1, @"Open not traced");
+	XCTAssertEqual([snapshot histogramForPhase:ULDocumentTracePhaseInteraction ofInteraction:ULDocumentInteractionSave].count, 1, @"Save not traced");
+	XCTAssertEqual([snapshot histogramForPhase:ULDocumentTracePhaseCoordinationWait ofInteraction:ULDocumentInteractionSave].count, 1, @"Coordination wait not traced");
+	XCTAssertEqual([snapshot histogramForPhase:ULDocumentTracePhaseReading ofInteraction:ULDocumentInteractionOpen].count, 1, @"Reading not traced");
+	XCTAssertEqual([snapshot histogramForPhase:ULDocumentTracePhaseSerialization ofInteraction:ULDocumentInteractionSave].count, 1, @"Serialization not traced");
+	XCTAssertEqual([snapshot histogramForPhase:ULDocumentTracePhaseWriting ofInteraction:ULDocumentInteractionSave].count, 1, @"Writing not traced");
+	XCTAssertGreaterThan([snapshot histogramForPhase:ULDocumentTracePhaseChangeToken ofInteraction:ULDocumentInteractionSave].count, 0, @"Change token not traced");
+	
+	// Phases are part of their interaction
+	ULDocumentTraceHistogram *saveHistogram = [snapshot histogramForPhase:ULDocumentTracePhaseInteraction ofInteraction:ULDocumentInteractionSave];
+	ULDocumentTraceHistogram *writeHistogram = [snapshot histogramForPhase:ULDocumentTracePhaseWriting ofInteraction:ULDocumentInteractionSave];
+	XCTAssertGreaterThanOrEqual(saveHistogram.totalDuration, writeHistogram.totalDuration, @"Invalid durations");
+	XCTAssertGreaterThan([saveHistogram durationAtPercentile: 0.99], 0, @"Invalid percentile");
+	XCTAssertGreaterThanOrEqual(saveHistogram.maximumDuration, [saveHistogram durationAtPercentile: 0.99], @"Percentile exceeds maximum");
+	
+	// Events should be ordered and exportable
+	XCTAssertGreaterThanOrEqual(snapshot.events.count, 7, @"Missing events");
+	XCTAssertLessThanOrEqual([snapshot.events.firstObject startTime], [snapshot.events.lastObject startTime], @"Events not ordered");
+	
+	NSDictionary *chromeTrace = [NSJSONSerialization JSONObjectWithData:snapshot.chromeTraceEventData options:0 error:NULL];
+	XCTAssertEqual([chromeTrace[@"traceEvents"] count], snapshot.events.count, @"Invalid trace export");
+	
+	// Disabled tracing should not record
+	success = [self ul_performOperation:^(void (^handler)(BOOL)) {
+		[document revertToContentsOfURL:url completionHandler:handler];
+	}];
+	XCTAssertTrue(success, @"Reverting failed");
+	XCTAssertEqual([[ULDocumentTrace snapshot] histogramForPhase:ULDocumentTracePhaseInteraction ofInteraction:ULDocumentInteractionRevert].count, 0, @"Disabled tracing should not record");
+	
+	[document close];
+	[ULDocumentTrace reset];
+}
+
 - (void)testPostingErrorNotificationsOnSynchronousWrite
 {
 	NSURL *url = [self createTestDocument];
@@ -513,6 +799,200 @@ NSString *kTestText3	= @"Fusce tincidunt erat sit amet magna porttitor nec iacul
 	[document close];
 }
 
+- (void)testBatchMoving
+{
+	NSURL *directoryURL = self.ul_newTemporarySubdirectory;
+	NSMutableArray *documents = [NSMutableArray new];
+	NSMutableArray *oldURLs = [NSMutableArray new];
+	NSMutableArray *newURLs = [NSMutableArray new];
+	
+	for (NSUInteger index = 0; index < 5; index ++) {
+		NSURL *url = [directoryURL URLByAppendingPathComponent: [NSString stringWithFormat: @"old%lu.txt", index]];
+		[kTestText1 writeToURL:url atomically:NO encoding:NSUTF8StringEncoding error:NULL];
+		
+		ULTestDocument *document = [[ULTestDocument alloc] initWithFileURL:url readOnly:NO];
+		BOOL success = [self ul_performOperation:^(void (^handler)(BOOL)) {
+			[document openWithCompletionHandler: handler];
+		}];
+		XCTAssertTrue(success, @"Opening failed");
+		
+		[documents addObject: document];
+		[oldURLs addObject: url];
+		[newURLs addObject: [directoryURL URLByAppendingPathComponent: [NSString stringWithFormat: @"new%lu.txt", index]]];
+	}
+	
+	// Unsaved changes are kept while moving
+	ULTestDocument *changedDocument = documents.firstObject;
+	changedDocument.text = kTestText2;
+	break_undo_coalesing();
+	
+	static void *queueKey = &queueKey;
+	dispatch_queue_t completionQueue = dispatch_queue_create("com.soulmen.ulysses3.test.completion", DISPATCH_QUEUE_SERIAL);
+	dispatch_queue_set_specific(completionQueue, queueKey, queueKey, NULL);
+	__block BOOL calledOnQueue = NO;
+	
+	BOOL success = [self ul_performOperation:^(void (^handler)(BOOL)) {
+		[ULDocument moveDocuments:documents toURLs:newURLs completionQueue:completionQueue completionHandler:^(BOOL success) {
+			calledOnQueue = (dispatch_get_specific(queueKey) == queueKey);
+			handler(success);
+		}];
+	}];
+	XCTAssertTrue(success, @"Moving failed");
+	XCTAssertTrue(calledOnQueue, @"Completion handler should be called on the passed queue");
+	
+	[documents enumerateObjectsUsingBlock:^(ULTestDocument *document, NSUInteger index, BOOL *stop) {
+		ULAssertEqualFileURLs(document.fileURL, newURLs[index], @"File URL not updated");
+		XCTAssertFalse([oldURLs[index] checkResourceIsReachableAndReturnError: NULL], @"Old file should have been moved");
+		XCTAssertEqualObjects(document.recognizedFilenameChange, [newURLs[index] lastPathComponent], @"Should have notified new URL");
+		XCTAssertNil(document.recognizedMoveURL, @"Own moves should not be notified as external moves");
+	}];
+	
+	XCTAssertTrue(changedDocument.hasUnsavedChanges, @"Changes should be kept");
+	XCTAssertEqualObjects([NSString stringWithContentsOfURL:newURLs.firstObject encoding:NSUTF8StringEncoding error:NULL], kTestText1, @"Changes should not be written by moving");
+	
+	// Later saves write to the new URL
+	success = [self ul_performOperation:^(void (^handler)(BOOL)) {
+		[changedDocument autosaveWithCompletionHandler: handler];
+	}];
+	XCTAssertTrue(success, @"Saving failed");
+	XCTAssertEqualObjects([NSString stringWithContentsOfURL:newURLs.firstObject encoding:NSUTF8StringEncoding error:NULL], kTestText2, @"Persistence mismatch");
+	
+	for (ULTestDocument *document in documents)
+		[document close];
+}
+
+- (void)testCompletionQueues
+{
+	static void *queueKey = &queueKey;
+	dispatch_queue_t completionQueue = dispatch_queue_create("com.soulmen.ulysses3.test.completion", DISPATCH_QUEUE_SERIAL);
+	dispatch_queue_set_specific(completionQueue, queueKey, queueKey, NULL);
+	
+	// Completion handlers are called on the passed queue
+	ULTestDocument *document = [[ULTestDocument alloc] initWithFileURL:[self createTestDocument] readOnly:NO];
+	__block BOOL calledOnQueue = NO;
+	
+	BOOL success = [self ul_performOperation:^(void (^handler)(BOOL)) {
+		[document openWithCompletionQueue:completionQueue completionHandler:^(BOOL success) {
+			calledOnQueue = (dispatch_get_specific(queueKey) == queueKey);
+			handler(success);
+		}];
+	}];
+	XCTAssertTrue(success, @"Opening failed");
+	XCTAssertTrue(calledOnQueue, @"Completion handler should be called on the passed queue");
+	
+	document.text = kTestText2;
+	break_undo_coalesing();
+	
+	success = [self ul_performOperation:^(void (^handler)(BOOL)) {
+		[document saveToURL:document.fileURL forSaveOperation:ULDocumentSave completionQueue:completionQueue completionHandler:^(BOOL success) {
+			calledOnQueue = (dispatch_get_specific(queueKey) == queueKey);
+			handler(success);
+		}];
+	}];
+	XCTAssertTrue(success, @"Saving failed");
+	XCTAssertTrue(calledOnQueue, @"Completion handler should be called on the passed queue");
+	
+	calledOnQueue = NO;
+	document.text = kTestText1;
+	break_undo_coalesing();
+	
+	success = [self ul_performOperation:^(void (^handler)(BOOL)) {
+		[document saveWithCompletionQueue:completionQueue completionHandler:^(BOOL success) {
+			calledOnQueue = (dispatch_get_specific(queueKey) == queueKey);
+			handler(success);
+		}];
+	}];
+	XCTAssertTrue(success, @"Saving failed");
+	XCTAssertTrue(calledOnQueue, @"Completion handler should be called on the passed queue");
+	
+	calledOnQueue = NO;
+	
+	id snapshot = [self ul_performOperationWithObjectHandler:^(void (^handler)(id)) {
+		[document makeReadOnlySnapshotWithCompletionQueue:completionQueue completionHandler:^(id snapshot) {
+			calledOnQueue = (dispatch_get_specific(queueKey) == queueKey);
+			handler(snapshot);
+		}];
+	}];
+	XCTAssertNotNil(snapshot, @"Snapshot failed");
+	XCTAssertTrue(calledOnQueue, @"Completion handler should be called on the passed queue");
+	[snapshot close];
+	
+	calledOnQueue = NO;
+	
+	[self ul_performOperation:^(void (^handler)(BOOL)) {
+		[document hibernateWithCompletionQueue:completionQueue completionHandler:^(BOOL success) {
+			calledOnQueue = (dispatch_get_specific(queueKey) == queueKey);
+			handler(success);
+		}];
+	}];
+	XCTAssertTrue(calledOnQueue, @"Completion handler should be called on the passed queue");
+	
+	// Without queue, completion handlers are called before the next interaction starts
+	__block BOOL nextInteractionStarted = NO;
+	__block BOOL calledBeforeNextInteraction = NO;
+	
+	success = [self ul_performOperation:^(void (^handler)(BOOL)) {
+		[document closeWithCompletionQueue:nil completionHandler:^(BOOL success) {
+			calledBeforeNextInteraction = !nextInteractionStarted;
+			handler(success);
+		}];
+		[document makeReadOnlySnapshotWithCompletionHandler:^(id snapshot) {
+			nextInteractionStarted = YES;
+		}];
+	}];
+	XCTAssertTrue(success, @"Closing failed");
+	XCTAssertTrue(calledBeforeNextInteraction, @"Completion handler should be called on the interaction queue");
+	XCTAssertFalse(document.documentIsOpen, @"Document should be closed");
+	
+	
+	// Batches call a single completion handler
+	NSMutableArray *documents = [NSMutableArray new];
+	
+	for (NSUInteger index = 0; index < 20; index ++)
+		[documents addObject: [[ULTestDocument alloc] initWithFileURL:[self createTestDocument] readOnly:NO]];
+	
+	ULTestDocument *missingDocument = [[ULTestDocument alloc] initWithFileURL:[self.ul_newTemporarySubdirectory URLByAppendingPathComponent: @"missing.txt"] readOnly:NO];
+	[documents addObject: missingDocument];
+	
+	__block NSUInteger callCount = 0;
+	
+	NSArray *failedDocuments = [self ul_performOperationWithObjectHandler:^(void (^handler)(id)) {
+		[ULDocument openDocuments:documents completionQueue:completionQueue completionHandler:^(NSArray *failedDocuments) {
+			callCount ++;
+			calledOnQueue = (dispatch_get_specific(queueKey) == queueKey);
+			handler(failedDocuments);
+		}];
+	}];
+	XCTAssertEqualObjects(failedDocuments, @[missingDocument], @"Only the missing document should fail");
+	XCTAssertTrue(calledOnQueue, @"Completion handler should be called on the passed queue");
+	
+	for (ULTestDocument *document in documents)
+		XCTAssertTrue(document.documentIsOpen == (document != missingDocument), @"Only existing documents should be open");
+	
+	[documents removeObject: missingDocument];
+	[documents.firstObject setText: kTestText3];
+	break_undo_coalesing();
+	
+	failedDocuments = [self ul_performOperationWithObjectHandler:^(void (^handler)(id)) {
+		[ULDocument closeDocuments:documents completionQueue:nil completionHandler:^(NSArray *failedDocuments) {
+			callCount ++;
+			handler(failedDocuments);
+		}];
+	}];
+	XCTAssertEqual(failedDocuments.count, (NSUInteger)0, @"Closing failed");
+	XCTAssertEqual(callCount, (NSUInteger)2, @"Each batch should call its completion handler once");
+	XCTAssertEqualObjects([NSString stringWithContentsOfURL:[documents.firstObject fileURL] encoding:NSUTF8StringEncoding error:NULL], kTestText3, @"Changes should be saved by closing");
+	
+	for (ULTestDocument *document in documents)
+		XCTAssertFalse(document.documentIsOpen, @"Documents should be closed");
+	
+	// Empty batches complete as well
+	failedDocuments = [self ul_performOperationWithObjectHandler:^(void (^handler)(id)) {
+		[ULDocument autosaveDocuments:@[] completionQueue:completionQueue completionHandler:handler];
+	}];
+	XCTAssertEqual(failedDocuments.count, (NSUInteger)0, @"Empty batch should succeed");
+}
+
 - (void)testChangeTracking
 {
 	NSURL *url = [self createTestDocument];
@@ -875,10 +1355,264 @@ NSString *kTestText3	= @"Fusce tincidunt erat sit amet magna porttitor nec iacul
 	XCTAssertEqual(document.writeCount, 0, @"No write should have been triggered");
 }
 
-- (void)testAutomaticSaving
+- (void)testFlushAllDocuments
 {
-	// Short autosave delay for this test
-	[ULDocument setAutosaveDelay: 0.1];
+	NSMutableArray *documents = [NSMutableArray new];
+	
+	// Open and change documents
+	for (NSUInteger index = 0; index < 3; index ++) {
+		ULTestDocument *document = [[ULTestDocument alloc] initWithFileURL:[self createTestDocument] readOnly:NO];
+		BOOL success = [self ul_performOperation:^(void (^handler)(BOOL)) {
+			[document openWithCompletionHandler: handler];
+		}];
+		XCTAssertTrue(success, @"Opening failed");
+		
+		document.text = kTestText2;
+		break_undo_coalesing();
+		
+		[documents addObject: document];
+	}
+	
+	// An expired deadline does not start any saves
+	ULWaitOnAssertion([[ULTestDocument flushAllDocumentsWithDeadline: NSDate.distantPast].unfinishedDocuments containsObject: documents.lastObject], @"Document should be pending autosave");
+	
+	for (ULTestDocument *document in documents) {
+		XCTAssertTrue(document.hasUnsavedChanges, @"Invalid change state");
+		XCTAssertEqual(document.writeCount, 0, @"No write should have been triggered");
+	}
+	
+	// Flush all documents
+	ULDocumentFlushReport *report = [ULTestDocument flushAllDocumentsWithDeadline: [NSDate dateWithTimeIntervalSinceNow: 30]];
+	
+	for (ULTestDocument *document in documents) {
+		XCTAssertTrue([report.savedDocuments containsObject: document], @"Document should be reported as saved");
+		XCTAssertFalse([report.unfinishedDocuments containsObject: document], @"Document should not be reported as unfinished");
+		XCTAssertFalse(document.hasUnsavedChanges, @"Invalid change state");
+		XCTAssertEqual(document.writeCount, 1, @"Write should have been triggered");
+		XCTAssertEqualObjects([NSString stringWithContentsOfURL:document.fileURL usedEncoding:NULL error:NULL], kTestText2, @"Persistence mismatch");
+	}
+	
+	// Saved documents are not flushed again
+	ULWaitOnAssertion(![[ULTestDocument flushAllDocumentsWithDeadline: NSDate.distantPast].unfinishedDocuments containsObject: documents.lastObject], @"Document should not be pending autosave");
+	
+	for (ULTestDocument *document in documents)
+		[document close];
+}
+
+- (void)testSkippingUnchangedSave
+{
+	ULTestDocumentFingerprintsContentsWhenOpening = YES;
+	
+	NSURL *url = [self createTestDocument];
+	
+	// Open document
+	ULTestDocument *document = [[ULTestDocument alloc] initWithFileURL:url readOnly:NO];
+	BOOL success = [self ul_performOperation:^(void (^handler)(BOOL)) {
+		[document openWithCompletionHandler: handler];
+	}];
+	XCTAssertTrue(success, @"Opening failed");
+	
+	id persistedToken = [ULTestDocument changeTokenForItemAtURL: url];
+	
+	
+	// Change text and restore it without undo
+	document.text = kTestText2;
+	break_undo_coalesing();
+	document.text = kTestText1;
+	break_undo_coalesing();
+	
+	XCTAssertTrue(document.hasUnsavedChanges, @"Invalid change state");
+	
+	success = [self ul_performOperation:^(void (^handler)(BOOL)) {
+		[document autosaveWithCompletionHandler: handler];
+	}];
+	XCTAssertTrue(success, @"Saving failed");
+	
+	// File should not have been written
+	XCTAssertFalse(document.hasUnsavedChanges, @"Invalid change state");
+	XCTAssertEqualObjects([ULTestDocument changeTokenForItemAtURL: url], persistedToken, @"File should not be written");
+	XCTAssertEqualObjects(document.changeToken, persistedToken, @"Change token should represent the persisted state");
+	
+	
+	// Actual changes are still written
+	document.text = kTestText2;
+	break_undo_coalesing();
+	
+	success = [self ul_performOperation:^(void (^handler)(BOOL)) {
+		[document autosaveWithCompletionHandler: handler];
+	}];
+	XCTAssertTrue(success, @"Saving failed");
+	
+	XCTAssertEqualObjects([NSString stringWithContentsOfURL:url usedEncoding:NULL error:NULL], kTestText2, @"Persistence mismatch");
+	XCTAssertNotEqualObjects([ULTestDocument changeTokenForItemAtURL: url], persistedToken, @"File should be written");
+	
+	[document close];
+}
+
+- (void)testSkippingUnchangedSaveAfterFirstSave
+{
+	NSURL *url = [self createTestDocument];
+	
+	ULTestDocument *document = [[ULTestDocument alloc] initWithFileURL:url readOnly:NO];
+	BOOL success = [self ul_performOperation:^(void (^handler)(BOOL)) {
+		[document openWithCompletionHandler: handler];
+	}];
+	XCTAssertTrue(success, @"Opening failed");
+	
+	// Contents are not fingerprinted when opening, so the first save is written
+	document.text = kTestText2;
+	break_undo_coalesing();
+	
+	success = [self ul_performOperation:^(void (^handler)(BOOL)) {
+		[document autosaveWithCompletionHandler: handler];
+	}];
+	XCTAssertTrue(success, @"Saving failed");
+	
+	id persistedToken = [ULTestDocument changeTokenForItemAtURL: url];
+	
+	
+	// Saves following the first one are skipped if nothing changed
+	document.text = kTestText1;
+	break_undo_coalesing();
+	document.text = kTestText2;
+	break_undo_coalesing();
+	
+	success = [self ul_performOperation:^(void (^handler)(BOOL)) {
+		[document autosaveWithCompletionHandler: handler];
+	}];
+	XCTAssertTrue(success, @"Saving failed");
+	
+	XCTAssertFalse(document.hasUnsavedChanges, @"Invalid change state");
+	XCTAssertEqualObjects([ULTestDocument changeTokenForItemAtURL: url], persistedToken, @"File should not be written");
+	
+	[document close];
+}
+
+- (void)testEditJournalRecovery
+{
+	ULTestDocumentUsesEditJournal = YES;
+	ULTestDocumentEditJournalDirectoryURL = self.ul_newTemporarySubdirectory;
+	
+	NSURL *url = [self createTestDocument];
+	
+	// Open document and journal a change
+	ULTestDocument *document = [[ULTestDocument alloc] initWithFileURL:url readOnly:NO];
+	BOOL success = [self ul_performOperation:^(void (^handler)(BOOL)) {
+		[document openWithCompletionHandler: handler];
+	}];
+	XCTAssertTrue(success, @"Opening failed");
+	
+	document.text = kTestText2;
+	[document appendJournalRecord: [kTestText2 dataUsingEncoding: NSUTF8StringEncoding]];
+	
+	ULWaitOnAssertion([NSFileManager.defaultManager contentsOfDirectoryAtURL:ULTestDocumentEditJournalDirectoryURL includingPropertiesForKeys:nil options:0 error:NULL].count == 1, @"Journal should be written");
+	
+	
+	// Simulate a crash by opening the document again without saving it
+	ULTestDocument *recoveredDocument = [[ULTestDocument alloc] initWithFileURL:url readOnly:NO];
+	success = [self ul_performOperation:^(void (^handler)(BOOL)) {
+		[recoveredDocument openWithCompletionHandler: handler];
+	}];
+	XCTAssertTrue(success, @"Opening failed");
+	
+	XCTAssertEqualObjects(recoveredDocument.text, kTestText2, @"Journaled change should be replayed");
+	XCTAssertTrue(recoveredDocument.hasUnsavedChanges, @"Replayed changes should be unsaved");
+	XCTAssertEqualObjects([NSString stringWithContentsOfURL:url usedEncoding:NULL error:NULL], kTestText1, @"Persistence mismatch");
+	
+	
+	// Saving removes the journal
+	success = [self ul_performOperation:^(void (^handler)(BOOL)) {
+		[recoveredDocument saveWithCompletionHandler: handler];
+	}];
+	XCTAssertTrue(success, @"Saving failed");
+	
+	XCTAssertEqualObjects([NSString stringWithContentsOfURL:url usedEncoding:NULL error:NULL], kTestText2, @"Persistence mismatch");
+	XCTAssertEqual([NSFileManager.defaultManager contentsOfDirectoryAtURL:ULTestDocumentEditJournalDirectoryURL includingPropertiesForKeys:nil options:0 error:NULL].count, 0, @"Journal should be removed after saving");
+	
+	[document close];
+	[recoveredDocument close];
+}
+
+- (void)testEditJournalIsDiscardedByRevert
+{
+	ULTestDocumentUsesEditJournal = YES;
+	ULTestDocumentEditJournalDirectoryURL = self.ul_newTemporarySubdirectory;
+	
+	NSURL *url = [self createTestDocument];
+	
+	ULTestDocument *document = [[ULTestDocument alloc] initWithFileURL:url readOnly:NO];
+	BOOL success = [self ul_performOperation:^(void (^handler)(BOOL)) {
+		[document openWithCompletionHandler: handler];
+	}];
+	XCTAssertTrue(success, @"Opening failed");
+	
+	document.text = kTestText2;
+	[document appendJournalRecord: [kTestText2 dataUsingEncoding: NSUTF8StringEncoding]];
+	
+	ULWaitOnAssertion([NSFileManager.defaultManager contentsOfDirectoryAtURL:ULTestDocumentEditJournalDirectoryURL includingPropertiesForKeys:nil options:0 error:NULL].count == 1, @"Journal should be written");
+	
+	// Reverting to the unchanged file drops the journaled change
+	success = [self ul_performOperation:^(void (^handler)(BOOL)) {
+		[document revertToContentsOfURL:url completionHandler:handler];
+	}];
+	XCTAssertTrue(success, @"Reverting failed");
+	
+	XCTAssertEqualObjects(document.text, kTestText1, @"Journaled change should not be replayed");
+	XCTAssertFalse(document.hasUnsavedChanges, @"Reverted document should be clean");
+	XCTAssertEqual([NSFileManager.defaultManager contentsOfDirectoryAtURL:ULTestDocumentEditJournalDirectoryURL includingPropertiesForKeys:nil options:0 error:NULL].count, (NSUInteger)0, @"Journal should be removed by reverting");
+	
+	[document close];
+}
+
+- (void)testEditJournalKeepsChangesDuringSave
+{
+	ULTestDocumentUsesEditJournal = YES;
+	ULTestDocumentEditJournalDirectoryURL = self.ul_newTemporarySubdirectory;
+	
+	NSURL *url = [self createTestDocument];
+	
+	ULTestDocument *document = [[ULTestDocument alloc] initWithFileURL:url readOnly:NO];
+	BOOL success = [self ul_performOperation:^(void (^handler)(BOOL)) {
+		[document openWithCompletionHandler: handler];
+	}];
+	XCTAssertTrue(success, @"Opening failed");
+	
+	document.text = kTestText2;
+	[document appendJournalRecord: [kTestText2 dataUsingEncoding: NSUTF8StringEncoding]];
+	
+	// Journal a change after the contents have been serialized
+	document.afterWriteLock = dispatch_semaphore_create(1);
+	dispatch_semaphore_wait(document.afterWriteLock, DISPATCH_TIME_NOW);
+	
+	__block BOOL saveFinished = NO;
+	dispatch_async_on_global_queue(^{
+		[document saveToURL:document.fileURL forSaveOperation:ULDocumentSave error:NULL];
+		saveFinished = YES;
+	});
+	
+	ULWaitOnAssertion(document.writeCount > 0, @"Test precondition failed: Write never occured.");
+	
+	document.text = kTestText1;
+	[document appendJournalRecord: [kTestText1 dataUsingEncoding: NSUTF8StringEncoding]];
+	
+	dispatch_semaphore_signal(document.afterWriteLock);
+	ULWaitOnAssertion(saveFinished, @"Save should finish");
+	
+	XCTAssertEqualObjects([NSString stringWithContentsOfURL:url usedEncoding:NULL error:NULL], kTestText2, @"Persistence mismatch");
+	
+	// Only the change made after serialization is replayed
+	NSString *baseToken;
+	NSArray *records = [[[ULEditJournal alloc] initWithURL: [ULEditJournal journalURLForItemAtURL:url inDirectory:ULTestDocumentEditJournalDirectoryURL]] readRecordsWithBaseToken: &baseToken];
+	XCTAssertEqual(records.count, (NSUInteger)1, @"Only unsaved changes should remain journaled");
+	XCTAssertEqualObjects(records.firstObject, [kTestText1 dataUsingEncoding: NSUTF8StringEncoding], @"Unsaved change should remain journaled");
+	
+	[document close];
+}
+
+- (void)testAutomaticSaving
+{
+	// Short autosave delay for this test
+	[ULDocument setAutosaveDelay: 0.1];
 	
 	NSURL *url = [self createTestDocument];
 	
@@ -1397,6 +2131,99 @@ NSString *kTestText3	= @"Fusce tincidunt erat sit amet magna porttitor nec iacul
 	XCTAssertFalse(document2.hasUnsavedChanges, @"Change state not cleared");
 }
 
+- (void)testPresenterRelocationCoordinations
+{
+	[NSFileCoordinator ul_installCoordinationCounting];
+	NSFileCoordinator *mover = [[NSFileCoordinator alloc] initWithFilePresenter: nil];
+	
+	void (^moveItems)(NSArray *, NSArray *) = ^(NSArray *oldURLs, NSArray *newURLs) {
+		[oldURLs enumerateObjectsUsingBlock:^(NSURL *oldURL, NSUInteger index, BOOL *stop) {
+			[mover coordinateWritingItemAtURL:oldURL options:NSFileCoordinatorWritingForMoving writingItemAtURL:newURLs[index] options:0 error:NULL byAccessor:^(NSURL *currentURL, NSURL *newURL) {
+				[NSFileManager.defaultManager moveItemAtURL:currentURL toURL:newURL error:NULL];
+				[mover itemAtURL:currentURL didMoveToURL:newURL];
+			}];
+		}];
+	};
+	
+	NSArray *(^openDocuments)(NSArray *) = ^(NSArray *urls) {
+		NSMutableArray *documents = [NSMutableArray new];
+		
+		for (NSURL *url in urls) {
+			ULTestDocument *document = [[ULTestDocument alloc] initWithFileURL:url readOnly:NO];
+			document.text = kTestText1;
+			
+			BOOL success = [self ul_performOperation:^(void (^handler)(BOOL)) {
+				[document saveToURL:url forSaveOperation:ULDocumentSave completionHandler:handler];
+			}];
+			XCTAssertTrue(success, @"Saving failed");
+			
+			[documents addObject: document];
+		}
+		
+		return documents;
+	};
+	
+	NSUInteger moveCount = 3;
+	NSURL *directoryURL = self.ul_newTemporarySubdirectory;
+	NSMutableArray *flatURLs = [NSMutableArray new], *movedFlatURLs = [NSMutableArray new], *packageURLs = [NSMutableArray new], *movedPackageURLs = [NSMutableArray new];
+	
+	for (NSUInteger index = 0; index < moveCount; index ++) {
+		[flatURLs addObject: [directoryURL URLByAppendingPathComponent: [NSString stringWithFormat: @"flat%lu.txt", index]]];
+		[movedFlatURLs addObject: [directoryURL URLByAppendingPathComponent: [NSString stringWithFormat: @"movedFlat%lu.txt", index]]];
+		[packageURLs addObject: [directoryURL URLByAppendingPathComponent: [NSString stringWithFormat: @"package%lu.package", index]]];
+		[movedPackageURLs addObject: [directoryURL URLByAppendingPathComponent: [NSString stringWithFormat: @"movedPackage%lu.package", index]]];
+	}
+	
+	
+	// Presenters of flat files are relocated without any coordination
+	NSArray *flatDocuments = openDocuments(flatURLs);
+	
+	ULTestCoordinationCount = ULTestPresenterRegistrationCount = 0;
+	ULTestCountsCoordinations = YES;
+	moveItems(flatURLs, movedFlatURLs);
+	
+	[flatDocuments enumerateObjectsUsingBlock:^(ULTestDocument *document, NSUInteger index, BOOL *stop) {
+		ULWaitOnAssertion([document.fileURL ul_isEqualToFileURL: movedFlatURLs[index]], @"Move not noticed");
+	}];
+	[NSRunLoop.currentRunLoop runUntilDate: [NSDate dateWithTimeIntervalSinceNow: 0.5]];
+	ULTestCountsCoordinations = NO;
+	
+	XCTAssertEqual(ULTestCoordinationCount, 0, @"Moving flat files should not coordinate");
+	XCTAssertEqual(ULTestPresenterRegistrationCount, 0, @"Moving flat files should not re-register presenters");
+	
+	
+	// Presenters of packages are re-registered in batches
+	ULTestDocumentShouldHandleSubitemChanges = YES;
+	NSArray *packageDocuments = openDocuments(packageURLs);
+	
+	ULTestCoordinationCount = ULTestPresenterRegistrationCount = 0;
+	ULTestCountsCoordinations = YES;
+	moveItems(packageURLs, movedPackageURLs);
+	
+	[packageDocuments enumerateObjectsUsingBlock:^(ULTestDocument *document, NSUInteger index, BOOL *stop) {
+		ULWaitOnAssertion([document.fileURL ul_isEqualToFileURL: movedPackageURLs[index]], @"Move not noticed");
+	}];
+	ULWaitOnAssertion(ULTestPresenterRegistrationCount == moveCount, @"Package presenters should be re-registered");
+	[NSRunLoop.currentRunLoop runUntilDate: [NSDate dateWithTimeIntervalSinceNow: 0.5]];
+	ULTestCountsCoordinations = NO;
+	
+	XCTAssertEqual((NSUInteger)ULTestPresenterRegistrationCount, moveCount, @"Each package presenter should be re-registered once");
+	XCTAssertLessThanOrEqual((NSUInteger)ULTestCoordinationCount, moveCount, @"Re-registrations should be coordinated in batches");
+	
+	// Subitem changes are still notified after moving
+	ULTestDocument *packageDocument = packageDocuments.firstObject;
+	NSURL *contentURL = [movedPackageURLs.firstObject URLByAppendingPathComponent: @"content.txt"];
+	
+	[mover coordinateWritingItemAtURL:contentURL options:0 error:NULL byAccessor:^(NSURL *newURL) {
+		[kTestText2 writeToURL:newURL atomically:YES encoding:NSUTF8StringEncoding error:NULL];
+	}];
+	
+	ULWaitOnEqualObjects(packageDocument.text, kTestText2);
+	
+	for (ULTestDocument *document in [flatDocuments arrayByAddingObjectsFromArray: packageDocuments])
+		[document close];
+}
+
 - (void)testUpdatesOnPackageItemChanges
 {
 	ULTestDocumentShouldHandleSubitemChanges = YES;
@@ -1441,6 +2268,284 @@ NSString *kTestText3	= @"Fusce tincidunt erat sit amet magna porttitor nec iacul
 	ULWaitOnEqualObjects(packageDocument.text, kTestText2);
 }
 
+- (void)testContainerStorage
+{
+	ULTestDocumentUsesContainerStorage = YES;
+	
+	// Create package directory
+	NSURL *url = [self.ul_newTemporarySubdirectory URLByAppendingPathComponent: @"test.package"];
+	NSFileWrapper *packageWrapper = [[NSFileWrapper alloc] initDirectoryWithFileWrappers: @{
+		@"content.txt": [[NSFileWrapper alloc] initRegularFileWithContents: [kTestText1 dataUsingEncoding: NSUTF8StringEncoding]],
+		@"otherFile.txt": [[NSFileWrapper alloc] initRegularFileWithContents: [@"otherFile" dataUsingEncoding: NSUTF8StringEncoding]]
+	}];
+	XCTAssertTrue([packageWrapper writeToURL:url options:0 originalContentsURL:nil error:NULL], @"Cannot create package");
+	
+	ULTestDocument *document = [[ULTestDocument alloc] initWithFileURL:url readOnly:NO];
+	BOOL success = [self ul_performOperation:^(void (^handler)(BOOL)) {
+		[document openWithCompletionHandler: handler];
+	}];
+	XCTAssertTrue(success, @"Opening failed");
+	XCTAssertEqualObjects(document.text, kTestText1, @"Package directory should be readable");
+	
+	
+	// Saving converts the package directory to a container
+	document.text = kTestText2;
+	break_undo_coalesing();
+	
+	success = [self ul_performOperation:^(void (^handler)(BOOL)) {
+		[document saveWithCompletionHandler: handler];
+	}];
+	XCTAssertTrue(success, @"Saving failed");
+	
+	NSNumber *isRegularFile;
+	[url getResourceValue:&isRegularFile forKey:NSURLIsRegularFileKey error:NULL];
+	XCTAssertTrue(isRegularFile.boolValue, @"Package should be stored as container");
+	
+	NSUInteger containerLength = [NSData dataWithContentsOfURL: url].length;
+	id containerToken = document.changeToken;
+	
+	
+	// Further saves append the changed file
+	document.text = kTestText3;
+	break_undo_coalesing();
+	
+	success = [self ul_performOperation:^(void (^handler)(BOOL)) {
+		[document saveWithCompletionHandler: handler];
+	}];
+	XCTAssertTrue(success, @"Saving failed");
+	
+	XCTAssertGreaterThan([NSData dataWithContentsOfURL: url].length, containerLength, @"Changes should be appended");
+	XCTAssertNotEqualObjects([ULTestDocument changeTokenForItemAtURL: url], containerToken, @"Change token should change with each save");
+	XCTAssertEqualObjects(document.changeToken, [ULTestDocument changeTokenForItemAtURL: url], @"Change token should represent the persisted state");
+	
+	[document close];
+	
+	
+	// Container is read through the file wrapper contract
+	ULTestDocument *reopenedDocument = [[ULTestDocument alloc] initWithFileURL:url readOnly:NO];
+	success = [self ul_performOperation:^(void (^handler)(BOOL)) {
+		[reopenedDocument openWithCompletionHandler: handler];
+	}];
+	XCTAssertTrue(success, @"Opening failed");
+	XCTAssertEqualObjects(reopenedDocument.text, kTestText3, @"Persistence mismatch");
+	
+	[reopenedDocument close];
+	
+	
+	// Entries of a save that did not reach the disk fall back to the previous save
+	NSMutableData *containerData = [NSMutableData dataWithContentsOfURL: url];
+	((uint8_t *)containerData.mutableBytes)[containerLength] ^= 0xFF;
+	XCTAssertTrue([containerData writeToURL:url atomically:NO], @"Cannot damage container");
+	
+	ULTestDocument *recoveredDocument = [[ULTestDocument alloc] initWithFileURL:url readOnly:NO];
+	success = [self ul_performOperation:^(void (^handler)(BOOL)) {
+		[recoveredDocument openWithCompletionHandler: handler];
+	}];
+	XCTAssertTrue(success, @"Opening failed");
+	XCTAssertEqualObjects(recoveredDocument.text, kTestText2, @"Previous save should be read");
+	
+	[recoveredDocument close];
+}
+
+- (void)testHibernation
+{
+	ULTestDocumentSupportsHibernation = YES;
+	NSURL *url = [self createTestDocument];
+	
+	ULTestDocument *document = [[ULTestDocument alloc] initWithFileURL:url readOnly:NO];
+	BOOL success = [self ul_performOperation:^(void (^handler)(BOOL)) {
+		[document openWithCompletionHandler: handler];
+	}];
+	XCTAssertTrue(success, @"Opening failed");
+	
+	
+	// Clean documents release their contents
+	success = [self ul_performOperation:^(void (^handler)(BOOL)) {
+		[document hibernateWithCompletionHandler: handler];
+	}];
+	XCTAssertTrue(success, @"Hibernation failed");
+	XCTAssertTrue(document.isHibernating, @"Document should hibernate");
+	XCTAssertNil(document.text, @"Contents should be released");
+	
+	
+	// Accessing the contents reloads them from disk
+	NSUInteger readCount = document.readCount;
+	
+	XCTAssertTrue([document beginContentAccess], @"Waking up failed");
+	XCTAssertFalse(document.isHibernating, @"Document should be awake");
+	XCTAssertEqualObjects(document.text, kTestText1, @"Contents should be reloaded");
+	XCTAssertEqual(document.readCount, readCount + 1, @"Contents should be read");
+	
+	
+	// Documents do not hibernate while being accessed or with unsaved changes
+	success = [self ul_performOperation:^(void (^handler)(BOOL)) {
+		[document hibernateWithCompletionHandler: handler];
+	}];
+	XCTAssertFalse(success, @"Document should not hibernate while being accessed");
+	
+	document.text = kTestText2;
+	break_undo_coalesing();
+	[document endContentAccess];
+	
+	success = [self ul_performOperation:^(void (^handler)(BOOL)) {
+		[document hibernateWithCompletionHandler: handler];
+	}];
+	XCTAssertFalse(success, @"Document with unsaved changes should not hibernate");
+	XCTAssertEqualObjects(document.text, kTestText2, @"Unsaved changes should be kept");
+	
+	success = [self ul_performOperation:^(void (^handler)(BOOL)) {
+		[document saveWithCompletionHandler: handler];
+	}];
+	XCTAssertTrue(success, @"Saving failed");
+	
+	
+	// A cached form is restored without reading, if the file did not change
+	ULTestDocumentUsesHibernationCache = YES;
+	
+	success = [self ul_performOperation:^(void (^handler)(BOOL)) {
+		[document hibernateWithCompletionHandler: handler];
+	}];
+	XCTAssertTrue(success, @"Hibernation failed");
+	
+	readCount = document.readCount;
+	
+	// Asynchronous accesses wake up the document without blocking
+	success = [self ul_performOperation:^(void (^handler)(BOOL)) {
+		[document beginContentAccessWithCompletionHandler: handler];
+	}];
+	XCTAssertTrue(success, @"Waking up failed");
+	XCTAssertEqualObjects(document.text, kTestText2, @"Contents should be restored");
+	XCTAssertEqual(document.readCount, readCount, @"Cached contents should not be read");
+	[document endContentAccess];
+	
+	
+	// External changes while hibernating invalidate the cached form
+	success = [self ul_performOperation:^(void (^handler)(BOOL)) {
+		[document hibernateWithCompletionHandler: handler];
+	}];
+	XCTAssertTrue(success, @"Hibernation failed");
+	
+	[[[NSFileCoordinator alloc] initWithFilePresenter:nil] coordinateWritingItemAtURL:url options:0 error:NULL byAccessor:^(NSURL *newURL) {
+		[kTestText3 writeToURL:newURL atomically:YES encoding:NSUTF8StringEncoding error:NULL];
+	}];
+	
+	XCTAssertTrue([document beginContentAccess], @"Waking up failed");
+	XCTAssertEqualObjects(document.text, kTestText3, @"External changes should be read");
+	[document endContentAccess];
+	
+	[document close];
+}
+
+- (void)testReadOnlySnapshot
+{
+	NSURL *url = [self createTestDocument];
+	
+	ULTestDocument *document = [[ULTestDocument alloc] initWithFileURL:url readOnly:NO];
+	BOOL success = [self ul_performOperation:^(void (^handler)(BOOL)) {
+		[document openWithCompletionHandler: handler];
+	}];
+	XCTAssertTrue(success, @"Opening failed");
+	
+	document.text = kTestText2;
+	break_undo_coalesing();
+	
+	
+	// Snapshots contain unsaved changes without reading from disk
+	__block ULTestDocument *snapshot;
+	success = [self ul_performOperation:^(void (^handler)(BOOL)) {
+		[document makeReadOnlySnapshotWithCompletionHandler:^(id newSnapshot) {
+			snapshot = newSnapshot;
+			handler(newSnapshot != nil);
+		}];
+	}];
+	XCTAssertTrue(success, @"Snapshot failed");
+	
+	XCTAssertTrue(snapshot.isReadOnly, @"Snapshot should be read-only");
+	XCTAssertTrue(snapshot.documentIsOpen, @"Snapshot should be open");
+	XCTAssertFalse(snapshot.hasUnsavedChanges, @"Snapshot should not have changes");
+	XCTAssertEqualObjects(snapshot.text, kTestText2, @"Snapshot should contain unsaved changes");
+	XCTAssertEqualObjects(snapshot.changeToken, document.changeToken, @"Snapshot should have the change token of the document");
+	XCTAssertEqual(snapshot.readCount, 0, @"Snapshot should not be read from disk");
+	
+	
+	// Later changes do not affect the snapshot
+	document.text = kTestText3;
+	break_undo_coalesing();
+	
+	XCTAssertEqualObjects(snapshot.text, kTestText2, @"Snapshot should be immutable");
+	XCTAssertNotEqualObjects(snapshot.changeToken, document.changeToken, @"Change tokens should differ");
+	
+	[document close];
+}
+
+- (void)testSiblingPrefetching
+{
+	NSURL *directoryURL = self.ul_newTemporarySubdirectory;
+	NSMutableArray *urls = [NSMutableArray new];
+	
+	for (NSUInteger index = 0; index < 6; index ++) {
+		NSURL *url = [directoryURL URLByAppendingPathComponent: [NSString stringWithFormat: @"sheet%lu.txt", index]];
+		[kTestText1 writeToURL:url atomically:NO encoding:NSUTF8StringEncoding error:NULL];
+		[urls addObject: url];
+	}
+	
+	// Other file types are not predicted
+	[kTestText1 writeToURL:[directoryURL URLByAppendingPathComponent: @"sheet1.md"] atomically:NO encoding:NSUTF8StringEncoding error:NULL];
+	
+	[ULDocument setSiblingPrefetchCount: 2];
+	[ULDocument setReadAheadCacheLimit: 1024 * 1024];
+	
+	ULTestDocument *(^openDocument)(NSURL *) = ^(NSURL *url) {
+		ULTestDocument *document = [[ULTestDocument alloc] initWithFileURL:url readOnly:NO];
+		BOOL success = [self ul_performOperation:^(void (^handler)(BOOL)) {
+			[document openWithCompletionHandler: handler];
+		}];
+		XCTAssertTrue(success, @"Opening failed");
+		
+		return document;
+	};
+	
+	
+	// The first open cannot be predicted, but warms the following siblings
+	ULTestDocument *document = openDocument(urls[1]);
+	ULWaitOnAssertion(ULDocument.prefetchStatistics.prefetchedCount == 2, @"Siblings should be prefetched");
+	
+	ULDocumentPrefetchStatistics statistics = ULDocument.prefetchStatistics;
+	XCTAssertEqual(statistics.missCount, (NSUInteger)1, @"First open should be a miss");
+	XCTAssertEqual(statistics.hitCount, (NSUInteger)0, @"First open should be a miss");
+	XCTAssertEqual(statistics.prefetchedBytes, (unsigned long long)(2 * [kTestText1 lengthOfBytesUsingEncoding: NSUTF8StringEncoding]), @"Both siblings should be advised");
+	[document close];
+	
+	
+	// The next sibling uses the contents read ahead of time
+	document = openDocument(urls[2]);
+	XCTAssertEqualObjects(document.text, kTestText1, @"Contents read ahead should be used");
+	XCTAssertFalse(document.hasUnsavedChanges, @"Document read ahead should be clean");
+	XCTAssertEqualObjects(document.changeToken, [document.class changeTokenForItemAtURL: urls[2]], @"Document read ahead should describe the file");
+	
+	statistics = ULDocument.prefetchStatistics;
+	XCTAssertEqual(statistics.hitCount, (NSUInteger)1, @"Prefetched sibling should be a hit");
+	XCTAssertEqual(statistics.readAheadHitCount, (NSUInteger)1, @"Contents read ahead should be used");
+	
+	// Only the sibling not prefetched before is added
+	ULWaitOnAssertion(ULDocument.prefetchStatistics.prefetchedCount == 3, @"Next sibling should be prefetched");
+	[document close];
+	
+	
+	// Contents read ahead of changed files are not used
+	[kTestText2 writeToURL:urls[3] atomically:NO encoding:NSUTF8StringEncoding error:NULL];
+	[urls[3] setResourceValue:[NSDate dateWithTimeIntervalSinceNow: -3600] forKey:NSURLContentModificationDateKey error:NULL];
+	
+	document = openDocument(urls[3]);
+	XCTAssertEqualObjects(document.text, kTestText2, @"Changed contents should be read");
+	
+	statistics = ULDocument.prefetchStatistics;
+	XCTAssertEqual(statistics.hitCount, (NSUInteger)2, @"Prefetched sibling should be a hit");
+	XCTAssertEqual(statistics.readAheadHitCount, (NSUInteger)1, @"Stale contents read ahead should not be used");
+	XCTAssertEqual(statistics.wastedBytes, (unsigned long long)0, @"No prefetched sibling should have been dropped");
+	[document close];
+}
+
 - (void)testReadOnlyInstance
 {
 	NSURL *url = [self createTestDocument];
@@ -1648,6 +2753,52 @@ NSString *kTestText3	= @"Fusce tincidunt erat sit amet magna porttitor nec iacul
 	[document close];
 }
 
+- (void)testStagingDirectoryReuse
+{
+	ULStagingDirectoryPool *pool = [ULStagingDirectoryPool new];
+	NSURL *url = [self createTestDocument];
+	
+	// Concurrent saves use distinct directories on the volume of the document
+	NSURL *directoryURL = [pool acquireDirectoryForItemAtURL:url error:NULL];
+	NSURL *otherDirectoryURL = [pool acquireDirectoryForItemAtURL:url error:NULL];
+	
+	XCTAssertNotNil(directoryURL, @"Staging directory missing");
+	XCTAssertNotEqualObjects(directoryURL, otherDirectoryURL, @"Staging directories should not be shared");
+	XCTAssertTrue([directoryURL checkResourceIsReachableAndReturnError: NULL], @"Staging directory should exist");
+	
+	NSNumber *documentVolume, *directoryVolume;
+	[url getResourceValue:&documentVolume forKey:NSURLVolumeIdentifierKey error:NULL];
+	[directoryURL getResourceValue:&directoryVolume forKey:NSURLVolumeIdentifierKey error:NULL];
+	XCTAssertEqualObjects(documentVolume, directoryVolume, @"Staging directory should be on the volume of the document");
+	
+	// Empty directories are reused
+	[pool relinquishDirectory:directoryURL isEmpty:YES];
+	XCTAssertEqualObjects([pool acquireDirectoryForItemAtURL:url error:NULL], directoryURL, @"Staging directory should be reused");
+	
+	// Directories with contents are removed lazily instead
+	[@"leftover" writeToURL:[otherDirectoryURL URLByAppendingPathComponent: @"leftover.txt"] atomically:NO encoding:NSUTF8StringEncoding error:NULL];
+	[pool relinquishDirectory:otherDirectoryURL isEmpty:NO];
+	
+	ULWaitOnAssertion(![otherDirectoryURL checkResourceIsReachableAndReturnError: NULL], @"Staging directory should be removed");
+	XCTAssertNotEqualObjects([pool acquireDirectoryForItemAtURL:url error:NULL], otherDirectoryURL, @"Removed staging directory should not be reused");
+	
+	// Pooled directories removed by the system are replaced
+	[pool relinquishDirectory:directoryURL isEmpty:YES];
+	[NSFileManager.defaultManager removeItemAtURL:directoryURL error:NULL];
+	
+	NSURL *replacedDirectoryURL = [pool acquireDirectoryForItemAtURL:url error:NULL];
+	XCTAssertNotEqualObjects(replacedDirectoryURL, directoryURL, @"Missing staging directory should not be reused");
+	XCTAssertTrue([replacedDirectoryURL checkResourceIsReachableAndReturnError: NULL], @"Staging directory should exist");
+	
+	// Identifiers are unique
+	NSMutableSet *identifiers = [NSMutableSet new];
+	
+	for (NSUInteger index = 0; index < 1000; index ++)
+		[identifiers addObject: NSString.ul_newSequentialIdentifier];
+	
+	XCTAssertEqual(identifiers.count, (NSUInteger)1000, @"Identifiers should be unique");
+}
+
 - (void)testVersionAutocreation
 {
 	// Short autoversioning interval for this test